@@ -12,6 +12,7 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,6 +21,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <linux/types.h>
@@ -46,16 +48,339 @@ static char *addr_to_dotted(unsigned int addr)
 	return buf;
 }
 
+static char *addr6_to_string(const struct in6_addr *addr)
+{
+	static char buf[INET6_ADDRSTRLEN + 3];
+
+	inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN);
+	strcat(buf, "/64");
+	return buf;
+}
+
+static const char *const proto_names[ACCOUNT_PROTO_MAX] = {
+	[ACCOUNT_PROTO_TCP]   = "TCP",
+	[ACCOUNT_PROTO_UDP]   = "UDP",
+	[ACCOUNT_PROTO_OTHER] = "other",
+};
+
+/* Field names of the protocols in the line protocol */
+static const char *const proto_keys[ACCOUNT_PROTO_MAX] = {
+	[ACCOUNT_PROTO_TCP]   = "tcp",
+	[ACCOUNT_PROTO_UDP]   = "udp",
+	[ACCOUNT_PROTO_OTHER] = "other",
+};
+
+static void show_csv_header(const struct ipt_ACCOUNT_context *ctx)
+{
+	unsigned int p;
+
+	printf("IP;SRC packets;SRC bytes;DST packets;DST bytes");
+	if (ctx->handle.flags & ACCOUNT_F_PROTO)
+		for (p = 0; p < ACCOUNT_PROTO_MAX; p++)
+			printf(";%s SRC packets;%s SRC bytes;%s DST packets;%s DST bytes",
+			       proto_names[p], proto_names[p],
+			       proto_names[p], proto_names[p]);
+	printf("\n");
+}
+
+/* @counters are src_packets, src_bytes, dst_packets and dst_bytes of
+   either kind of entry */
+static void show_entry(const struct ipt_ACCOUNT_context *ctx,
+                       const char *addr, const uint64_t *counters,
+                       const void *entry, bool csv)
+{
+	const struct ipt_acc_handle_proto *proto =
+		ipt_ACCOUNT_get_proto(ctx, entry);
+	unsigned int p;
+
+	if (csv)
+		printf("%s;%llu;%llu;%llu;%llu", addr,
+		       (unsigned long long)counters[0],
+		       (unsigned long long)counters[1],
+		       (unsigned long long)counters[2],
+		       (unsigned long long)counters[3]);
+	else
+		printf("IP: %s SRC packets: %llu bytes: %llu DST packets: %llu bytes: %llu",
+		       addr,
+		       (unsigned long long)counters[0],
+		       (unsigned long long)counters[1],
+		       (unsigned long long)counters[2],
+		       (unsigned long long)counters[3]);
+
+	for (p = 0; proto != NULL && p < ACCOUNT_PROTO_MAX; p++) {
+		if (csv)
+			printf(";%llu;%llu;%llu;%llu",
+			       (unsigned long long)proto[p].src_packets,
+			       (unsigned long long)proto[p].src_bytes,
+			       (unsigned long long)proto[p].dst_packets,
+			       (unsigned long long)proto[p].dst_bytes);
+		else
+			printf("\n    %s SRC packets: %llu bytes: %llu DST packets: %llu bytes: %llu",
+			       proto_names[p],
+			       (unsigned long long)proto[p].src_packets,
+			       (unsigned long long)proto[p].src_bytes,
+			       (unsigned long long)proto[p].dst_packets,
+			       (unsigned long long)proto[p].dst_bytes);
+	}
+	printf("\n");
+}
+
+/*
+ * Collector mode (-i) reads a table over netlink at fixed intervals and
+ * writes every run to a file or pipe, either in the line protocol of
+ * InfluxDB or as binary records (-b). A binary run is a struct
+ * collect_run followed by its entries, in the format of the kernel.
+ */
+#define COLLECT_MAGIC   "IACC"
+#define COLLECT_VERSION 1
+#define NSEC_PER_SEC    1000000000ULL
+
+/**
+ * Header of a run in binary output, in host byte order
+ * @timestamp:	start of the read, in ns since the epoch
+ * @missed:	pool counters of the table, see struct ipt_acc_snapshot
+ * @refill_failed: ditto
+ * @itemcount:	number of entries that follow
+ * @entry_size:	size of each entry, including the protocol split
+ */
+struct collect_run {
+	char magic[4];
+	uint32_t version;
+	uint64_t timestamp;
+	uint64_t missed;
+	uint64_t refill_failed;
+	uint32_t itemcount;
+	uint32_t entry_size;
+	uint8_t family;
+	uint8_t flags;
+	uint8_t __pad0[6];
+};
+
+/**
+ * @interval:	time between the starts of two runs, in ns
+ * @generation:	for reading only the changes (-d)
+ * @buf:	receives the netlink dump, batch by batch
+ * @tag:	table name, escaped for the line protocol
+ * @overruns:	intervals skipped because a run took too long
+ * @failed:	runs whose read failed, which left their interval out
+ * @read_*:	time the runs took, in ns
+ */
+struct collector {
+	FILE *out;
+	bool binary, timing, flush, changed;
+	uint64_t interval;
+	uint32_t generation;
+	char buf[IPT_ACCOUNT_NL_BUFSIZE];
+	char tag[2 * ACCOUNT_TABLE_NAME_LEN];
+	unsigned int runs, overruns, failed;
+	uint64_t read_min, read_max, read_sum;
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Tag values of the line protocol need commas, spaces and equal signs
+   escaped */
+static void escape_tag(char *buf, const char *s)
+{
+	for (; *s != '\0'; ++s) {
+		if (*s == ',' || *s == ' ' || *s == '=')
+			*buf++ = '\\';
+		*buf++ = *s;
+	}
+	*buf = '\0';
+}
+
+static void collect_entry(const struct collector *c,
+                          const struct ipt_ACCOUNT_context *ctx,
+                          const char *addr, const uint64_t counters[4],
+                          const void *entry, uint64_t timestamp)
+{
+	const struct ipt_acc_handle_proto *proto;
+	unsigned int p;
+
+	fprintf(c->out, "account,table=%s,ip=%s src_packets=%llui,"
+	        "src_bytes=%llui,dst_packets=%llui,dst_bytes=%llui",
+	        c->tag, addr,
+	        (unsigned long long)counters[0],
+	        (unsigned long long)counters[1],
+	        (unsigned long long)counters[2],
+	        (unsigned long long)counters[3]);
+	proto = ipt_ACCOUNT_get_proto(ctx, entry);
+	for (p = 0; proto != NULL && p < ACCOUNT_PROTO_MAX; p++)
+		fprintf(c->out, ",%s_src_packets=%llui,%s_src_bytes=%llui,"
+		        "%s_dst_packets=%llui,%s_dst_bytes=%llui",
+		        proto_keys[p], (unsigned long long)proto[p].src_packets,
+		        proto_keys[p], (unsigned long long)proto[p].src_bytes,
+		        proto_keys[p], (unsigned long long)proto[p].dst_packets,
+		        proto_keys[p], (unsigned long long)proto[p].dst_bytes);
+	fprintf(c->out, " %llu\n", (unsigned long long)timestamp);
+}
+
+/* Write a batch of entries in the line protocol */
+static void collect_batch(const struct collector *c,
+                          const struct ipt_ACCOUNT_context *ctx,
+                          const char *entries, int count, uint64_t timestamp)
+{
+	const struct ipt_acc_handle_ip6 *entry6;
+	const struct ipt_acc_handle_ip *entry;
+	uint64_t counters[4];
+	const char *addr;
+
+	for (; count > 0; --count, entries += ctx->handle.entry_size) {
+		if (ctx->handle.family == AF_INET6) {
+			entry6 = (const void *)entries;
+			addr = addr6_to_string(&entry6->ip);
+			counters[0] = entry6->src_packets;
+			counters[1] = entry6->src_bytes;
+			counters[2] = entry6->dst_packets;
+			counters[3] = entry6->dst_bytes;
+		} else {
+			entry = (const void *)entries;
+			addr = addr_to_dotted(entry->ip);
+			counters[0] = entry->src_packets;
+			counters[1] = entry->src_bytes;
+			counters[2] = entry->dst_packets;
+			counters[3] = entry->dst_bytes;
+		}
+		collect_entry(c, ctx, addr, counters, entries, timestamp);
+	}
+}
+
+/* Read the table once and write it out. The context keeps its netlink
+   socket from one run to the next, and the buffer is ours. Returns -1 if
+   the read failed, which only costs this run, and -2 if the output can't
+   go on */
+static int collect_run(struct collector *c, struct ipt_ACCOUNT_context *ctx,
+                       const char *table)
+{
+	uint64_t timestamp = clock_ns(CLOCK_REALTIME);
+	uint64_t start = clock_ns(CLOCK_MONOTONIC), took;
+	struct collect_run run;
+	const void *entries;
+	unsigned int n = 0;
+	int count;
+
+	if (ipt_ACCOUNT_dump_start(ctx, table, !c->flush,
+	    c->changed ? &c->generation : NULL, c->buf, sizeof(c->buf)) != 0)
+		return -1;
+
+	if (c->binary) {
+		memset(&run, 0, sizeof(run));
+		memcpy(run.magic, COLLECT_MAGIC, sizeof(run.magic));
+		run.version       = COLLECT_VERSION;
+		run.timestamp     = timestamp;
+		run.missed        = ctx->missed;
+		run.refill_failed = ctx->refill_failed;
+		run.itemcount     = ctx->handle.itemcount;
+		run.entry_size    = ctx->handle.entry_size;
+		run.family        = ctx->handle.family;
+		run.flags         = ctx->handle.flags;
+		fwrite(&run, sizeof(run), 1, c->out);
+	} else {
+		fprintf(c->out, "account_pool,table=%s missed=%llui,"
+		        "refill_failed=%llui %llu\n", c->tag,
+		        (unsigned long long)ctx->missed,
+		        (unsigned long long)ctx->refill_failed,
+		        (unsigned long long)timestamp);
+	}
+
+	// Binary output takes the entries just as they come
+	while ((count = ipt_ACCOUNT_next_batch(ctx, &entries)) > 0) {
+		if (c->binary)
+			fwrite(entries, ctx->handle.entry_size, count, c->out);
+		else
+			collect_batch(c, ctx, entries, count, timestamp);
+		n += count;
+	}
+	if (count == 0 && n != ctx->handle.itemcount) {
+		ctx->error_str = "Netlink dump ended early";
+		count = -1;
+	}
+	if (fflush(c->out) != 0) {
+		ctx->error_str = strerror(errno);
+		return -2;
+	}
+	// Lines stand on their own, but a record promised itemcount entries
+	if (count < 0)
+		return c->binary ? -2 : -1;
+
+	took = clock_ns(CLOCK_MONOTONIC) - start;
+	if (c->runs == 0 || took < c->read_min)
+		c->read_min = took;
+	if (took > c->read_max)
+		c->read_max = took;
+	c->read_sum += took;
+	if (c->timing)
+		fprintf(stderr, "Run #%u - %u %s in %.3f ms\n", c->runs, n,
+		        n == 1 ? "item" : "items", took / 1e6);
+	++c->runs;
+	return 0;
+}
+
+/* Run at fixed deadlines from the start, so that the time a run takes does
+   not add up. A run longer than the interval skips the deadlines it
+   missed, keeping the phase */
+static int collect(struct collector *c, struct ipt_ACCOUNT_context *ctx,
+                   const char *table)
+{
+	uint64_t deadline = clock_ns(CLOCK_MONOTONIC), now, skipped;
+	struct timespec ts;
+	int ret;
+
+	while (!exit_now) {
+		// The table may be gone for a while, or the read interrupted
+		ret = collect_run(c, ctx, table);
+		if (ret == -2)
+			return -1;
+		if (ret < 0) {
+			fprintf(stderr, "Read failed, interval skipped: %s\n",
+			        ctx->error_str);
+			++c->failed;
+		}
+
+		deadline += c->interval;
+		now = clock_ns(CLOCK_MONOTONIC);
+		if (now >= deadline) {
+			skipped = (now - deadline) / c->interval + 1;
+			c->overruns += skipped;
+			deadline += skipped * c->interval;
+		}
+		ts.tv_sec  = deadline / NSEC_PER_SEC;
+		ts.tv_nsec = deadline % NSEC_PER_SEC;
+		while (!exit_now && clock_nanosleep(CLOCK_MONOTONIC,
+		       TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+	return 0;
+}
+
+static void show_banner(FILE *fp)
+{
+	fprintf(fp, "\nlibxt_ACCOUNT_cl userspace accounting tool v%s\n\n",
+	        LIBXT_ACCOUNT_VERSION);
+}
+
 static void show_usage(void)
 {
-	printf("Unknown command line option. Try: [-u] [-h] [-a] [-f] [-c] [-s] [-l name]\n");
+	printf("Unknown command line option. Try: [-u] [-h] [-a] [-f] [-c] [-d] [-s] [-l name]\n");
 	printf("[-u] show kernel handle usage\n");
 	printf("[-h] free all kernel handles (experts only!)\n\n");
 	printf("[-a] list all table names\n");
 	printf("[-l name] show data in table <name>\n");
 	printf("[-f] flush data after showing\n");
 	printf("[-c] loop every second (abort with CTRL+C)\n");
+	printf("[-d] with -c, only show IPs that changed since the last run\n");
 	printf("[-s] CSV output (for spreadsheet import)\n");
+	printf("[-i secs] collector mode: read every secs seconds over netlink\n");
+	printf("[-o file] with -i, write to file instead of stdout\n");
+	printf("[-b] with -i, binary output instead of line protocol\n");
+	printf("[-t] with -i, report how long each read took on stderr\n");
 	printf("\n");
 }
 
@@ -63,24 +388,32 @@ int main(int argc, char *argv[])
 {
 	struct ipt_ACCOUNT_context ctx;
 	struct ipt_acc_handle_ip *entry;
+	struct ipt_acc_handle_ip6 *entry6;
 	int i;
 	int optchar;
 	bool doHandleUsage = false, doHandleFree = false, doTableNames = false;
 	bool doFlush = false, doContinue = false, doCSV = false;
+	bool doChanged = false;
+	uint32_t generation = 0;
+	struct collector coll;
+	double interval = 0;
+	const char *out_name = NULL;
+	// Collector output may go to stdout, so tell the rest elsewhere
+	FILE *info = stdout;
 
 	char *table_name = NULL;
 	const char *name;
 
-	printf("\nlibxt_ACCOUNT_cl userspace accounting tool v%s\n\n",
-	LIBXT_ACCOUNT_VERSION);
+	memset(&coll, 0, sizeof(coll));
 
 	if (argc == 1)
 	{
+		show_banner(stdout);
 		show_usage();
 		exit(0);
 	}
 
-	while ((optchar = getopt(argc, argv, "uhacfsl:")) != -1)
+	while ((optchar = getopt(argc, argv, "uhacdfsl:i:o:bt")) != -1)
 	{
 		switch (optchar)
 		{
@@ -99,20 +432,45 @@ int main(int argc, char *argv[])
 		case 'c':
 			doContinue = true;
 			break;
+		case 'd':
+			doChanged = true;
+			break;
 		case 's':
 			doCSV = true;
 			break;
 		case 'l':
 			table_name = strdup(optarg);
 			break;
+		case 'i':
+			interval = strtod(optarg, NULL);
+			if (interval <= 0)
+			{
+				fprintf(stderr, "Invalid interval: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		case 'b':
+			coll.binary = true;
+			break;
+		case 't':
+			coll.timing = true;
+			break;
 		case '?':
 		default:
+			show_banner(stdout);
 			show_usage();
 			exit(0);
 			break;
 		}
 	}
 
+	if (interval > 0)
+		info = stderr;
+	show_banner(info);
+
 	// install exit handler
 	if (signal(SIGTERM, sig_term) == SIG_ERR)
 	{
@@ -173,47 +531,79 @@ int main(int argc, char *argv[])
 			printf("Found table: %s\n", name);
 	}
 
-	if (table_name)
+	if (table_name && interval > 0)
+	{
+		coll.out = stdout;
+		if (out_name != NULL && (coll.out = fopen(out_name, "a")) == NULL)
+		{
+			fprintf(stderr, "Can't open %s: %s\n", out_name,
+			        strerror(errno));
+			ipt_ACCOUNT_deinit(&ctx);
+			return EXIT_FAILURE;
+		}
+		// Write errors on a closed pipe are reported, not fatal
+		signal(SIGPIPE, SIG_IGN);
+		setvbuf(coll.out, NULL, _IOFBF, 1 << 20);
+		coll.interval = interval * NSEC_PER_SEC;
+		if (coll.interval == 0)
+			coll.interval = 1;
+		coll.flush = doFlush;
+		coll.changed = doChanged && !doFlush;
+		escape_tag(coll.tag, table_name);
+
+		fprintf(info, "Collecting table: %s every %g s\n", table_name,
+		        interval);
+		if (collect(&coll, &ctx, table_name) != 0)
+		{
+			fprintf(stderr, "Collecting failed: %s\n", ctx.error_str);
+			ipt_ACCOUNT_deinit(&ctx);
+			return EXIT_FAILURE;
+		}
+		if (coll.runs > 0)
+			fprintf(info, "%u runs, %u intervals overrun, %u failed, "
+			        "read time min/avg/max %.3f/%.3f/%.3f ms\n",
+			        coll.runs, coll.overruns, coll.failed,
+			        coll.read_min / 1e6,
+			        coll.read_sum / 1e6 / coll.runs,
+			        coll.read_max / 1e6);
+		else if (coll.failed > 0)
+			fprintf(info, "%u runs failed\n", coll.failed);
+		if (coll.out != stdout)
+			fclose(coll.out);
+	}
+	else if (table_name)
 	{
 		// Read out data
-		if (doCSV)
-			printf("IP;SRC packets;SRC bytes;DST packets;DST bytes\n");
-		else
+		if (!doCSV)
 			printf("Showing table: %s\n", table_name);
 
 		i = 0;
 		while (!exit_now)
 		{
 			// Get entries from table test
-			if (ipt_ACCOUNT_read_entries(&ctx, table_name, !doFlush))
+			if (doChanged && !doFlush ?
+			    ipt_ACCOUNT_read_changed(&ctx, table_name, &generation) :
+			    ipt_ACCOUNT_read_entries(&ctx, table_name, !doFlush))
 			{
 				printf("Read failed: %s\n", ctx.error_str);
 				ipt_ACCOUNT_deinit(&ctx);
 				return EXIT_FAILURE;
 			}
 
+			// The columns depend on the table
+			if (doCSV && i == 0)
+				show_csv_header(&ctx);
 			if (!doCSV)
 				printf("Run #%d - %u %s found\n", i, ctx.handle.itemcount,
 				       ctx.handle.itemcount == 1 ? "item" : "items");
 
 			// Output and free entries
 			while ((entry = ipt_ACCOUNT_get_next_entry(&ctx)) != NULL)
-			{
-				if (doCSV)
-					printf("%s;%llu;%llu;%llu;%llu\n",
-					       addr_to_dotted(entry->ip),
-					       (unsigned long long)entry->src_packets,
-					       (unsigned long long)entry->src_bytes,
-					       (unsigned long long)entry->dst_packets,
-					       (unsigned long long)entry->dst_bytes);
-				else
-					printf("IP: %s SRC packets: %llu bytes: %llu DST packets: %llu bytes: %llu\n",
-					       addr_to_dotted(entry->ip),
-					       (unsigned long long)entry->src_packets,
-					       (unsigned long long)entry->src_bytes,
-					       (unsigned long long)entry->dst_packets,
-					       (unsigned long long)entry->dst_bytes);
-			}
+				show_entry(&ctx, addr_to_dotted(entry->ip),
+				           &entry->src_packets, entry, doCSV);
+			while ((entry6 = ipt_ACCOUNT_get_next_entry6(&ctx)) != NULL)
+				show_entry(&ctx, addr6_to_string(&entry6->ip),
+				           &entry6->src_packets, entry6, doCSV);
 
 			if (doContinue)
 			{
@@ -224,7 +614,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	printf("Finished.\n");
+	fprintf(info, "Finished.\n");
 	ipt_ACCOUNT_deinit(&ctx);
 	return EXIT_SUCCESS;
 }
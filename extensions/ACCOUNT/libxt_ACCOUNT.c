@@ -20,6 +20,14 @@ static struct option account_tg_opts[] = {
 	{NULL},
 };
 
+/* Revision 2 only; revision 1 has no room for flags */
+static struct option account_tg_opts_v2[] = {
+	{.name = "addr",  .has_arg = true, .val = 'a'},
+	{.name = "tname", .has_arg = true, .val = 't'},
+	{.name = "proto-split", .has_arg = false, .val = 'p'},
+	{NULL},
+};
+
 /* Function which prints out usage message. */
 static void account_tg_help(void)
 {
@@ -30,6 +38,19 @@ static void account_tg_help(void)
 account_tg_opts[0].name, account_tg_opts[1].name);
 }
 
+static void account_tg_help_v2(void)
+{
+	printf(
+"ACCOUNT target options:\n"
+" --%s ip/prefix\t\tBase network IP and prefix length used for this\n"
+"\t\t\t\ttable; IPv6 is accounted per /64\n"
+" --%s name\t\t\tTable name for the userspace library\n"
+" --%s\t\t\tAlso count TCP, UDP and other protocols\n"
+"\t\t\t\tseparately\n",
+account_tg_opts_v2[0].name, account_tg_opts_v2[1].name,
+account_tg_opts_v2[2].name);
+}
+
 /* Initialize the target. */
 static void
 account_tg_init(struct xt_entry_target *t)
@@ -39,8 +60,17 @@ account_tg_init(struct xt_entry_target *t)
 	accountinfo->table_nr = -1;
 }
 
+static void
+account_tg_init_v2(struct xt_entry_target *t)
+{
+	struct ipt_acc_info_v2 *accountinfo = (void *)t->data;
+
+	accountinfo->table_nr = -1;
+}
+
 #define IPT_ACCOUNT_OPT_ADDR 0x01
 #define IPT_ACCOUNT_OPT_TABLE 0x02
+#define IPT_ACCOUNT_OPT_PROTO 0x04
 
 /* Function which parses command options; returns true if it
    ate an option */
@@ -79,6 +109,11 @@ static int account_tg_parse(int c, char **argv, int invert, unsigned int *flags,
 				"Maximum table name length %u for --%s",
 				ACCOUNT_TABLE_NAME_LEN - 1,
 				account_tg_opts[1].name);
+		/* It also names the snapshot file in /proc/net/xt_ACCOUNT */
+		if (strchr(optarg, '/') != NULL)
+			xtables_error(PARAMETER_PROBLEM,
+				"--%s must not contain \"/\"",
+				account_tg_opts[1].name);
 
 		strcpy(accountinfo->table_name, optarg);
 		*flags |= IPT_ACCOUNT_OPT_TABLE;
@@ -90,6 +125,121 @@ static int account_tg_parse(int c, char **argv, int invert, unsigned int *flags,
 	return 1;
 }
 
+/* Parse "ip[/prefix]"; only numeric addresses make sense for a network */
+static void account_tg_parse_addr(struct ipt_acc_info_v2 *info,
+		const char *arg, uint8_t family)
+{
+	unsigned int max = (family == NFPROTO_IPV6) ? 64 : 32;
+	unsigned int prefix = max;
+	const char *slash = strchr(arg, '/');
+	size_t len = (slash != NULL) ? slash - arg : strlen(arg);
+	char buf[INET6_ADDRSTRLEN];
+	const struct in6_addr *ip6;
+	const struct in_addr *ip;
+	unsigned int i;
+
+	if (len >= sizeof(buf))
+		xtables_error(PARAMETER_PROBLEM, "Bad --%s \"%s\"",
+			account_tg_opts_v2[0].name, arg);
+	memcpy(buf, arg, len);
+	buf[len] = '\0';
+	if (slash != NULL && !xtables_strtoui(slash + 1, NULL, &prefix, 0, max))
+		xtables_error(PARAMETER_PROBLEM,
+			"Bad prefix length \"%s\", must be 0-%u", slash + 1, max);
+
+	memset(&info->net_ip, 0, sizeof(info->net_ip));
+	if (family == NFPROTO_IPV6) {
+		ip6 = xtables_numeric_to_ip6addr(buf);
+		if (ip6 == NULL)
+			xtables_error(PARAMETER_PROBLEM,
+				"Bad IPv6 address \"%s\"", buf);
+		info->net_ip.in6 = *ip6;
+		/* Keep only the network, so that it is saved as given */
+		for (i = 0; i < 16; ++i)
+			if (prefix <= 8 * i)
+				info->net_ip.in6.s6_addr[i] = 0;
+			else if (prefix < 8 * (i + 1))
+				info->net_ip.in6.s6_addr[i] &=
+					0xFF << (8 * (i + 1) - prefix);
+	} else {
+		ip = xtables_numeric_to_ipaddr(buf);
+		if (ip == NULL)
+			xtables_error(PARAMETER_PROBLEM,
+				"Bad IPv4 address \"%s\"", buf);
+		info->net_ip.in = *ip;
+		info->net_ip.in.s_addr &=
+			htonl(prefix ? ~0U << (32 - prefix) : 0);
+	}
+	info->net_prefix = prefix;
+}
+
+static int account_tg_parse_v2(int c, char **argv, int invert,
+		unsigned int *flags, struct xt_entry_target **target,
+		uint8_t family)
+{
+	struct ipt_acc_info_v2 *accountinfo = (void *)(*target)->data;
+
+	switch (c) {
+	case 'a':
+		if (*flags & IPT_ACCOUNT_OPT_ADDR)
+			xtables_error(PARAMETER_PROBLEM, "Can't specify --%s twice",
+				account_tg_opts_v2[0].name);
+		account_tg_parse_addr(accountinfo, optarg, family);
+		*flags |= IPT_ACCOUNT_OPT_ADDR;
+		break;
+
+	case 't':
+		if (*flags & IPT_ACCOUNT_OPT_TABLE)
+			xtables_error(PARAMETER_PROBLEM,
+				"Can't specify --%s twice",
+				account_tg_opts_v2[1].name);
+
+		if (strlen(optarg) > ACCOUNT_TABLE_NAME_LEN - 1)
+			xtables_error(PARAMETER_PROBLEM,
+				"Maximum table name length %u for --%s",
+				ACCOUNT_TABLE_NAME_LEN - 1,
+				account_tg_opts_v2[1].name);
+		/* It also names the snapshot file in /proc/net/xt_ACCOUNT */
+		if (strchr(optarg, '/') != NULL)
+			xtables_error(PARAMETER_PROBLEM,
+				"--%s must not contain \"/\"",
+				account_tg_opts_v2[1].name);
+
+		strcpy(accountinfo->table_name, optarg);
+		*flags |= IPT_ACCOUNT_OPT_TABLE;
+		break;
+
+	case 'p':
+		if (*flags & IPT_ACCOUNT_OPT_PROTO)
+			xtables_error(PARAMETER_PROBLEM,
+				"Can't specify --%s twice",
+				account_tg_opts_v2[2].name);
+		accountinfo->flags |= ACCOUNT_F_PROTO;
+		*flags |= IPT_ACCOUNT_OPT_PROTO;
+		break;
+
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static int account_tg_parse4_v2(int c, char **argv, int invert,
+		unsigned int *flags, const void *entry,
+		struct xt_entry_target **target)
+{
+	return account_tg_parse_v2(c, argv, invert, flags, target,
+	       NFPROTO_IPV4);
+}
+
+static int account_tg_parse6_v2(int c, char **argv, int invert,
+		unsigned int *flags, const void *entry,
+		struct xt_entry_target **target)
+{
+	return account_tg_parse_v2(c, argv, invert, flags, target,
+	       NFPROTO_IPV6);
+}
+
 static void account_tg_check(unsigned int flags)
 {
 	if (!(flags & IPT_ACCOUNT_OPT_ADDR) || !(flags & IPT_ACCOUNT_OPT_TABLE))
@@ -140,23 +290,105 @@ account_tg_save(const void *ip, const struct xt_entry_target *target)
 	account_tg_print_it(ip, target, true);
 }
 
-static struct xtables_target account_tg_reg = {
-	.name          = "ACCOUNT",
-	.revision      = 1,
-	.family        = NFPROTO_IPV4,
-	.version       = XTABLES_VERSION,
-	.size          = XT_ALIGN(sizeof(struct ipt_acc_info)),
-	.userspacesize = offsetof(struct ipt_acc_info, table_nr),
-	.help          = account_tg_help,
-	.init          = account_tg_init,
-	.parse         = account_tg_parse,
-	.final_check   = account_tg_check,
-	.print         = account_tg_print,
-	.save          = account_tg_save,
-	.extra_opts    = account_tg_opts,
+static void account_tg_print_it_v2(const struct xt_entry_target *target,
+		bool do_prefix, uint8_t family)
+{
+	const struct ipt_acc_info_v2 *accountinfo = (const void *)target->data;
+
+	if (!do_prefix)
+		printf(" ACCOUNT ");
+	if (do_prefix)
+		printf(" --");
+	printf("%s ", account_tg_opts_v2[0].name);
+
+	if (family == NFPROTO_IPV6)
+		printf("%s", xtables_ip6addr_to_numeric(&accountinfo->net_ip.in6));
+	else
+		printf("%s", xtables_ipaddr_to_numeric(&accountinfo->net_ip.in));
+	printf("/%u ", accountinfo->net_prefix);
+
+	if (do_prefix)
+		printf(" --");
+	printf("%s %s", account_tg_opts_v2[1].name, accountinfo->table_name);
+
+	if (accountinfo->flags & ACCOUNT_F_PROTO)
+		printf(" %s%s", do_prefix ? "--" : "", account_tg_opts_v2[2].name);
+}
+
+static void account_tg_print4_v2(const void *ip,
+		const struct xt_entry_target *target, int numeric)
+{
+	account_tg_print_it_v2(target, false, NFPROTO_IPV4);
+}
+
+static void account_tg_print6_v2(const void *ip,
+		const struct xt_entry_target *target, int numeric)
+{
+	account_tg_print_it_v2(target, false, NFPROTO_IPV6);
+}
+
+static void account_tg_save4_v2(const void *ip,
+		const struct xt_entry_target *target)
+{
+	account_tg_print_it_v2(target, true, NFPROTO_IPV4);
+}
+
+static void account_tg_save6_v2(const void *ip,
+		const struct xt_entry_target *target)
+{
+	account_tg_print_it_v2(target, true, NFPROTO_IPV6);
+}
+
+static struct xtables_target account_tg_reg[] = {
+	{
+		.name          = "ACCOUNT",
+		.revision      = 1,
+		.family        = NFPROTO_IPV4,
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof(struct ipt_acc_info)),
+		.userspacesize = offsetof(struct ipt_acc_info, table_nr),
+		.help          = account_tg_help,
+		.init          = account_tg_init,
+		.parse         = account_tg_parse,
+		.final_check   = account_tg_check,
+		.print         = account_tg_print,
+		.save          = account_tg_save,
+		.extra_opts    = account_tg_opts,
+	},
+	{
+		.name          = "ACCOUNT",
+		.revision      = 2,
+		.family        = NFPROTO_IPV4,
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof(struct ipt_acc_info_v2)),
+		.userspacesize = offsetof(struct ipt_acc_info_v2, table_nr),
+		.help          = account_tg_help_v2,
+		.init          = account_tg_init_v2,
+		.parse         = account_tg_parse4_v2,
+		.final_check   = account_tg_check,
+		.print         = account_tg_print4_v2,
+		.save          = account_tg_save4_v2,
+		.extra_opts    = account_tg_opts_v2,
+	},
+	{
+		.name          = "ACCOUNT",
+		.revision      = 2,
+		.family        = NFPROTO_IPV6,
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof(struct ipt_acc_info_v2)),
+		.userspacesize = offsetof(struct ipt_acc_info_v2, table_nr),
+		.help          = account_tg_help_v2,
+		.init          = account_tg_init_v2,
+		.parse         = account_tg_parse6_v2,
+		.final_check   = account_tg_check,
+		.print         = account_tg_print6_v2,
+		.save          = account_tg_save6_v2,
+		.extra_opts    = account_tg_opts_v2,
+	},
 };
 
 static __attribute__((constructor)) void account_tg_ldr(void)
 {
-	xtables_register_target(&account_tg_reg);
+	xtables_register_targets(account_tg_reg,
+		sizeof(account_tg_reg) / sizeof(*account_tg_reg));
 }
@@ -10,12 +10,15 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <netinet/in.h>
 #include <linux/if.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
 
 #include <libxt_ACCOUNT_cl.h>
 
@@ -23,6 +26,7 @@ int ipt_ACCOUNT_init(struct ipt_ACCOUNT_context *ctx)
 {
 	memset(ctx, 0, sizeof(struct ipt_ACCOUNT_context));
 	ctx->handle.handle_nr = -1;
+	ctx->nl_sockfd = -1;
 
 	ctx->sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 	if (ctx->sockfd < 0) {
@@ -49,12 +53,14 @@ void ipt_ACCOUNT_free_entries(struct ipt_ACCOUNT_context *ctx)
 {
 	if (ctx->handle.handle_nr != -1) {
 		setsockopt(ctx->sockfd, IPPROTO_IP, IPT_SO_SET_ACCOUNT_HANDLE_FREE,
-		           &ctx->handle, sizeof(struct ipt_acc_handle_sockopt));
+		           &ctx->handle, IPT_ACC_HANDLE_SOCKOPT_V1_SIZE);
 		ctx->handle.handle_nr = -1;
 	}
 
 	ctx->handle.itemcount = 0;
 	ctx->pos = 0;
+	ctx->nl_entries = NULL;
+	ctx->nl_count = 0;
 }
 
 void ipt_ACCOUNT_deinit(struct ipt_ACCOUNT_context *ctx)
@@ -66,24 +72,30 @@ void ipt_ACCOUNT_deinit(struct ipt_ACCOUNT_context *ctx)
 
 	close(ctx->sockfd);
 	ctx->sockfd = -1;
+
+	if (ctx->nl_sockfd >= 0)
+		close(ctx->nl_sockfd);
+	ctx->nl_sockfd = -1;
+	ctx->nl_dumping = 0;
 }
 
-int ipt_ACCOUNT_read_entries(struct ipt_ACCOUNT_context *ctx,
-                             const char *table, char dont_flush)
+static int ipt_ACCOUNT_read(struct ipt_ACCOUNT_context *ctx,
+                            const char *table, int cmd, uint32_t generation)
 {
 	unsigned int s = sizeof(struct ipt_acc_handle_sockopt);
 	unsigned int new_size;
 	int rtn;
 
+	ctx->nl_entries = NULL;
 	strncpy(ctx->handle.name, table, ACCOUNT_TABLE_NAME_LEN-1);
+	// Older kernels don't fill these in, and read everything
+	ctx->handle.family = 0;
+	ctx->handle.flags = 0;
+	ctx->handle.entry_size = 0;
+	ctx->handle.generation = generation;
 
 	// Get table information
-	if (!dont_flush)
-		rtn = getsockopt(ctx->sockfd, IPPROTO_IP,
-		      IPT_SO_GET_ACCOUNT_PREPARE_READ_FLUSH, &ctx->handle, &s);
-	else
-		rtn = getsockopt(ctx->sockfd, IPPROTO_IP, IPT_SO_GET_ACCOUNT_PREPARE_READ,
-		      &ctx->handle, &s);
+	rtn = getsockopt(ctx->sockfd, IPPROTO_IP, cmd, &ctx->handle, &s);
 
 	if (rtn < 0) {
 		ctx->error_str = "Can't get table information from kernel. "
@@ -91,9 +103,14 @@ int ipt_ACCOUNT_read_entries(struct ipt_ACCOUNT_context *ctx,
 		return -1;
 	}
 
+	if (ctx->handle.entry_size == 0) {
+		ctx->handle.family = AF_INET;
+		ctx->handle.entry_size = sizeof(struct ipt_acc_handle_ip);
+	}
+
 	// Check data buffer size
 	ctx->pos = 0;
-	new_size = ctx->handle.itemcount * sizeof(struct ipt_acc_handle_ip);
+	new_size = ctx->handle.itemcount * ctx->handle.entry_size;
 	// We want to prevent reallocations all the time
 	if (new_size < IPT_ACCOUNT_MIN_BUFSIZE)
 		new_size = IPT_ACCOUNT_MIN_BUFSIZE;
@@ -126,28 +143,406 @@ int ipt_ACCOUNT_read_entries(struct ipt_ACCOUNT_context *ctx,
 
 	// Free kernel handle but don't reset pos/itemcount
 	setsockopt(ctx->sockfd, IPPROTO_IP, IPT_SO_SET_ACCOUNT_HANDLE_FREE,
-	           &ctx->handle, sizeof(struct ipt_acc_handle_sockopt));
+	           &ctx->handle, IPT_ACC_HANDLE_SOCKOPT_V1_SIZE);
 	ctx->handle.handle_nr = -1;
 
 	return 0;
 }
 
-struct ipt_acc_handle_ip *ipt_ACCOUNT_get_next_entry(struct ipt_ACCOUNT_context *ctx)
+int ipt_ACCOUNT_read_entries(struct ipt_ACCOUNT_context *ctx,
+                             const char *table, char dont_flush)
+{
+	return ipt_ACCOUNT_read(ctx, table, dont_flush ?
+	       IPT_SO_GET_ACCOUNT_PREPARE_READ :
+	       IPT_SO_GET_ACCOUNT_PREPARE_READ_FLUSH, 0);
+}
+
+int ipt_ACCOUNT_read_changed(struct ipt_ACCOUNT_context *ctx,
+                             const char *table, uint32_t *generation)
+{
+	if (ipt_ACCOUNT_read(ctx, table, IPT_SO_GET_ACCOUNT_PREPARE_READ,
+	    *generation) < 0)
+		return -1;
+	*generation = ctx->handle.generation;
+	return 0;
+}
+
+/* Append an attribute to the netlink message in buf */
+static void ipt_ACCOUNT_nl_attr(char *buf, unsigned short type,
+                                const void *data, unsigned short len)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct nlattr *nla = (struct nlattr *)(buf + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len  = NLA_HDRLEN + len;
+	if (len > 0)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/* Start a generic netlink message of cmd in buf */
+static void ipt_ACCOUNT_nl_msg(struct ipt_ACCOUNT_context *ctx, char *buf,
+                               unsigned short type, unsigned short flags,
+                               unsigned char cmd, unsigned char version)
 {
-	struct ipt_acc_handle_ip *rtn;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+	memset(buf, 0, NLMSG_HDRLEN + GENL_HDRLEN);
+	nlh->nlmsg_len   = NLMSG_HDRLEN + GENL_HDRLEN;
+	nlh->nlmsg_type  = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq   = ++ctx->nl_seq;
+	genl->cmd     = cmd;
+	genl->version = version;
+}
+
+/* Receive into the buffer of the dump. The kernel makes its messages no
+   bigger than the buffers they are received with, down to
+   IPT_ACCOUNT_NL_MIN_BUFSIZE, and up to IPT_ACCOUNT_NL_BUFSIZE */
+static int ipt_ACCOUNT_nl_recv(struct ipt_ACCOUNT_context *ctx)
+{
+	ssize_t len;
+
+	do
+		len = recv(ctx->nl_sockfd, ctx->nl_buf, ctx->nl_bufsize,
+		           MSG_TRUNC);
+	while (len < 0 && errno == EINTR);
+	if (ctx->nl_bufsize > ctx->nl_recvmax)
+		ctx->nl_recvmax = ctx->nl_bufsize;
+	if (len < 0 || (size_t)len > ctx->nl_bufsize) {
+		ctx->error_str = "Can't receive netlink message from kernel";
+		ctx->nl_dumping = 0;
+		return -1;
+	}
+	ctx->nl_len = len;
+	ctx->nl_msgpos = 0;
+	return 0;
+}
+
+/* Get the next message of our request. Returns it, or NULL on errors */
+static struct nlmsghdr *ipt_ACCOUNT_nl_next(struct ipt_ACCOUNT_context *ctx)
+{
+	struct nlmsghdr *nlh;
+	int len;
+
+	for (;;) {
+		if (ctx->nl_msgpos >= ctx->nl_len &&
+		    ipt_ACCOUNT_nl_recv(ctx) < 0)
+			return NULL;
+
+		nlh = (struct nlmsghdr *)((char *)ctx->nl_buf + ctx->nl_msgpos);
+		len = ctx->nl_len - ctx->nl_msgpos;
+		if (!NLMSG_OK(nlh, len)) {
+			ctx->nl_msgpos = ctx->nl_len;
+			continue;
+		}
+		ctx->nl_msgpos += NLMSG_ALIGN(nlh->nlmsg_len);
+		/* Leftovers of an abandoned request */
+		if (nlh->nlmsg_seq != ctx->nl_seq)
+			continue;
+		return nlh;
+	}
+}
+
+/* Look up the id of the xt_ACCOUNT generic netlink family */
+static int ipt_ACCOUNT_nl_open(struct ipt_ACCOUNT_context *ctx)
+{
+	char buf[NLMSG_HDRLEN + GENL_HDRLEN + NLA_HDRLEN + 16];
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+	int len;
+
+	ctx->nl_recvmax = 0;
+	ctx->nl_sockfd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (ctx->nl_sockfd < 0) {
+		ctx->error_str = "Can't open generic netlink socket";
+		return -1;
+	}
+
+	ipt_ACCOUNT_nl_msg(ctx, buf, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, 1);
+	ipt_ACCOUNT_nl_attr(buf, CTRL_ATTR_FAMILY_NAME, ACCOUNT_GENL_NAME,
+	                    sizeof(ACCOUNT_GENL_NAME));
+	nlh = (struct nlmsghdr *)buf;
+	if (send(ctx->nl_sockfd, buf, nlh->nlmsg_len, 0) < 0 ||
+	    (nlh = ipt_ACCOUNT_nl_next(ctx)) == NULL ||
+	    nlh->nlmsg_type != GENL_ID_CTRL)
+		goto out;
+
+	len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	nla = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+	for (; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	     nla->nla_len <= len; len -= NLA_ALIGN(nla->nla_len),
+	     nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len)))
+		if (nla->nla_type == CTRL_ATTR_FAMILY_ID) {
+			ctx->nl_family = *(uint16_t *)((char *)nla + NLA_HDRLEN);
+			return 0;
+		}
+
+ out:
+	ctx->error_str = "Can't find xt_ACCOUNT netlink family. "
+	                 "Module too old or not loaded?";
+	close(ctx->nl_sockfd);
+	ctx->nl_sockfd = -1;
+	return -1;
+}
+
+/* Move on to the next batch of a dump. Returns 1 if there is one, 0 at the
+   end and -1 on errors */
+static int ipt_ACCOUNT_nl_batch(struct ipt_ACCOUNT_context *ctx)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+	int len, err;
+
+	while (ctx->nl_dumping) {
+		if ((nlh = ipt_ACCOUNT_nl_next(ctx)) == NULL)
+			return -1;
+
+		if (nlh->nlmsg_type == NLMSG_DONE ||
+		    nlh->nlmsg_type == NLMSG_ERROR) {
+			ctx->nl_dumping = 0;
+			err = *(int *)NLMSG_DATA(nlh);
+			if (err >= 0)
+				return 0;
+			ctx->error_str = (err == -EINVAL) ?
+				"Can't get table from kernel. Does it exist?" :
+				"Can't get table from kernel. "
+				"Check /var/log/messages for details.";
+			return -1;
+		}
+		if (nlh->nlmsg_type != ctx->nl_family)
+			continue;
+
+		ctx->nl_entries = NULL;
+		ctx->nl_count = 0;
+		ctx->pos = 0;
+		ctx->handle.flags = 0;
+		len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+		nla = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+		for (; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+		     nla->nla_len <= len; len -= NLA_ALIGN(nla->nla_len),
+		     nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len))) {
+			void *data = (char *)nla + NLA_HDRLEN;
+
+			switch (nla->nla_type) {
+			case ACCOUNT_ATTR_FAMILY:
+				ctx->handle.family = *(uint8_t *)data;
+				break;
+			case ACCOUNT_ATTR_FLAGS:
+				ctx->handle.flags = *(uint8_t *)data;
+				break;
+			case ACCOUNT_ATTR_GENERATION:
+				ctx->handle.generation = *(uint32_t *)data;
+				break;
+			case ACCOUNT_ATTR_ITEMCOUNT:
+				ctx->handle.itemcount = *(uint32_t *)data;
+				break;
+			case ACCOUNT_ATTR_MISSED:
+				memcpy(&ctx->missed, data, sizeof(ctx->missed));
+				break;
+			case ACCOUNT_ATTR_REFILL_FAILED:
+				memcpy(&ctx->refill_failed, data,
+				       sizeof(ctx->refill_failed));
+				break;
+			case ACCOUNT_ATTR_ENTRIES:
+				ctx->nl_entries = data;
+				ctx->nl_count = nla->nla_len - NLA_HDRLEN;
+				break;
+			}
+		}
+		ctx->handle.entry_size = (ctx->handle.family == AF_INET6) ?
+			sizeof(struct ipt_acc_handle_ip6) :
+			sizeof(struct ipt_acc_handle_ip);
+		if (ctx->handle.flags & ACCOUNT_F_PROTO)
+			ctx->handle.entry_size += ACCOUNT_PROTO_MAX *
+				sizeof(struct ipt_acc_handle_proto);
+		ctx->nl_count /= ctx->handle.entry_size;
+		if (ctx->nl_entries == NULL) {
+			ctx->error_str = "Malformed netlink message from kernel";
+			return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Request a dump of table, received into the buffer set up by the caller */
+static int ipt_ACCOUNT_dump(struct ipt_ACCOUNT_context *ctx,
+                            const char *table, char dont_flush,
+                            uint32_t *generation)
+{
+	char buf[NLMSG_HDRLEN + GENL_HDRLEN + 2 * NLA_HDRLEN +
+	         ACCOUNT_TABLE_NAME_LEN + sizeof(uint32_t)];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	char name[ACCOUNT_TABLE_NAME_LEN];
+	uint32_t since;
+
+	// The kernel sizes the messages by the largest buffer the socket ever
+	// received with, so a smaller one takes a new socket
+	if (ctx->nl_sockfd >= 0 && ctx->nl_bufsize < ctx->nl_recvmax) {
+		close(ctx->nl_sockfd);
+		ctx->nl_sockfd = -1;
+		ctx->nl_dumping = 0;
+	}
+	if (ctx->nl_sockfd < 0 && ipt_ACCOUNT_nl_open(ctx) < 0)
+		return -1;
+	// The kernel runs one dump per socket at a time
+	while (ctx->nl_dumping)
+		if (ipt_ACCOUNT_nl_batch(ctx) < 0)
+			break;
+	ctx->nl_dumping = 0;
+	ctx->nl_len = ctx->nl_msgpos = 0;
+
+	ipt_ACCOUNT_nl_msg(ctx, buf, ctx->nl_family, NLM_F_DUMP,
+	                   ACCOUNT_CMD_GET, ACCOUNT_GENL_VERSION);
+	memset(name, 0, sizeof(name));
+	strncpy(name, table, sizeof(name) - 1);
+	ipt_ACCOUNT_nl_attr(buf, ACCOUNT_ATTR_TABLE, name, strlen(name) + 1);
+	if (!dont_flush)
+		ipt_ACCOUNT_nl_attr(buf, ACCOUNT_ATTR_FLUSH, NULL, 0);
+	else if (generation != NULL) {
+		since = *generation;
+		ipt_ACCOUNT_nl_attr(buf, ACCOUNT_ATTR_GENERATION,
+		                    &since, sizeof(since));
+	}
+	if (send(ctx->nl_sockfd, buf, nlh->nlmsg_len, 0) < 0) {
+		ctx->error_str = "Can't send netlink request to kernel";
+		return -1;
+	}
+	ctx->nl_dumping = 1;
+
+	// The first batch tells about the table
+	if (ipt_ACCOUNT_nl_batch(ctx) <= 0) {
+		if (ctx->error_str == NULL)
+			ctx->error_str = "Empty netlink dump from kernel";
+		ipt_ACCOUNT_free_entries(ctx);
+		return -1;
+	}
+	if (generation != NULL && dont_flush)
+		*generation = ctx->handle.generation;
+	return 0;
+}
+
+static void ipt_ACCOUNT_dump_reset(struct ipt_ACCOUNT_context *ctx,
+                                   const char *table)
+{
+	ipt_ACCOUNT_free_entries(ctx);
+	ctx->error_str = NULL;
+	memset(&ctx->handle, 0, sizeof(ctx->handle));
+	ctx->handle.handle_nr = -1;
+	strncpy(ctx->handle.name, table, ACCOUNT_TABLE_NAME_LEN-1);
+}
+
+int ipt_ACCOUNT_dump_entries(struct ipt_ACCOUNT_context *ctx,
+                             const char *table, char dont_flush,
+                             uint32_t *generation)
+{
+	ipt_ACCOUNT_dump_reset(ctx, table);
+
+	// Big enough for any dump message
+	if (ctx->data_size < IPT_ACCOUNT_NL_BUFSIZE) {
+		void *data = realloc(ctx->data, IPT_ACCOUNT_NL_BUFSIZE);
+
+		if (data == NULL) {
+			ctx->error_str = "Out of memory for data buffer";
+			return -1;
+		}
+		ctx->data = data;
+		ctx->data_size = IPT_ACCOUNT_NL_BUFSIZE;
+	}
+	ctx->nl_buf = ctx->data;
+	ctx->nl_bufsize = ctx->data_size;
+
+	return ipt_ACCOUNT_dump(ctx, table, dont_flush, generation);
+}
+
+int ipt_ACCOUNT_dump_start(struct ipt_ACCOUNT_context *ctx,
+                           const char *table, char dont_flush,
+                           uint32_t *generation, void *buf, size_t size)
+{
+	ipt_ACCOUNT_dump_reset(ctx, table);
+
+	if (size < IPT_ACCOUNT_NL_MIN_BUFSIZE) {
+		ctx->error_str = "Buffer too small for netlink messages";
+		return -1;
+	}
+	ctx->nl_buf = buf;
+	ctx->nl_bufsize = (size < IPT_ACCOUNT_NL_BUFSIZE) ?
+	                  size : IPT_ACCOUNT_NL_BUFSIZE;
+
+	return ipt_ACCOUNT_dump(ctx, table, dont_flush, generation);
+}
+
+int ipt_ACCOUNT_next_batch(struct ipt_ACCOUNT_context *ctx,
+                           const void **entries)
+{
+	unsigned int count;
+
+	if (ctx->nl_entries == NULL)
+		return 0;
+	while (ctx->pos >= ctx->nl_count) {
+		int rtn = ipt_ACCOUNT_nl_batch(ctx);
+
+		if (rtn <= 0)
+			return rtn;
+	}
+
+	*entries = (char *)ctx->nl_entries + ctx->pos * ctx->handle.entry_size;
+	count = ctx->nl_count - ctx->pos;
+	ctx->pos = ctx->nl_count;
+	return count;
+}
+
+static void *ipt_ACCOUNT_next(struct ipt_ACCOUNT_context *ctx,
+                               unsigned char family)
+{
+	void *rtn;
+
+	// Streaming a netlink dump?
+	if (ctx->nl_entries != NULL) {
+		if (ctx->handle.family != family)
+			return NULL;
+		while (ctx->pos >= ctx->nl_count)
+			if (ipt_ACCOUNT_nl_batch(ctx) <= 0)
+				return NULL;
+		return (char *)ctx->nl_entries +
+		       ctx->pos++ * ctx->handle.entry_size;
+	}
 
 	// Empty or no more items left to return?
-	if (!ctx->handle.itemcount || ctx->pos >= ctx->handle.itemcount)
+	if (!ctx->handle.itemcount || ctx->pos >= ctx->handle.itemcount ||
+	    ctx->handle.family != family)
 		return NULL;
 
 	// Get next entry
-	rtn = (struct ipt_acc_handle_ip *)(ctx->data + ctx->pos
-	      * sizeof(struct ipt_acc_handle_ip));
+	rtn = ctx->data + ctx->pos * ctx->handle.entry_size;
 	ctx->pos++;
 
 	return rtn;
 }
 
+struct ipt_acc_handle_ip *ipt_ACCOUNT_get_next_entry(struct ipt_ACCOUNT_context *ctx)
+{
+	return ipt_ACCOUNT_next(ctx, AF_INET);
+}
+
+struct ipt_acc_handle_ip6 *ipt_ACCOUNT_get_next_entry6(struct ipt_ACCOUNT_context *ctx)
+{
+	return ipt_ACCOUNT_next(ctx, AF_INET6);
+}
+
+const struct ipt_acc_handle_proto *ipt_ACCOUNT_get_proto(
+	const struct ipt_ACCOUNT_context *ctx, const void *entry)
+{
+	if (!(ctx->handle.flags & ACCOUNT_F_PROTO))
+		return NULL;
+	// The split comes last in the entry
+	return (const void *)((const char *)entry + ctx->handle.entry_size -
+	       ACCOUNT_PROTO_MAX * sizeof(struct ipt_acc_handle_proto));
+}
+
 int ipt_ACCOUNT_get_handle_usage(struct ipt_ACCOUNT_context *ctx)
 {
 	unsigned int s = sizeof(struct ipt_acc_handle_sockopt);
@@ -174,12 +569,27 @@ int ipt_ACCOUNT_free_all_handles(struct ipt_ACCOUNT_context *ctx)
 
 int ipt_ACCOUNT_get_table_names(struct ipt_ACCOUNT_context *ctx)
 {
-	int rtn = getsockopt(ctx->sockfd, IPPROTO_IP,
-	          IPT_SO_GET_ACCOUNT_GET_TABLE_NAMES,
-	          ctx->data, &ctx->data_size);
+	socklen_t len;
+	void *data;
+	int rtn;
+
+	// The kernel does not tell how much space the names need,
+	// so grow the buffer until they fit
+	for (;;) {
+		len = ctx->data_size;
+		rtn = getsockopt(ctx->sockfd, IPPROTO_IP,
+		      IPT_SO_GET_ACCOUNT_GET_TABLE_NAMES, ctx->data, &len);
+		if (rtn == 0 || errno != ENOMEM ||
+		    ctx->data_size >= IPT_ACCOUNT_NAMES_MAXSIZE)
+			break;
+		if ((data = realloc(ctx->data, ctx->data_size * 2)) == NULL)
+			break;
+		ctx->data = data;
+		ctx->data_size *= 2;
+	}
 	if (rtn < 0) {
-		ctx->error_str = "Can't get table names from kernel. Out of memory, "
-		                 "MINBUFISZE too small?";
+		ctx->error_str = "Can't get table names from kernel. "
+		                 "Out of memory?";
 		return -1;
 	}
 	ctx->pos = 0;
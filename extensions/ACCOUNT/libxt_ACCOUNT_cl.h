@@ -11,13 +11,26 @@
 #ifndef _xt_ACCOUNT_cl_H
 #define _xt_ACCOUNT_cl_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
 #include <xt_ACCOUNT.h>
 
-#define LIBXT_ACCOUNT_VERSION "1.3"
+#define LIBXT_ACCOUNT_VERSION "1.6"
 
 /* Don't set this below the size of struct ipt_account_handle_sockopt */
 #define IPT_ACCOUNT_MIN_BUFSIZE 4096
+/* Limit for the list of table names, which has room for the longest
+   names of half a million tables */
+#define IPT_ACCOUNT_NAMES_MAXSIZE (16 << 20)
+/* Largest netlink dump message the kernel sends */
+#define IPT_ACCOUNT_NL_BUFSIZE 32768
+/* Smallest buffer for ipt_ACCOUNT_dump_start(); the kernel sends smaller
+   messages to smaller buffers, down to about a page */
+#define IPT_ACCOUNT_NL_MIN_BUFSIZE 8192
 
+/* Allocated by the caller: changing it needs a new soname, see Makefile.am */
 struct ipt_ACCOUNT_context
 {
 	int sockfd;
@@ -28,6 +41,23 @@ struct ipt_ACCOUNT_context
 	unsigned int pos;
 
 	char *error_str;
+
+	/* Netlink dump state, see ipt_ACCOUNT_dump_entries() */
+	int nl_sockfd;
+	uint16_t nl_family;
+	uint32_t nl_seq;
+	char nl_dumping;
+	unsigned int nl_len;
+	unsigned int nl_msgpos;
+	void *nl_entries;
+	unsigned int nl_count;
+	void *nl_buf;
+	unsigned int nl_bufsize;
+	unsigned int nl_recvmax;
+	/* Pool counters of the table, see struct ipt_acc_snapshot.
+	   Only set by ipt_ACCOUNT_dump_entries() */
+	uint64_t missed;
+	uint64_t refill_failed;
 };
 
 #ifdef __cplusplus
@@ -40,8 +70,42 @@ void ipt_ACCOUNT_deinit(struct ipt_ACCOUNT_context *ctx);
 void ipt_ACCOUNT_free_entries(struct ipt_ACCOUNT_context *ctx);
 int ipt_ACCOUNT_read_entries(struct ipt_ACCOUNT_context *ctx,
                              const char *table, char dont_flush);
+/* Read without flush only the entries that changed since *generation,
+   all of them for 0. Updates *generation for the next call; the totals
+   are never reset. An entry can come up twice in a row */
+int ipt_ACCOUNT_read_changed(struct ipt_ACCOUNT_context *ctx,
+                             const char *table, uint32_t *generation);
+/* Read over netlink, entries are fetched in batches while they are
+   walked with the functions below, in a buffer of IPT_ACCOUNT_NL_BUFSIZE.
+   handle.itemcount is the total. If the walk ends early on an error,
+   error_str tells. generation works as with ipt_ACCOUNT_read_changed()
+   if dont_flush is set, and can be NULL */
+int ipt_ACCOUNT_dump_entries(struct ipt_ACCOUNT_context *ctx,
+                             const char *table, char dont_flush,
+                             uint32_t *generation);
+/* Like ipt_ACCOUNT_dump_entries(), but the messages are received into
+   buf, which the caller keeps until the dump is over. It takes size bytes,
+   at least IPT_ACCOUNT_NL_MIN_BUFSIZE; more than IPT_ACCOUNT_NL_BUFSIZE is
+   not used. Memory use thus does not depend on the size of the table */
+int ipt_ACCOUNT_dump_start(struct ipt_ACCOUNT_context *ctx,
+                           const char *table, char dont_flush,
+                           uint32_t *generation, void *buf, size_t size);
+/* Next batch of a netlink dump: sets *entries to the entries, of
+   handle.entry_size bytes each, which stay valid until the next call.
+   Returns their number, 0 at the end and -1 on errors. Can be mixed with
+   the functions below, which then go on after the batch */
+int ipt_ACCOUNT_next_batch(struct ipt_ACCOUNT_context *ctx,
+                           const void **entries);
+/* handle.family tells which one to use for the table just read */
 struct ipt_acc_handle_ip *ipt_ACCOUNT_get_next_entry(
                              struct ipt_ACCOUNT_context *ctx);
+struct ipt_acc_handle_ip6 *ipt_ACCOUNT_get_next_entry6(
+                             struct ipt_ACCOUNT_context *ctx);
+/* For tables with ACCOUNT_F_PROTO in handle.flags, the counters of an
+   entry per protocol, indexed by ACCOUNT_PROTO_*. NULL for other tables */
+const struct ipt_acc_handle_proto *ipt_ACCOUNT_get_proto(
+                             const struct ipt_ACCOUNT_context *ctx,
+                             const void *entry);
 
 /* ipt_ACCOUNT_free_entries is for internal use only function as this library
 is constructed to be used in a loop -> Don't allocate memory all the time.
@@ -24,12 +24,27 @@
 
 #include <linux/semaphore.h>
 
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
-#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 
+#include <net/genetlink.h>
+#include <net/ipv6.h>
+#include <net/net_namespace.h>
 #include <net/route.h>
 #include "xt_ACCOUNT.h"
 #include "compat_xtables.h"
@@ -38,43 +53,111 @@
 #error "ipt_ACCOUNT needs at least a PAGE_SIZE of 4096"
 #endif
 
+/**
+ * Per-CPU part of a table. Every CPU counts into its own tree, so packets
+ * on different CPUs never share a lock or a cache line.
+ * @data:	pointer to the actual data, depending on netmask;
+ * 		%NULL until this CPU has seen a packet for the table.
+ * 		The packet path only ever adds to the tree, within an
+ * 		RCU-bh read side section. Read-and-flush swaps the tree
+ * 		out for %NULL and waits for a grace period before reading it.
+ */
+struct ipt_acc_cpu {
+	void __rcu *data;
+};
+
+/**
+ * Blocks kept ready for the packet path of a table, so that it rarely has
+ * to allocate pages itself. A work item tops the pool up in process
+ * context whenever it runs half empty, and read-and-flush gives back the
+ * blocks of the trees it merges. A pool starts out small and only grows
+ * for tables that run it dry.
+ * @lock:	protects everything but @refill
+ * @count:	number of blocks in @block
+ * @size:	room in @block; ipt_acc_pool_blocks at table creation, grown
+ * 		only by the work item
+ * @shortfall:	blocks asked for while the pool was empty since the last
+ * 		refill, by which the refill grows @size
+ * @tree_blocks: blocks a CPU takes to start a new tree
+ * @block:	zeroed blocks of four pages
+ * @refill:	work item that fills the pool up to @size
+ * @missed:	blocks the packet path could neither take from the pool nor
+ * 		allocate; the addresses of those packets went uncounted
+ * @refill_failed: refills that ran out of memory
+ */
+struct ipt_acc_pool {
+	spinlock_t lock;
+	unsigned int count;
+	unsigned int size;
+	unsigned int shortfall;
+	unsigned int tree_blocks;
+	void **block;
+	struct work_struct refill;
+	uint64_t missed;
+	uint64_t refill_failed;
+};
+
 /**
  * Internal table structure, generated by check_entry()
  * @name:	name of the table
- * @ip:		base IP address of the network
- * @mask:	netmask of the network
- * @depth:	size of network (0: 8-bit, 1: 16-bit, 2: 24-bit)
+ * @family:	%NFPROTO_IPV4 or %NFPROTO_IPV6
+ * @prefix:	prefix length of the network
+ * @ip:		base IP address of the network (IPv4 only)
+ * @mask:	netmask of the network (IPv4 only)
+ * @unit_net:	network in units, i.e. IPv4 addresses or IPv6 /64 prefixes,
+ * 		in host byte order
+ * @unit_mask:	netmask in units
+ * @depth:	size of network (0: 8-bit, 1: 16-bit, 2: 24-bit,
+ * 		3: anything larger, and IPv6; hashed blocks)
+ * @flags:	ACCOUNT_F_*
  * @refcount:	refcount of the table; if zero, destroy it
- * @itemcount:	number of IP addresses in this table
- * @data;	pointer to the actual data, depending on netmask
+ * @gen:	current generation, which the packet path stamps into the
+ * 		data it touches. Every snapshot starts a new one
+ * @cpu:	per-CPU accounting data, summed up by snapshots
+ * @pool:	blocks for new parts of the per-CPU trees
+ * @next:	next table in the same bucket of the name hash
+ * @nr:		slot of the table, which the rules cache
+ * @proc:	the snapshot file was created, and goes with the table
  */
 struct ipt_acc_table {
 	char name[ACCOUNT_TABLE_NAME_LEN];
+	uint8_t family;
+	uint8_t prefix;
 	__be32 ip;
 	__be32 netmask;
+	uint64_t unit_net;
+	uint64_t unit_mask;
 	uint8_t depth;
+	uint8_t flags;
 	uint32_t refcount;
-	uint32_t itemcount;
-	void *data;
+	uint32_t gen;
+	struct ipt_acc_cpu __percpu *cpu;
+	struct ipt_acc_pool pool;
+	struct ipt_acc_table *next;
+	int32_t nr;
+	bool proc;
 };
 
 /**
  * Internal handle structure
  * @ip:		base IP address of the network. Used for caculating the final
  * 		address during get_data().
+ * @family:	family of the table
  * @depth:	size of the network; see above
+ * @flags:	flags of the table
  * @itemcount:	number of addresses in this table
  */
 struct ipt_acc_handle {
 	uint32_t ip;
+	uint8_t family;
 	uint8_t depth;
+	uint8_t flags;
 	uint32_t itemcount;
 	void *data;
 };
 
-/* Used for every IP entry
-   Size is 32 bytes so that 256 (class C network) * 16
-   fits in a double kernel (zero) page (two consecutive kernel pages)*/
+/* Used for every IP entry. The 256 of a class C network, with their
+   generations, fit in a block of four kernel pages (see ipt_acc_mask_24) */
 struct ipt_acc_ip {
 	uint64_t src_packets;
 	uint64_t src_bytes;
@@ -85,51 +168,307 @@ struct ipt_acc_ip {
 /*
  *	The IP addresses are organized as an array so that direct slot
  *	calculations are possible.
- *	Only 8-bit networks are preallocated, 16/24-bit networks
- *	allocate their slots when needed -> very efficent.
+ *	Every level takes one block of four pages, allocated with the first
+ *	packet a CPU counts for that part of the network. A CPU counting
+ *	every address of a 16-bit network thus holds 257 blocks (about
+ *	4 MB), and twice that with ACCOUNT_F_PROTO.
  */
+/*
+ *	Each level also records the generation of its last packet, so that
+ *	reads of only the changed addresses can skip the rest.
+ *	Tables with ACCOUNT_F_PROTO count TCP and UDP once more in a second
+ *	leaf, allocated along with the first packet. Other protocols are
+ *	what is left of the totals.
+ */
+struct ipt_acc_mask_24_proto {
+	struct ipt_acc_ip ip[ACCOUNT_PROTO_OTHER][256];
+};
+
 struct ipt_acc_mask_24 {
 	struct ipt_acc_ip ip[256];
+	uint32_t ip_gen[256];
+	uint32_t gen;
+	struct ipt_acc_mask_24_proto *proto;
 };
 
 struct ipt_acc_mask_16 {
 	struct ipt_acc_mask_24 *mask_24[256];
+	uint32_t gen;
 };
 
 struct ipt_acc_mask_8 {
 	struct ipt_acc_mask_16 *mask_16[256];
 };
 
-static struct ipt_acc_table *ipt_acc_tables;
+/*
+ *	Networks larger than 24 bit and IPv6 networks are too sparse for
+ *	direct slots. They are kept as a hash of blocks of 256 units each,
+ *	that is one /24 for IPv4 or one /56 (of /64s) for IPv6, again only
+ *	allocated when needed.
+ */
+#define IPT_ACC_HASH_BITS 11
+
+struct ipt_acc_block {
+	struct ipt_acc_block *next;
+	uint64_t key;		/* first unit of the block >> 8 */
+	struct ipt_acc_mask_24 data;
+};
+
+struct ipt_acc_hash {
+	struct ipt_acc_block *bucket[1 << IPT_ACC_HASH_BITS];
+};
+
+/*
+ *	Tables are found by name in a hash, and by the slot cached in their
+ *	rules in an array. Both grow with the number of tables. The packet
+ *	path only reads the slots, under RCU, so that array is replaced as
+ *	a whole when it grows.
+ */
+#define IPT_ACC_TABLE_HASH_MIN_BITS 6
+
+struct ipt_acc_table_slots {
+	unsigned int size;
+	struct ipt_acc_table *table[0];
+};
+
+static struct ipt_acc_table_slots __rcu *ipt_acc_table_slots;
+static unsigned int ipt_acc_table_free;	/* no free slot below */
+static struct ipt_acc_table **ipt_acc_table_hash;
+static unsigned int ipt_acc_table_hash_bits;
+static unsigned int ipt_acc_table_count;
 static struct ipt_acc_handle *ipt_acc_handles;
 static void *ipt_acc_tmpbuf;
 
-/* Spinlock used for manipulating the current accounting tables/data */
-static DEFINE_SPINLOCK(ipt_acc_lock);
+/* Mutex used for manipulating the table list and snapshotting data */
+static DEFINE_MUTEX(ipt_acc_mutex);
+/* Serializes creating and destroying tables together with their proc
+   files. Taken outside of ipt_acc_mutex, which opening the files needs */
+static DEFINE_MUTEX(ipt_acc_table_mutex);
+static struct proc_dir_entry *ipt_acc_proc_dir;
+static const struct file_operations ipt_acc_proc_fops;
 /* Mutex (semaphore) used for manipulating userspace handles/snapshot data */
 static struct semaphore ipt_acc_userspace_mutex;
 
-/* Allocates a page pair and clears it */
+static unsigned int ipt_acc_pool_blocks = 8;
+module_param_named(pool_blocks, ipt_acc_pool_blocks, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_blocks, "number of blocks of 4 pages a table starts "
+	"with ready for new addresses; the pool of a table that runs dry grows "
+	"up to a new tree on every online CPU beyond that. Takes effect for new "
+	"tables (default: 8)");
+
+/* Allocates four pages and clears them. The barrier makes the zeroes
+   visible before the pages are linked into a tree that is being read.
+   The packet path gets its pages from ipt_acc_pool_take() instead */
 static void *ipt_acc_zalloc_page(void)
 {
 	// Don't use get_zeroed_page until it's fixed in the kernel.
-	// get_zeroed_page(GFP_ATOMIC)
-	void *mem = (void *)__get_free_pages(GFP_ATOMIC, 2);
-	if (mem != NULL)
-		memset(mem, 0,  2 *PAGE_SIZE);
+	// get_zeroed_page(GFP_KERNEL)
+	void *mem = (void *)__get_free_pages(GFP_KERNEL, 2);
+	if (mem != NULL) {
+		memset(mem, 0, PAGE_SIZE << 2);
+		smp_wmb();
+	}
+	return mem;
+}
+
+/* Give a zeroed block to a pool, from process context. Returns the room
+   left, or -1 if the pool is full and the block still the caller's */
+static int ipt_acc_pool_put(struct ipt_acc_pool *pool, void *mem)
+{
+	int room = -1;
+
+	spin_lock_bh(&pool->lock);
+	if (pool->count < pool->size) {
+		pool->block[pool->count++] = mem;
+		room = pool->size - pool->count;
+	}
+	spin_unlock_bh(&pool->lock);
+	return room;
+}
+
+/* Make room for @more blocks in a pool, but no more than a new tree on
+   every online CPU beyond ipt_acc_pool_blocks. Only the work item changes
+   the size, so it reads it unlocked */
+static void ipt_acc_pool_grow(struct ipt_acc_pool *pool, unsigned int more)
+{
+	unsigned int size = min(pool->size + more,
+		ACCESS_ONCE(ipt_acc_pool_blocks) +
+		num_online_cpus() * pool->tree_blocks);
+	void **block, **old;
+
+	if (size <= pool->size)
+		return;
+	block = kcalloc(size, sizeof(*block), GFP_KERNEL);
+	spin_lock_bh(&pool->lock);
+	if (block == NULL) {
+		pool->refill_failed++;
+		spin_unlock_bh(&pool->lock);
+		return;
+	}
+	memcpy(block, pool->block, pool->count * sizeof(*block));
+	old = pool->block;
+	pool->block = block;
+	pool->size = size;
+	spin_unlock_bh(&pool->lock);
+	kfree(old);
+}
+
+/* Grow a pool by what was asked of it while empty, and top it up */
+static void ipt_acc_pool_refill(struct work_struct *work)
+{
+	struct ipt_acc_pool *pool = container_of(work, struct ipt_acc_pool,
+	                            refill);
+	unsigned int more;
+	int room;
+	void *mem;
+
+	spin_lock_bh(&pool->lock);
+	more = pool->shortfall;
+	pool->shortfall = 0;
+	spin_unlock_bh(&pool->lock);
+	if (more > 0)
+		ipt_acc_pool_grow(pool, more);
+
+	spin_lock_bh(&pool->lock);
+	room = pool->size - pool->count;
+	spin_unlock_bh(&pool->lock);
+
+	while (room > 0) {
+		if ((mem = ipt_acc_zalloc_page()) == NULL) {
+			spin_lock_bh(&pool->lock);
+			pool->refill_failed++;
+			spin_unlock_bh(&pool->lock);
+			return;
+		}
+		/* Read-and-flush may have filled it up in the meantime */
+		if ((room = ipt_acc_pool_put(pool, mem)) < 0)
+			free_pages((unsigned long)mem, 2);
+	}
+}
+
+/* Blocks a CPU takes for the first packet into an empty tree of @depth:
+   one per level, and one for the protocol split */
+static unsigned int ipt_acc_pool_tree_blocks(uint8_t depth, uint8_t flags)
+{
+	unsigned int blocks = (depth == 3) ? 2 : depth + 1;
+
+	if (flags & ACCOUNT_F_PROTO)
+		blocks++;
+	return blocks;
+}
+
+/* Set up a full pool of ipt_acc_pool_blocks for a table of @depth and
+   @flags. If after a flush every CPU starting a new tree drains it, it
+   grows. Returns -1 if out of memory */
+static int ipt_acc_pool_init(struct ipt_acc_pool *pool, uint8_t depth,
+			     uint8_t flags)
+{
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->refill, ipt_acc_pool_refill);
+	pool->size = ACCESS_ONCE(ipt_acc_pool_blocks);
+	pool->tree_blocks = ipt_acc_pool_tree_blocks(depth, flags);
+	pool->block = kcalloc(pool->size, sizeof(*pool->block), GFP_KERNEL);
+	if (pool->block == NULL)
+		return -1;
+	ipt_acc_pool_refill(&pool->refill);
+	return (pool->count == pool->size) ? 0 : -1;
+}
+
+/* Free a pool. No packet may take from it anymore */
+static void ipt_acc_pool_destroy(struct ipt_acc_pool *pool)
+{
+	cancel_work_sync(&pool->refill);
+	while (pool->count > 0)
+		free_pages((unsigned long)pool->block[--pool->count], 2);
+	kfree(pool->block);
+}
+
+/* Take a zeroed block of four pages for a new part of a tree, from the
+   packet path. If the pool is empty, the block is allocated atomically;
+   only if that fails too, the caller has to do without */
+static void *ipt_acc_pool_take(struct ipt_acc_pool *pool)
+{
+	void *mem = NULL;
+	bool refill;
+
+	spin_lock(&pool->lock);
+	if (pool->count > 0)
+		mem = pool->block[--pool->count];
+	else
+		pool->shortfall++;
+	refill = pool->count <= pool->size / 2;
+	spin_unlock(&pool->lock);
+
+	if (refill)
+		schedule_work(&pool->refill);
+	if (mem == NULL) {
+		mem = (void *)__get_free_pages(GFP_ATOMIC, 2);
+		if (mem == NULL) {
+			spin_lock(&pool->lock);
+			pool->missed++;
+			spin_unlock(&pool->lock);
+			if (net_ratelimit())
+				printk("ACCOUNT: Out of memory for new "
+					"addresses, packets go uncounted\n");
+			return NULL;
+		}
+		memset(mem, 0, PAGE_SIZE << 2);
+	}
+	/* Like ipt_acc_zalloc_page(), the zeroes go before the link */
+	smp_wmb();
 	return mem;
 }
 
-/* Recursive free of all data structures */
-static void ipt_acc_data_free(void *data, uint8_t depth)
+/* Free a block of a tree no packet can reach anymore. With a @pool, the
+   block is cleared and given back while the pool has room */
+static void ipt_acc_block_free(struct ipt_acc_pool *pool, void *mem)
+{
+	if (pool != NULL && ACCESS_ONCE(pool->count) < pool->size) {
+		memset(mem, 0, PAGE_SIZE << 2);
+		if (ipt_acc_pool_put(pool, mem) >= 0)
+			return;
+	}
+	free_pages((unsigned long)mem, 2);
+}
+
+static void ipt_acc_mask_24_free(struct ipt_acc_pool *pool,
+				 struct ipt_acc_mask_24 *mask_24)
+{
+	if (mask_24->proto != NULL)
+		ipt_acc_block_free(pool, mask_24->proto);
+	ipt_acc_block_free(pool, mask_24);
+}
+
+/* Recursive free of all data structures. Blocks go back to @pool if one
+   is given, see ipt_acc_block_free() */
+static void ipt_acc_data_free(void *data, uint8_t depth,
+			      struct ipt_acc_pool *pool)
 {
 	/* Empty data set */
 	if (!data)
 		return;
 
+	/* Free for hashed blocks */
+	if (depth == 3) {
+		struct ipt_acc_hash *hash = data;
+		struct ipt_acc_block *block, *next;
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(hash->bucket); i++)
+			for (block = hash->bucket[i]; block; block = next) {
+				next = block->next;
+				if (block->data.proto != NULL)
+					ipt_acc_block_free(pool,
+						block->data.proto);
+				ipt_acc_block_free(pool, block);
+			}
+		ipt_acc_block_free(pool, data);
+		return;
+	}
+
 	/* Free for 8 bit network */
 	if (depth == 0) {
-		free_pages((unsigned long)data, 2);
+		ipt_acc_mask_24_free(pool, data);
 		return;
 	}
 
@@ -139,8 +478,8 @@ static void ipt_acc_data_free(void *data, uint8_t depth)
 		unsigned int b;
 		for (b = 0; b <= 255; ++b)
 			if (mask_16->mask_24[b])
-				free_pages((unsigned long)mask_16->mask_24[b], 2);
-		free_pages((unsigned long)data, 2);
+				ipt_acc_mask_24_free(pool, mask_16->mask_24[b]);
+		ipt_acc_block_free(pool, data);
 		return;
 	}
 
@@ -154,11 +493,12 @@ static void ipt_acc_data_free(void *data, uint8_t depth)
 
 				for (b = 0; b <= 255; ++b)
 					if (mask_16->mask_24[b])
-						free_pages((unsigned long)mask_16->mask_24[b], 2);
-				free_pages((unsigned long)mask_16, 2);
+						ipt_acc_mask_24_free(pool,
+							mask_16->mask_24[b]);
+				ipt_acc_block_free(pool, mask_16);
 			}
 		}
-		free_pages((unsigned long)data, 2);
+		ipt_acc_block_free(pool, data);
 		return;
 	}
 
@@ -167,107 +507,572 @@ static void ipt_acc_data_free(void *data, uint8_t depth)
 	return;
 }
 
-/* Look for existing table / insert new one.
-   Return internal ID or -1 on error */
-static int ipt_acc_table_insert(const char *name, __be32 ip, __be32 netmask)
+/* Free the per-CPU data of a table. No rule references it anymore */
+static void ipt_acc_table_free_data(struct ipt_acc_table *table)
 {
-	unsigned int i;
+	unsigned int cpu;
 
-	pr_debug("ACCOUNT: ipt_acc_table_insert: %s, %u.%u.%u.%u/%u.%u.%u.%u\n",
-		name, NIPQUAD(ip), NIPQUAD(netmask));
+	for_each_possible_cpu(cpu) {
+		struct ipt_acc_cpu *pcpu = per_cpu_ptr(table->cpu, cpu);
 
-	/* Look for existing table */
-	for (i = 0; i < ACCOUNT_MAX_TABLES; i++) {
-		if (strncmp(ipt_acc_tables[i].name, name,
-		    ACCOUNT_TABLE_NAME_LEN) == 0) {
-			pr_debug("ACCOUNT: Found existing slot: %d - "
-				"%u.%u.%u.%u/%u.%u.%u.%u\n", i,
-				NIPQUAD(ipt_acc_tables[i].ip),
-				NIPQUAD(ipt_acc_tables[i].netmask));
-
-			if (ipt_acc_tables[i].ip != ip
-			    || ipt_acc_tables[i].netmask != netmask) {
-				printk("ACCOUNT: Table %s found, but IP/netmask mismatch. "
-					"IP/netmask found: %u.%u.%u.%u/%u.%u.%u.%u\n",
-					name, NIPQUAD(ipt_acc_tables[i].ip),
-					NIPQUAD(ipt_acc_tables[i].netmask));
-				return -1;
+		ipt_acc_data_free(rcu_dereference_protected(pcpu->data,
+			lockdep_is_held(&ipt_acc_mutex)), table->depth, NULL);
+		RCU_INIT_POINTER(pcpu->data, NULL);
+	}
+}
+
+static inline void ipt_acc_ip_add(struct ipt_acc_ip *to,
+				  const struct ipt_acc_ip *from)
+{
+	to->src_packets += from->src_packets;
+	to->src_bytes += from->src_bytes;
+	to->dst_packets += from->dst_packets;
+	to->dst_bytes += from->dst_bytes;
+}
+
+/* Add the counters of the addresses in @from that changed in generation
+   @since or later to @to. With @mark, only their generations are taken
+   over, for ipt_acc_mask_24_collect(). Returns -1 if out of memory */
+static int ipt_acc_mask_24_merge(struct ipt_acc_mask_24 *to,
+				 const struct ipt_acc_mask_24 *from,
+				 uint32_t since, bool mark)
+{
+	unsigned int i, p;
+
+	if (!mark && from->proto != NULL && to->proto == NULL &&
+	    (to->proto = ipt_acc_zalloc_page()) == NULL)
+		return -1;
+
+	for (i = 0; i <= 255; i++) {
+		if (from->ip_gen[i] < since)
+			continue;
+		to->ip_gen[i] = max(to->ip_gen[i], from->ip_gen[i]);
+		if (mark)
+			continue;
+		ipt_acc_ip_add(&to->ip[i], &from->ip[i]);
+		if (from->proto != NULL)
+			for (p = 0; p < ACCOUNT_PROTO_OTHER; p++)
+				ipt_acc_ip_add(&to->proto->ip[p][i],
+					&from->proto->ip[p][i]);
+	}
+	to->gen = max(to->gen, from->gen);
+	return 0;
+}
+
+/* Add the counters of @from for every address marked in @to, whatever
+   generation they have in @from. Returns -1 if out of memory */
+static int ipt_acc_mask_24_collect(struct ipt_acc_mask_24 *to,
+				   const struct ipt_acc_mask_24 *from,
+				   uint32_t since)
+{
+	unsigned int i, p;
+
+	if (from->proto != NULL && to->proto == NULL &&
+	    (to->proto = ipt_acc_zalloc_page()) == NULL)
+		return -1;
+
+	for (i = 0; i <= 255; i++) {
+		if (to->ip_gen[i] < since)
+			continue;
+		ipt_acc_ip_add(&to->ip[i], &from->ip[i]);
+		if (from->proto != NULL)
+			for (p = 0; p < ACCOUNT_PROTO_OTHER; p++)
+				ipt_acc_ip_add(&to->proto->ip[p][i],
+					&from->proto->ip[p][i]);
+	}
+	return 0;
+}
+
+/* The block of @key, %NULL if there is none */
+static struct ipt_acc_mask_24 *
+ipt_acc_hash_lookup(const struct ipt_acc_hash *hash, uint64_t key)
+{
+	struct ipt_acc_block *block;
+
+	for (block = hash->bucket[hash_64(key, IPT_ACC_HASH_BITS)]; block;
+	     block = block->next)
+		if (block->key == key)
+			return &block->data;
+	return NULL;
+}
+
+/* Find the block of @unit, allocating it if needed. The packet path
+   passes the @pool of its table, anything else %NULL */
+static struct ipt_acc_mask_24 *
+ipt_acc_hash_find(struct ipt_acc_hash *hash, uint64_t unit,
+		  struct ipt_acc_pool *pool)
+{
+	struct ipt_acc_block **head, *block;
+	struct ipt_acc_mask_24 *mask_24;
+	uint64_t key = unit >> 8;
+
+	if ((mask_24 = ipt_acc_hash_lookup(hash, key)) != NULL)
+		return mask_24;
+
+	head = &hash->bucket[hash_64(key, IPT_ACC_HASH_BITS)];
+	block = (pool != NULL) ? ipt_acc_pool_take(pool) :
+	        ipt_acc_zalloc_page();
+	if (block == NULL)
+		return NULL;
+	block->key = key;
+	block->next = *head;
+	/* The chain may be walked by a concurrent snapshot */
+	smp_wmb();
+	*head = block;
+	return &block->data;
+}
+
+/* Add the counters of @from to @to, allocating missing blocks of @to.
+   Only addresses that changed in generation @since or later are taken,
+   and blocks without any are skipped. With @mark, the addresses are only
+   marked in @to, see ipt_acc_data_collect(). Returns -1 if out of memory */
+static int ipt_acc_data_merge(void *to, const void *from, uint8_t depth,
+			      uint32_t since, bool mark)
+{
+	if (from == NULL)
+		return 0;
+
+	/* Merge of hashed blocks */
+	if (depth == 3) {
+		const struct ipt_acc_hash *from_hash = from;
+		const struct ipt_acc_block *block;
+		struct ipt_acc_mask_24 *mask_24;
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(from_hash->bucket); i++) {
+			for (block = from_hash->bucket[i]; block;
+			     block = block->next) {
+				if (block->data.gen < since)
+					continue;
+				mask_24 = ipt_acc_hash_find(to, block->key << 8,
+					NULL);
+				if (mask_24 == NULL || ipt_acc_mask_24_merge(mask_24,
+				    &block->data, since, mark) != 0)
+					return -1;
 			}
+		}
+		return 0;
+	}
 
-			ipt_acc_tables[i].refcount++;
-			pr_debug("ACCOUNT: Refcount: %d\n", ipt_acc_tables[i].refcount);
-			return i;
+	/* Merge of 8 bit network */
+	if (depth == 0)
+		return ipt_acc_mask_24_merge(to, from, since, mark);
+
+	/* Merge of 16 bit network */
+	if (depth == 1) {
+		struct ipt_acc_mask_16 *to_16 = to;
+		const struct ipt_acc_mask_16 *from_16 = from;
+		unsigned int b;
+
+		for (b = 0; b <= 255; b++) {
+			if (from_16->mask_24[b] == NULL ||
+			    from_16->mask_24[b]->gen < since)
+				continue;
+			if (to_16->mask_24[b] == NULL &&
+			    (to_16->mask_24[b] = ipt_acc_zalloc_page()) == NULL)
+				return -1;
+			if (ipt_acc_mask_24_merge(to_16->mask_24[b],
+			    from_16->mask_24[b], since, mark) != 0)
+				return -1;
 		}
+		to_16->gen = max(to_16->gen, from_16->gen);
+		return 0;
 	}
 
-	/* Insert new table */
-	for (i = 0; i < ACCOUNT_MAX_TABLES; i++) {
-		/* Found free slot */
-		if (ipt_acc_tables[i].name[0] == 0) {
-			unsigned int netsize = 0;
-			uint32_t calc_mask;
-			int j;  /* needs to be signed, otherwise we risk endless loop */
-
-			pr_debug("ACCOUNT: Found free slot: %d\n", i);
-			strncpy(ipt_acc_tables[i].name, name, ACCOUNT_TABLE_NAME_LEN-1);
-
-			ipt_acc_tables[i].ip = ip;
-			ipt_acc_tables[i].netmask = netmask;
-
-			/* Calculate netsize */
-			calc_mask = htonl(netmask);
-			for (j = 31; j >= 0; j--) {
-				if (calc_mask & (1 << j))
-					netsize++;
-				else
-					break;
-			}
+	/* Merge of 24 bit network */
+	if (depth == 2) {
+		struct ipt_acc_mask_8 *to_8 = to;
+		const struct ipt_acc_mask_8 *from_8 = from;
+		unsigned int a;
 
-			/* Calculate depth from netsize */
-			if (netsize >= 24)
-				ipt_acc_tables[i].depth = 0;
-			else if (netsize >= 16)
-				ipt_acc_tables[i].depth = 1;
-			else if (netsize >= 8)
-				ipt_acc_tables[i].depth = 2;
-
-			pr_debug("ACCOUNT: calculated netsize: %u -> "
-				"ipt_acc_table depth %u\n", netsize,
-				ipt_acc_tables[i].depth);
-
-			ipt_acc_tables[i].refcount++;
-			if ((ipt_acc_tables[i].data
-			    = ipt_acc_zalloc_page()) == NULL) {
-				printk("ACCOUNT: out of memory for data of table: %s\n", name);
-				memset(&ipt_acc_tables[i], 0,
-					sizeof(struct ipt_acc_table));
+		for (a = 0; a <= 255; a++) {
+			if (from_8->mask_16[a] == NULL ||
+			    from_8->mask_16[a]->gen < since)
+				continue;
+			if (to_8->mask_16[a] == NULL &&
+			    (to_8->mask_16[a] = ipt_acc_zalloc_page()) == NULL)
 				return -1;
+			if (ipt_acc_data_merge(to_8->mask_16[a],
+			    from_8->mask_16[a], 1, since, mark) != 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Second pass of a read of the changes since @since: add the counters of
+   @from for every address that ipt_acc_data_merge() marked in @to, i.e.
+   that changed on any CPU. Returns -1 if out of memory */
+static int ipt_acc_data_collect(void *to, const void *from, uint8_t depth,
+				uint32_t since)
+{
+	if (from == NULL)
+		return 0;
+
+	/* Collect from hashed blocks */
+	if (depth == 3) {
+		const struct ipt_acc_hash *from_hash = from;
+		const struct ipt_acc_block *block;
+		struct ipt_acc_mask_24 *mask_24;
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(from_hash->bucket); i++) {
+			for (block = from_hash->bucket[i]; block;
+			     block = block->next) {
+				mask_24 = ipt_acc_hash_lookup(to, block->key);
+				if (mask_24 != NULL && ipt_acc_mask_24_collect(
+				    mask_24, &block->data, since) != 0)
+					return -1;
 			}
+		}
+		return 0;
+	}
 
-			return i;
+	/* Collect from 8 bit network */
+	if (depth == 0)
+		return ipt_acc_mask_24_collect(to, from, since);
+
+	/* Collect from 16 bit network */
+	if (depth == 1) {
+		struct ipt_acc_mask_16 *to_16 = to;
+		const struct ipt_acc_mask_16 *from_16 = from;
+		unsigned int b;
+
+		for (b = 0; b <= 255; b++) {
+			if (to_16->mask_24[b] == NULL ||
+			    from_16->mask_24[b] == NULL)
+				continue;
+			if (ipt_acc_mask_24_collect(to_16->mask_24[b],
+			    from_16->mask_24[b], since) != 0)
+				return -1;
 		}
+		return 0;
+	}
+
+	/* Collect from 24 bit network */
+	if (depth == 2) {
+		struct ipt_acc_mask_8 *to_8 = to;
+		const struct ipt_acc_mask_8 *from_8 = from;
+		unsigned int a;
+
+		for (a = 0; a <= 255; a++) {
+			if (to_8->mask_16[a] == NULL ||
+			    from_8->mask_16[a] == NULL)
+				continue;
+			if (ipt_acc_data_collect(to_8->mask_16[a],
+			    from_8->mask_16[a], 1, since) != 0)
+				return -1;
+		}
+		return 0;
 	}
 
-	/* No free slot found */
-	printk("ACCOUNT: No free table slot found (max: %d). "
-		"Please increase ACCOUNT_MAX_TABLES.\n", ACCOUNT_MAX_TABLES);
 	return -1;
 }
 
-static int ipt_acc_checkentry(const struct xt_tgchk_param *par)
+/* Number of IPs with traffic */
+static uint32_t ipt_acc_data_count(const void *data, uint8_t depth)
 {
-	struct ipt_acc_info *info = par->targinfo;
+	uint32_t count = 0;
+	unsigned int i;
+
+	if (data == NULL)
+		return 0;
+
+	if (depth == 0) {
+		const struct ipt_acc_mask_24 *mask_24 = data;
+
+		for (i = 0; i <= 255; i++)
+			if (mask_24->ip[i].src_packets ||
+			    mask_24->ip[i].dst_packets)
+				count++;
+		return count;
+	}
+
+	if (depth == 3) {
+		const struct ipt_acc_hash *hash = data;
+		const struct ipt_acc_block *block;
+
+		for (i = 0; i < ARRAY_SIZE(hash->bucket); i++)
+			for (block = hash->bucket[i]; block;
+			     block = block->next)
+				count += ipt_acc_data_count(&block->data, 0);
+		return count;
+	}
+
+	for (i = 0; i <= 255; i++) {
+		/* mask_16 and mask_8 are both arrays of 256 pointers */
+		const void *next = ((const struct ipt_acc_mask_8 *)data)->mask_16[i];
+
+		count += ipt_acc_data_count(next, depth - 1);
+	}
+	return count;
+}
+
+/* IPv6 traffic is accounted per /64: the unit of an address is its upper half */
+static inline uint64_t ipt_acc_ipv6_unit(const struct in6_addr *addr)
+{
+	return (uint64_t)ntohl(addr->s6_addr32[0]) << 32 |
+	       ntohl(addr->s6_addr32[1]);
+}
+
+static inline struct ipt_acc_table **ipt_acc_table_bucket(const char *name)
+{
+	uint32_t hash = jhash(name, strnlen(name, ACCOUNT_TABLE_NAME_LEN), 0);
+
+	return &ipt_acc_table_hash[hash_32(hash, ipt_acc_table_hash_bits)];
+}
+
+/* Look up a table by name. Must hold ipt_acc_mutex */
+static struct ipt_acc_table *ipt_acc_table_find(const char *tablename)
+{
+	struct ipt_acc_table *table;
+
+	for (table = *ipt_acc_table_bucket(tablename); table != NULL;
+	     table = table->next)
+		if (strncmp(table->name, tablename,
+		    ACCOUNT_TABLE_NAME_LEN) == 0)
+			return table;
+	return NULL;
+}
+
+/* Double the name hash once there are more tables than buckets. If that
+   fails, the old one keeps working with longer chains */
+static void ipt_acc_table_hash_grow(void)
+{
+	unsigned int i, old_size = 1U << ipt_acc_table_hash_bits;
+	struct ipt_acc_table **old_hash = ipt_acc_table_hash;
+	struct ipt_acc_table *table, *next, **bucket;
+
+	if (ipt_acc_table_count <= old_size)
+		return;
+	ipt_acc_table_hash = kcalloc(old_size * 2, sizeof(*old_hash),
+		GFP_KERNEL);
+	if (ipt_acc_table_hash == NULL) {
+		ipt_acc_table_hash = old_hash;
+		return;
+	}
+	ipt_acc_table_hash_bits++;
+
+	for (i = 0; i < old_size; i++) {
+		for (table = old_hash[i]; table != NULL; table = next) {
+			next = table->next;
+			bucket = ipt_acc_table_bucket(table->name);
+			table->next = *bucket;
+			*bucket = table;
+		}
+	}
+	kfree(old_hash);
+}
+
+/* Find a free slot for a table, doubling the array if there is none.
+   Returns the slot or -1 if out of memory */
+static int32_t ipt_acc_table_slot_alloc(void)
+{
+	struct ipt_acc_table_slots *slots, *old_slots;
+	unsigned int i;
+
+	old_slots = rcu_dereference_protected(ipt_acc_table_slots,
+		lockdep_is_held(&ipt_acc_mutex));
+	for (i = ipt_acc_table_free; i < old_slots->size; i++)
+		if (old_slots->table[i] == NULL)
+			return ipt_acc_table_free = i;
+
+	slots = kzalloc(sizeof(*slots) +
+		old_slots->size * 2 * sizeof(slots->table[0]), GFP_KERNEL);
+	if (slots == NULL)
+		return -1;
+	slots->size = old_slots->size * 2;
+	memcpy(slots->table, old_slots->table,
+		old_slots->size * sizeof(slots->table[0]));
+
+	/* Packets may still look up their tables in the old array */
+	rcu_assign_pointer(ipt_acc_table_slots, slots);
+	synchronize_rcu_bh();
+	kfree(old_slots);
+	return ipt_acc_table_free = i;
+}
+
+/* Look for existing table / insert new one.
+   @cpu is preallocated per-CPU storage, which a new table takes over.
+   Return internal ID or -1 on error */
+static int ipt_acc_table_insert(const char *name, uint8_t family,
+				const union nf_inet_addr *net_ip, uint8_t prefix,
+				uint8_t flags, struct ipt_acc_cpu __percpu **cpu)
+{
+	struct ipt_acc_table *table, **bucket;
+	struct ipt_acc_table_slots *slots;
+	__be32 ip = 0, netmask = 0;
+	uint64_t unit_net, unit_mask;
+	uint8_t depth;
+
+	/* Calculate the units and the depth from the prefix length */
+	if (family == NFPROTO_IPV6) {
+		unit_mask = prefix ? ~0ULL << (64 - prefix) : 0;
+		unit_net = ipt_acc_ipv6_unit(&net_ip->in6) & unit_mask;
+		/* ::/0 is the same special case as 0.0.0.0/0 */
+		depth = (prefix == 0) ? 0 : 3;
+	} else {
+		netmask = htonl(prefix ? ~0U << (32 - prefix) : 0);
+		/* Exported as the base of all addresses, so no host bits */
+		ip = net_ip->ip & netmask;
+		unit_mask = ntohl(netmask);
+		unit_net = ntohl(ip & netmask);
+		if (prefix == 0 || prefix >= 24)
+			depth = 0;
+		else if (prefix >= 16)
+			depth = 1;
+		else if (prefix >= 8)
+			depth = 2;
+		else
+			depth = 3;
+	}
+
+	pr_debug("ACCOUNT: ipt_acc_table_insert: %s, family %u, "
+		"%u.%u.%u.%u/%u.%u.%u.%u, prefix %u -> depth %u\n",
+		name, family, NIPQUAD(ip), NIPQUAD(netmask), prefix, depth);
+
+	/* Look for existing table */
+	table = ipt_acc_table_find(name);
+	if (table != NULL) {
+		pr_debug("ACCOUNT: Found existing slot: %d - "
+			"%u.%u.%u.%u/%u.%u.%u.%u\n", table->nr,
+			NIPQUAD(table->ip), NIPQUAD(table->netmask));
+
+		if (table->family != family || table->prefix != prefix ||
+		    table->ip != ip || table->unit_net != unit_net ||
+		    table->flags != flags) {
+			printk("ACCOUNT: Table %s found, but family/IP/netmask/"
+				"flags mismatch. Family %u, prefix %u, flags %#x "
+				"found\n", name, table->family, table->prefix,
+				table->flags);
+			return -1;
+		}
+
+		table->refcount++;
+		pr_debug("ACCOUNT: Refcount: %d\n", table->refcount);
+		return table->nr;
+	}
+
+	/* Insert new table */
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (table == NULL) {
+		printk("ACCOUNT: out of memory for table: %s\n", name);
+		return -1;
+	}
+	if (ipt_acc_pool_init(&table->pool, depth, flags) != 0) {
+		printk("ACCOUNT: out of memory for block pool of table: %s\n",
+			name);
+		ipt_acc_pool_destroy(&table->pool);
+		kfree(table);
+		return -1;
+	}
+	table->nr = ipt_acc_table_slot_alloc();
+	if (table->nr < 0) {
+		printk("ACCOUNT: out of memory for table slots\n");
+		ipt_acc_pool_destroy(&table->pool);
+		kfree(table);
+		return -1;
+	}
+
+	pr_debug("ACCOUNT: Found free slot: %d\n", table->nr);
+	strncpy(table->name, name, ACCOUNT_TABLE_NAME_LEN-1);
+	table->family = family;
+	table->prefix = prefix;
+	table->ip = ip;
+	table->netmask = netmask;
+	table->unit_net = unit_net;
+	table->unit_mask = unit_mask;
+	table->depth = depth;
+	table->flags = flags;
+	table->refcount++;
+	table->gen = 1;
+	table->cpu = *cpu;
+	*cpu = NULL;
+
+	bucket = ipt_acc_table_bucket(table->name);
+	table->next = *bucket;
+	*bucket = table;
+	ipt_acc_table_count++;
+	ipt_acc_table_hash_grow();
+
+	/* No packet can get here before a rule with the slot exists */
+	slots = rcu_dereference_protected(ipt_acc_table_slots,
+		lockdep_is_held(&ipt_acc_mutex));
+	slots->table[table->nr] = table;
+	return table->nr;
+}
+
+/* Get a reference to a table, creating it if needed.
+   Returns its internal ID or a negative error code */
+static int ipt_acc_table_get(const char *name, uint8_t family,
+			     const union nf_inet_addr *net_ip, uint8_t prefix,
+			     uint8_t flags)
+{
+	struct ipt_acc_cpu __percpu *cpu;
+	bool proc;
 	int table_nr;
 
-	spin_lock_bh(&ipt_acc_lock);
-	table_nr = ipt_acc_table_insert(info->table_name, info->net_ip,
-		info->net_mask);
-	spin_unlock_bh(&ipt_acc_lock);
+	/* The name is also that of the snapshot file */
+	if (strnlen(name, ACCOUNT_TABLE_NAME_LEN) == ACCOUNT_TABLE_NAME_LEN ||
+	    *name == '\0' || strchr(name, '/') != NULL ||
+	    strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		printk("ACCOUNT: Invalid table name\n");
+		return -EINVAL;
+	}
+
+	/* Allocated up front, so that only a new table needs the mutex */
+	cpu = alloc_percpu(struct ipt_acc_cpu);
+	if (cpu == NULL) {
+		printk("ACCOUNT: out of memory for data of table: %s\n", name);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&ipt_acc_table_mutex);
+	mutex_lock(&ipt_acc_mutex);
+	table_nr = ipt_acc_table_insert(name, family, net_ip, prefix, flags,
+		&cpu);
+	mutex_unlock(&ipt_acc_mutex);
+	/* Taken over only by a new table, which gets its snapshot file.
+	   The table works without one */
+	if (cpu == NULL) {
+		proc = proc_create(name, S_IRUSR | S_IWUSR, ipt_acc_proc_dir,
+		       &ipt_acc_proc_fops) != NULL;
+		if (!proc)
+			printk("ACCOUNT: Can't create "
+				"/proc/net/xt_ACCOUNT/%s\n", name);
+		mutex_lock(&ipt_acc_mutex);
+		ipt_acc_table_find(name)->proc = proc;
+		mutex_unlock(&ipt_acc_mutex);
+	}
+	mutex_unlock(&ipt_acc_table_mutex);
+	free_percpu(cpu);
 
 	if (table_nr == -1) {
 		printk("ACCOUNT: Table insert problem. Aborting\n");
 		return -EINVAL;
 	}
+	return table_nr;
+}
+
+static int ipt_acc_checkentry(const struct xt_tgchk_param *par)
+{
+	struct ipt_acc_info *info = par->targinfo;
+	union nf_inet_addr net_ip = {.ip = info->net_ip};
+	uint32_t calc_mask = ntohl(info->net_mask);
+	uint8_t prefix = 0;
+	int table_nr;
+
+	/* Calculate netsize */
+	while (prefix < 32 && (calc_mask & (0x80000000U >> prefix)))
+		prefix++;
+
+	table_nr = ipt_acc_table_get(info->table_name, NFPROTO_IPV4,
+		&net_ip, prefix, 0);
+	if (table_nr < 0)
+		return table_nr;
+
 	/* Table nr caching so we don't have to do an extra string compare
 	   for every packet */
 	info->table_nr = table_nr;
@@ -275,56 +1080,134 @@ static int ipt_acc_checkentry(const struct xt_tgchk_param *par)
 	return 0;
 }
 
-static void ipt_acc_destroy(const struct xt_tgdtor_param *par)
+static int ipt_acc_checkentry_v2(const struct xt_tgchk_param *par)
 {
-	unsigned int i;
-	struct ipt_acc_info *info = par->targinfo;
+	struct ipt_acc_info_v2 *info = par->targinfo;
+	int table_nr;
+
+	if (info->net_prefix > ((par->family == NFPROTO_IPV6) ? 64 : 32)) {
+		printk("ACCOUNT: prefix length %u too large; IPv6 is accounted "
+			"per /64\n", info->net_prefix);
+		return -EINVAL;
+	}
+	if ((info->flags & ~ACCOUNT_F_PROTO) != 0)
+		return -EINVAL;
 
-	spin_lock_bh(&ipt_acc_lock);
+	table_nr = ipt_acc_table_get(info->table_name, par->family,
+		&info->net_ip, info->net_prefix, info->flags);
+	if (table_nr < 0)
+		return table_nr;
+
+	info->table_nr = table_nr;
+	return 0;
+}
+
+/* Drop a reference to a table, destroying it with the last one */
+static void ipt_acc_table_put(const char *name, int32_t table_nr)
+{
+	struct ipt_acc_table *table, **pprev;
+	struct ipt_acc_table_slots *slots;
+	bool destroyed, proc = false;
+
+	mutex_lock(&ipt_acc_table_mutex);
+	mutex_lock(&ipt_acc_mutex);
 
 	pr_debug("ACCOUNT: ipt_acc_deleteentry called for table: %s (#%d)\n",
-		info->table_name, info->table_nr);
+		name, table_nr);
+
+	/* Look for table */
+	table = ipt_acc_table_find(name);
+	if (table == NULL) {
+		printk("ACCOUNT: Table %s not found for destroy\n", name);
+		mutex_unlock(&ipt_acc_mutex);
+		mutex_unlock(&ipt_acc_table_mutex);
+		return;
+	}
+	pr_debug("ACCOUNT: Found table at slot: %d\n", table->nr);
+
+	table->refcount--;
+	pr_debug("ACCOUNT: Refcount left: %d\n", table->refcount);
+
+	/* Table not needed anymore? The rules that used it are gone, so
+	   no packet can look it up anymore */
+	destroyed = table->refcount == 0;
+	if (destroyed) {
+		pr_debug("ACCOUNT: Destroying table at slot: %d\n", table->nr);
+		for (pprev = ipt_acc_table_bucket(name); *pprev != table;
+		     pprev = &(*pprev)->next)
+			;
+		*pprev = table->next;
+		ipt_acc_table_count--;
+
+		slots = rcu_dereference_protected(ipt_acc_table_slots,
+			lockdep_is_held(&ipt_acc_mutex));
+		slots->table[table->nr] = NULL;
+		if (table->nr < ipt_acc_table_free)
+			ipt_acc_table_free = table->nr;
+
+		proc = table->proc;
+		ipt_acc_table_free_data(table);
+		free_percpu(table->cpu);
+		ipt_acc_pool_destroy(&table->pool);
+		kfree(table);
+	}
+
+	mutex_unlock(&ipt_acc_mutex);
+	/* Waits for opens of the file, so not under the mutex */
+	if (proc)
+		remove_proc_entry(name, ipt_acc_proc_dir);
+	mutex_unlock(&ipt_acc_table_mutex);
+}
 
+static void ipt_acc_destroy(const struct xt_tgdtor_param *par)
+{
+	struct ipt_acc_info *info = par->targinfo;
+
+	ipt_acc_table_put(info->table_name, info->table_nr);
 	info->table_nr = -1;	/* Set back to original state */
+}
 
-	/* Look for table */
-	for (i = 0; i < ACCOUNT_MAX_TABLES; i++) {
-		if (strncmp(ipt_acc_tables[i].name, info->table_name,
-		    ACCOUNT_TABLE_NAME_LEN) == 0) {
-			pr_debug("ACCOUNT: Found table at slot: %d\n", i);
-
-			ipt_acc_tables[i].refcount--;
-			pr_debug("ACCOUNT: Refcount left: %d\n",
-				ipt_acc_tables[i].refcount);
-
-			/* Table not needed anymore? */
-			if (ipt_acc_tables[i].refcount == 0) {
-				pr_debug("ACCOUNT: Destroying table at slot: %d\n", i);
-				ipt_acc_data_free(ipt_acc_tables[i].data,
-					ipt_acc_tables[i].depth);
-				memset(&ipt_acc_tables[i], 0,
-					sizeof(struct ipt_acc_table));
-			}
+static void ipt_acc_destroy_v2(const struct xt_tgdtor_param *par)
+{
+	struct ipt_acc_info_v2 *info = par->targinfo;
 
-			spin_unlock_bh(&ipt_acc_lock);
-			return;
-		}
+	ipt_acc_table_put(info->table_name, info->table_nr);
+	info->table_nr = -1;
+}
+
+/* Count a packet of class @proto once more by protocol, for tables with
+   ACCOUNT_F_PROTO. ACCOUNT_PROTO_OTHER is left to the totals */
+static void ipt_acc_proto_insert(struct ipt_acc_pool *pool,
+				 struct ipt_acc_mask_24 *mask_24,
+				 uint8_t slot, uint8_t proto, bool is_dst,
+				 uint32_t size)
+{
+	struct ipt_acc_ip *ip;
+
+	if (proto >= ACCOUNT_PROTO_OTHER)
+		return;
+	if (mask_24->proto == NULL &&
+	    (mask_24->proto = ipt_acc_pool_take(pool)) == NULL)
+		return;
+
+	ip = &mask_24->proto->ip[proto][slot];
+	if (is_dst) {
+		ip->dst_packets++;
+		ip->dst_bytes += size;
+	} else {
+		ip->src_packets++;
+		ip->src_bytes += size;
 	}
-
-	/* Table not found */
-	printk("ACCOUNT: Table %s not found for destroy\n", info->table_name);
-	spin_unlock_bh(&ipt_acc_lock);
 }
 
-static void ipt_acc_depth0_insert(struct ipt_acc_mask_24 *mask_24,
+static void ipt_acc_depth0_insert(struct ipt_acc_pool *pool,
+				  struct ipt_acc_mask_24 *mask_24,
 				  __be32 net_ip, __be32 netmask,
 				  __be32 src_ip, __be32 dst_ip,
-				   uint32_t size, uint32_t *itemcount)
+				  uint32_t size, uint32_t gen, uint8_t proto)
 {
 	uint8_t src_slot, dst_slot;
 	bool is_src = false, is_dst = false;
-	/* Check if this entry is new */
-	bool is_src_new_ip = false, is_dst_new_ip = false;
 
 	pr_debug("ACCOUNT: ipt_acc_depth0_insert: %u.%u.%u.%u/%u.%u.%u.%u "
 		"for net %u.%u.%u.%u/%u.%u.%u.%u, size: %u\n", NIPQUAD(src_ip),
@@ -354,49 +1237,31 @@ static void ipt_acc_depth0_insert(struct ipt_acc_mask_24 *mask_24,
 	if (is_src) {
 		/* Calculate network slot */
 		pr_debug("ACCOUNT: Calculated SRC 8 bit network slot: %d\n", src_slot);
-		if (!mask_24->ip[src_slot].src_packets
-		    && !mask_24->ip[src_slot].dst_packets)
-			is_src_new_ip = true;
-
 		mask_24->ip[src_slot].src_packets++;
 		mask_24->ip[src_slot].src_bytes += size;
+		mask_24->ip_gen[src_slot] = gen;
+		ipt_acc_proto_insert(pool, mask_24, src_slot, proto, false,
+			size);
 	}
 	if (is_dst) {
 		pr_debug("ACCOUNT: Calculated DST 8 bit network slot: %d\n", dst_slot);
-		if (!mask_24->ip[dst_slot].src_packets
-		    && !mask_24->ip[dst_slot].dst_packets)
-			is_dst_new_ip = true;
-
 		mask_24->ip[dst_slot].dst_packets++;
 		mask_24->ip[dst_slot].dst_bytes += size;
+		mask_24->ip_gen[dst_slot] = gen;
+		ipt_acc_proto_insert(pool, mask_24, dst_slot, proto, true,
+			size);
 	}
-
-	/* Increase itemcounter */
-	pr_debug("ACCOUNT: Itemcounter before: %d\n", *itemcount);
-	if (src_slot == dst_slot) {
-		if (is_src_new_ip || is_dst_new_ip) {
-			pr_debug("ACCOUNT: src_slot == dst_slot: %d, %d\n",
-				is_src_new_ip, is_dst_new_ip);
-			++*itemcount;
-		}
-	} else {
-		if (is_src_new_ip) {
-			pr_debug("ACCOUNT: New src_ip: %u.%u.%u.%u\n", NIPQUAD(src_ip));
-			++*itemcount;
-		}
-		if (is_dst_new_ip) {
-			pr_debug("ACCOUNT: New dst_ip: %u.%u.%u.%u\n", NIPQUAD(dst_ip));
-			++*itemcount;
-		}
-	}
-	pr_debug("ACCOUNT: Itemcounter after: %d\n", *itemcount);
+	mask_24->gen = gen;
 }
 
-static void ipt_acc_depth1_insert(struct ipt_acc_mask_16 *mask_16,
+static void ipt_acc_depth1_insert(struct ipt_acc_pool *pool,
+				  struct ipt_acc_mask_16 *mask_16,
 				  __be32 net_ip, __be32 netmask,
 				  __be32 src_ip, __be32 dst_ip,
-				uint32_t size, uint32_t *itemcount)
+				uint32_t size, uint32_t gen, uint8_t proto)
 {
+	mask_16->gen = gen;
+
 	/* Do we need to process src IP? */
 	if ((net_ip & netmask) == (src_ip & netmask)) {
 		uint8_t slot = (ntohl(src_ip) & 0xFF00) >> 8;
@@ -404,13 +1269,11 @@ static void ipt_acc_depth1_insert(struct ipt_acc_mask_16 *mask_16,
 
 		/* Do we need to create a new mask_24 bucket? */
 		if (!mask_16->mask_24[slot] && (mask_16->mask_24[slot] =
-		    ipt_acc_zalloc_page()) == NULL) {
-			printk("ACCOUNT: Can't process packet because out of memory!\n");
+		    ipt_acc_pool_take(pool)) == NULL)
 			return;
-		}
 
-		ipt_acc_depth0_insert(mask_16->mask_24[slot],
-			net_ip, netmask, src_ip, 0, size, itemcount);
+		ipt_acc_depth0_insert(pool, mask_16->mask_24[slot],
+			net_ip, netmask, src_ip, 0, size, gen, proto);
 	}
 
 	/* Do we need to process dst IP? */
@@ -420,20 +1283,19 @@ static void ipt_acc_depth1_insert(struct ipt_acc_mask_16 *mask_16,
 
 		/* Do we need to create a new mask_24 bucket? */
 		if (!mask_16->mask_24[slot] && (mask_16->mask_24[slot]
-		    = ipt_acc_zalloc_page()) == NULL) {
-			printk("ACCOUT: Can't process packet because out of memory!\n");
+		    = ipt_acc_pool_take(pool)) == NULL)
 			return;
-		}
 
-		ipt_acc_depth0_insert(mask_16->mask_24[slot],
-			net_ip, netmask, 0, dst_ip, size, itemcount);
+		ipt_acc_depth0_insert(pool, mask_16->mask_24[slot],
+			net_ip, netmask, 0, dst_ip, size, gen, proto);
 	}
 }
 
-static void ipt_acc_depth2_insert(struct ipt_acc_mask_8 *mask_8,
+static void ipt_acc_depth2_insert(struct ipt_acc_pool *pool,
+				  struct ipt_acc_mask_8 *mask_8,
 				  __be32 net_ip, __be32 netmask,
 				  __be32 src_ip, __be32 dst_ip,
-				uint32_t size, uint32_t *itemcount)
+				uint32_t size, uint32_t gen, uint8_t proto)
 {
 	/* Do we need to process src IP? */
 	if ((net_ip & netmask) == (src_ip & netmask)) {
@@ -442,13 +1304,11 @@ static void ipt_acc_depth2_insert(struct ipt_acc_mask_8 *mask_8,
 
 		/* Do we need to create a new mask_24 bucket? */
 		if (!mask_8->mask_16[slot] && (mask_8->mask_16[slot]
-		    = ipt_acc_zalloc_page()) == NULL) {
-			printk("ACCOUNT: Can't process packet because out of memory!\n");
+		    = ipt_acc_pool_take(pool)) == NULL)
 			return;
-		}
 
-		ipt_acc_depth1_insert(mask_8->mask_16[slot],
-			net_ip, netmask, src_ip, 0, size, itemcount);
+		ipt_acc_depth1_insert(pool, mask_8->mask_16[slot],
+			net_ip, netmask, src_ip, 0, size, gen, proto);
 	}
 
 	/* Do we need to process dst IP? */
@@ -458,75 +1318,166 @@ static void ipt_acc_depth2_insert(struct ipt_acc_mask_8 *mask_8,
 
 		/* Do we need to create a new mask_24 bucket? */
 		if (!mask_8->mask_16[slot] && (mask_8->mask_16[slot]
-		    = ipt_acc_zalloc_page()) == NULL) {
-			printk("ACCOUNT: Can't process packet because out of memory!\n");
+		    = ipt_acc_pool_take(pool)) == NULL)
 			return;
-		}
 
-		ipt_acc_depth1_insert(mask_8->mask_16[slot],
-			net_ip, netmask, 0, dst_ip, size, itemcount);
+		ipt_acc_depth1_insert(pool, mask_8->mask_16[slot],
+			net_ip, netmask, 0, dst_ip, size, gen, proto);
 	}
 }
 
-static unsigned int
-ipt_acc_target(struct sk_buff *skb, const struct xt_action_param *par)
+/* Count a packet into a hashed table. @src and @dst are units, see
+   struct ipt_acc_table */
+static void ipt_acc_hash_insert(struct ipt_acc_pool *pool,
+				struct ipt_acc_hash *hash,
+				const struct ipt_acc_table *table,
+				uint64_t src, uint64_t dst, uint32_t size,
+				uint32_t gen, uint8_t proto)
 {
-	const struct ipt_acc_info *info =
-		par->targinfo;
+	struct ipt_acc_mask_24 *mask_24;
+
+	if ((src & table->unit_mask) == table->unit_net) {
+		if ((mask_24 = ipt_acc_hash_find(hash, src, pool)) == NULL)
+			return;
+		mask_24->ip[src & 0xFF].src_packets++;
+		mask_24->ip[src & 0xFF].src_bytes += size;
+		mask_24->ip_gen[src & 0xFF] = gen;
+		mask_24->gen = gen;
+		ipt_acc_proto_insert(pool, mask_24, src & 0xFF, proto, false,
+			size);
+	}
+
+	if ((dst & table->unit_mask) == table->unit_net) {
+		if ((mask_24 = ipt_acc_hash_find(hash, dst, pool)) == NULL)
+			return;
+		mask_24->ip[dst & 0xFF].dst_packets++;
+		mask_24->ip[dst & 0xFF].dst_bytes += size;
+		mask_24->ip_gen[dst & 0xFF] = gen;
+		mask_24->gen = gen;
+		ipt_acc_proto_insert(pool, mask_24, dst & 0xFF, proto, true,
+			size);
+	}
+}
+
+/* ACCOUNT_PROTO_* class of a transport protocol */
+static inline uint8_t ipt_acc_proto_class(uint8_t protocol)
+{
+	switch (protocol) {
+	case IPPROTO_TCP:
+		return ACCOUNT_PROTO_TCP;
+	case IPPROTO_UDP:
+		return ACCOUNT_PROTO_UDP;
+	default:
+		return ACCOUNT_PROTO_OTHER;
+	}
+}
+
+static void ipt_acc_account(int32_t table_nr, const struct sk_buff *skb)
+{
+	struct ipt_acc_table *table;
+	__be32 src_ip = 0, dst_ip = 0;
+	uint64_t src, dst;
+	uint32_t size, gen;
+	uint8_t proto = ACCOUNT_PROTO_OTHER;
+	struct ipt_acc_cpu *pcpu;
+	void *data;
+
+	/* The table is pinned by our rule, only this CPU's data is touched.
+	   A flush may take the tree away, but not before we are done */
+	rcu_read_lock_bh();
+	table = rcu_dereference_bh(ipt_acc_table_slots)->table[table_nr];
+	if (table == NULL) {
+		printk("ACCOUNT: ipt_acc_target: Invalid table id %u\n",
+			table_nr);
+		goto out;
+	}
+
+	if (table->family == NFPROTO_IPV6) {
+		const struct ipv6hdr *iph = ipv6_hdr(skb);
 
-	__be32 src_ip = ip_hdr(skb)->saddr;
-	__be32 dst_ip = ip_hdr(skb)->daddr;
-	uint32_t size = ntohs(ip_hdr(skb)->tot_len);
+		src = ipt_acc_ipv6_unit(&iph->saddr);
+		dst = ipt_acc_ipv6_unit(&iph->daddr);
+		size = sizeof(*iph) + ntohs(iph->payload_len);
+		if (table->flags & ACCOUNT_F_PROTO) {
+			uint8_t nexthdr = iph->nexthdr;
+			__be16 frag_off;
+
+			if (ipv6_skip_exthdr(skb, sizeof(*iph), &nexthdr,
+			    &frag_off) >= 0)
+				proto = ipt_acc_proto_class(nexthdr);
+		}
+	} else {
+		src_ip = ip_hdr(skb)->saddr;
+		dst_ip = ip_hdr(skb)->daddr;
+		src = ntohl(src_ip);
+		dst = ntohl(dst_ip);
+		size = ntohs(ip_hdr(skb)->tot_len);
+		if (table->flags & ACCOUNT_F_PROTO)
+			proto = ipt_acc_proto_class(ip_hdr(skb)->protocol);
+	}
 
-	spin_lock_bh(&ipt_acc_lock);
+	pcpu = this_cpu_ptr(table->cpu);
+	data = rcu_dereference_bh(pcpu->data);
+	gen = ACCESS_ONCE(table->gen);
 
-	if (ipt_acc_tables[info->table_nr].name[0] == 0) {
-		printk("ACCOUNT: ipt_acc_target: Invalid table id %u. "
-			"IPs %u.%u.%u.%u/%u.%u.%u.%u\n", info->table_nr,
-			NIPQUAD(src_ip), NIPQUAD(dst_ip));
-		spin_unlock_bh(&ipt_acc_lock);
-		return XT_CONTINUE;
+	if (data == NULL) {
+		if ((data = ipt_acc_pool_take(&table->pool)) == NULL)
+			goto out;
+		rcu_assign_pointer(pcpu->data, data);
 	}
 
-	/* 8 bit network or "any" network */
-	if (ipt_acc_tables[info->table_nr].depth == 0) {
-		/* Count packet and check if the IP is new */
-		ipt_acc_depth0_insert(
-			ipt_acc_tables[info->table_nr].data,
-			ipt_acc_tables[info->table_nr].ip,
-			ipt_acc_tables[info->table_nr].netmask,
-			src_ip, dst_ip, size, &ipt_acc_tables[info->table_nr].itemcount);
-		spin_unlock_bh(&ipt_acc_lock);
-		return XT_CONTINUE;
+	/* 8 bit network or "any" network. For IPv6, only ::/0 gets here,
+	   and the zero addresses make it count into slot 0 just the same */
+	if (table->depth == 0) {
+		ipt_acc_depth0_insert(&table->pool, data, table->ip,
+			table->netmask, src_ip, dst_ip, size, gen, proto);
+		goto out;
 	}
 
 	/* 16 bit network */
-	if (ipt_acc_tables[info->table_nr].depth == 1) {
-		ipt_acc_depth1_insert(
-			ipt_acc_tables[info->table_nr].data,
-			ipt_acc_tables[info->table_nr].ip,
-			ipt_acc_tables[info->table_nr].netmask,
-			src_ip, dst_ip, size, &ipt_acc_tables[info->table_nr].itemcount);
-		spin_unlock_bh(&ipt_acc_lock);
-		return XT_CONTINUE;
+	if (table->depth == 1) {
+		ipt_acc_depth1_insert(&table->pool, data, table->ip,
+			table->netmask, src_ip, dst_ip, size, gen, proto);
+		goto out;
 	}
 
 	/* 24 bit network */
-	if (ipt_acc_tables[info->table_nr].depth == 2) {
-		ipt_acc_depth2_insert(
-			ipt_acc_tables[info->table_nr].data,
-			ipt_acc_tables[info->table_nr].ip,
-			ipt_acc_tables[info->table_nr].netmask,
-			src_ip, dst_ip, size, &ipt_acc_tables[info->table_nr].itemcount);
-		spin_unlock_bh(&ipt_acc_lock);
-		return XT_CONTINUE;
+	if (table->depth == 2) {
+		ipt_acc_depth2_insert(&table->pool, data, table->ip,
+			table->netmask, src_ip, dst_ip, size, gen, proto);
+		goto out;
+	}
+
+	/* Anything larger, and IPv6 */
+	if (table->depth == 3) {
+		ipt_acc_hash_insert(&table->pool, data, table, src, dst, size,
+			gen, proto);
+		goto out;
 	}
 
 	printk("ACCOUNT: ipt_acc_target: Unable to process packet. "
 		"Table id %u. IPs %u.%u.%u.%u/%u.%u.%u.%u\n",
-		info->table_nr, NIPQUAD(src_ip), NIPQUAD(dst_ip));
+		table_nr, NIPQUAD(src_ip), NIPQUAD(dst_ip));
+
+ out:
+	rcu_read_unlock_bh();
+}
+
+static unsigned int
+ipt_acc_target(struct sk_buff *skb, const struct xt_action_param *par)
+{
+	const struct ipt_acc_info *info = par->targinfo;
+
+	ipt_acc_account(info->table_nr, skb);
+	return XT_CONTINUE;
+}
+
+static unsigned int
+ipt_acc_target_v2(struct sk_buff *skb, const struct xt_action_param *par)
+{
+	const struct ipt_acc_info_v2 *info = par->targinfo;
 
-	spin_unlock_bh(&ipt_acc_lock);
+	ipt_acc_account(info->table_nr, skb);
 	return XT_CONTINUE;
 }
 
@@ -576,34 +1527,37 @@ static int ipt_acc_handle_free(unsigned int handle)
 	}
 
 	ipt_acc_data_free(ipt_acc_handles[handle].data,
-		ipt_acc_handles[handle].depth);
+		ipt_acc_handles[handle].depth, NULL);
 	memset(&ipt_acc_handles[handle], 0, sizeof(struct ipt_acc_handle));
 	return 0;
 }
 
-/* Prepare data for read without flush. Use only for debugging!
-   Real applications should use read&flush as it's way more efficent */
-static int ipt_acc_handle_prepare_read(char *tablename,
-		 struct ipt_acc_handle *dest, uint32_t *count)
+/* Prepare data for read without flush. Only addresses that changed in
+   generation *@generation or later are taken, 0 takes all; it is then set
+   to the generation to pass for the next changes. Reading everything is
+   for debugging only, real applications should use read&flush as it's
+   way more efficent */
+static int ipt_acc_handle_prepare_read(const char *tablename,
+		 struct ipt_acc_handle *dest, uint32_t *count,
+		 uint32_t *generation)
 {
-	int table_nr = -1;
-	uint8_t depth;
-
-	for (table_nr = 0; table_nr < ACCOUNT_MAX_TABLES; table_nr++)
-		if (strncmp(ipt_acc_tables[table_nr].name, tablename,
-		    ACCOUNT_TABLE_NAME_LEN) == 0)
-			break;
+	uint32_t since = *generation;
+	struct ipt_acc_table *table;
+	unsigned int cpu, pass;
+	int ret;
 
-	if (table_nr == ACCOUNT_MAX_TABLES) {
+	table = ipt_acc_table_find(tablename);
+	if (table == NULL) {
 		printk("ACCOUNT: ipt_acc_handle_prepare_read(): "
 			"Table %s not found\n", tablename);
 		return -1;
 	}
 
 	/* Fill up handle structure */
-	dest->ip = ipt_acc_tables[table_nr].ip;
-	dest->depth = ipt_acc_tables[table_nr].depth;
-	dest->itemcount = ipt_acc_tables[table_nr].itemcount;
+	dest->ip = table->ip;
+	dest->family = table->family;
+	dest->depth = table->depth;
+	dest->flags = table->flags;
 
 	/* allocate "root" table */
 	if ((dest->data = ipt_acc_zalloc_page()) == NULL) {
@@ -612,127 +1566,268 @@ static int ipt_acc_handle_prepare_read(char *tablename,
 		return -1;
 	}
 
-	/* Recursive copy of complete data structure */
-	depth = dest->depth;
-	if (depth == 0) {
-		memcpy(dest->data,
-			ipt_acc_tables[table_nr].data,
-			sizeof(struct ipt_acc_mask_24));
-	} else if (depth == 1) {
-		struct ipt_acc_mask_16 *src_16 =
-			ipt_acc_tables[table_nr].data;
-		struct ipt_acc_mask_16 *network_16 = dest->data;
-		unsigned int b;
-
-		for (b = 0; b <= 255; b++) {
-			if (src_16->mask_24[b] == NULL)
-				continue;
-			if ((network_16->mask_24[b] =
-			    ipt_acc_zalloc_page()) == NULL) {
-				printk("ACCOUNT: out of memory during copy of 16 bit "
-					"network in ipt_acc_handle_prepare_read()\n");
-				ipt_acc_data_free(dest->data, depth);
-				return -1;
-			}
-
-			memcpy(network_16->mask_24[b], src_16->mask_24[b],
-				sizeof(struct ipt_acc_mask_24));
-		}
-	} else if (depth == 2) {
-		struct ipt_acc_mask_8 *src_8 =
-			ipt_acc_tables[table_nr].data;
-		struct ipt_acc_mask_8 *network_8 = dest->data;
-		struct ipt_acc_mask_16 *src_16, *network_16;
-		unsigned int a, b;
-
-		for (a = 0; a <= 255; a++) {
-			if (src_8->mask_16[a] == NULL)
-				continue;
-			if ((network_8->mask_16[a] =
-			    ipt_acc_zalloc_page()) == NULL) {
-				printk("ACCOUNT: out of memory during copy of 24 bit network"
-					" in ipt_acc_handle_prepare_read()\n");
-				ipt_acc_data_free(dest->data, depth);
+	/* Packets still stamped with the current generation after we looked
+	   are caught by the next read, which starts at it again */
+	*generation = table->gen;
+	ACCESS_ONCE(table->gen) = table->gen + 1;
+
+	/* Sum up the data of all CPUs. The trees can only be freed under
+	   the mutex, and the packet path does nothing but add to them.
+	   An address may have changed on one CPU only, but its totals are
+	   spread over all: the first pass marks the addresses that changed
+	   anywhere, the second sums those up on every CPU */
+	for (pass = 0; pass < 2; pass++) {
+		for_each_possible_cpu(cpu) {
+			struct ipt_acc_cpu *pcpu = per_cpu_ptr(table->cpu, cpu);
+			const void *data = rcu_dereference_protected(pcpu->data,
+				lockdep_is_held(&ipt_acc_mutex));
+
+			if (pass == 0)
+				ret = ipt_acc_data_merge(dest->data, data,
+					dest->depth, since, true);
+			else
+				ret = ipt_acc_data_collect(dest->data, data,
+					dest->depth, since);
+			if (ret != 0) {
+				printk("ACCOUNT: out of memory during copy "
+					"in ipt_acc_handle_prepare_read()\n");
+				ipt_acc_data_free(dest->data, dest->depth,
+					NULL);
 				return -1;
 			}
-
-			memcpy(network_8->mask_16[a], src_8->mask_16[a],
-				sizeof(struct ipt_acc_mask_16));
-
-			src_16 = src_8->mask_16[a];
-			network_16 = network_8->mask_16[a];
-
-			for (b = 0; b <= 255; b++) {
-				if (src_16->mask_24[b] == NULL)
-					continue;
-				if ((network_16->mask_24[b] =
-				    ipt_acc_zalloc_page()) == NULL) {
-					printk("ACCOUNT: out of memory during copy of 16 bit"
-						" network in ipt_acc_handle_prepare_read()\n");
-					ipt_acc_data_free(dest->data, depth);
-					return -1;
-				}
-
-				memcpy(network_16->mask_24[b], src_16->mask_24[b],
-					sizeof(struct ipt_acc_mask_24));
-			}
 		}
 	}
 
-	*count = ipt_acc_tables[table_nr].itemcount;
-
+	dest->itemcount = *count = ipt_acc_data_count(dest->data, dest->depth);
 	return 0;
 }
 
 /* Prepare data for read and flush it */
-static int ipt_acc_handle_prepare_read_flush(char *tablename,
+static int ipt_acc_handle_prepare_read_flush(const char *tablename,
 			   struct ipt_acc_handle *dest, uint32_t *count)
 {
-	int table_nr;
-	void *new_data_page;
+	struct ipt_acc_table *table;
+	void **data;
+	unsigned int cpu;
 
-	for (table_nr = 0; table_nr < ACCOUNT_MAX_TABLES; table_nr++)
-		if (strncmp(ipt_acc_tables[table_nr].name, tablename,
-		    ACCOUNT_TABLE_NAME_LEN) == 0)
-			break;
-
-	if (table_nr == ACCOUNT_MAX_TABLES) {
+	table = ipt_acc_table_find(tablename);
+	if (table == NULL) {
 		printk("ACCOUNT: ipt_acc_handle_prepare_read_flush(): "
 			"Table %s not found\n", tablename);
 		return -1;
 	}
 
-	/* Try to allocate memory */
-	if (!(new_data_page = ipt_acc_zalloc_page())) {
+	/* Fill up handle structure */
+	dest->ip = table->ip;
+	dest->family = table->family;
+	dest->depth = table->depth;
+	dest->flags = table->flags;
+	dest->data = NULL;
+
+	data = kcalloc(nr_cpu_ids, sizeof(*data), GFP_KERNEL);
+	if (data == NULL) {
 		printk("ACCOUNT: ipt_acc_handle_prepare_read_flush(): "
 			"Out of memory!\n");
 		return -1;
 	}
 
-	/* Fill up handle structure */
-	dest->ip = ipt_acc_tables[table_nr].ip;
-	dest->depth = ipt_acc_tables[table_nr].depth;
-	dest->itemcount = ipt_acc_tables[table_nr].itemcount;
-	dest->data = ipt_acc_tables[table_nr].data;
-	*count = ipt_acc_tables[table_nr].itemcount;
+	/* "Flush" table data: every CPU starts over with an empty tree,
+	   which it allocates with its next packet. Once the packets still
+	   counting into the old trees are done, these are all ours */
+	for_each_possible_cpu(cpu) {
+		struct ipt_acc_cpu *pcpu = per_cpu_ptr(table->cpu, cpu);
+
+		data[cpu] = (__force void *)xchg((__force void **)&pcpu->data,
+			NULL);
+	}
+	synchronize_rcu_bh();
+
+	/* The detached trees are folded into the first */
+	for_each_possible_cpu(cpu) {
+		if (data[cpu] == NULL)
+			continue;
+		if (dest->data == NULL) {
+			dest->data = data[cpu];
+			continue;
+		}
+		if (ipt_acc_data_merge(dest->data, data[cpu], dest->depth, 0,
+		    false))
+			printk("ACCOUNT: ipt_acc_handle_prepare_read_flush(): "
+				"Out of memory, some counters are lost!\n");
+		/* The next packets of the CPUs take these blocks again */
+		ipt_acc_data_free(data[cpu], dest->depth, &table->pool);
+	}
+	kfree(data);
 
-	/* "Flush" table data */
-	ipt_acc_tables[table_nr].data = new_data_page;
-	ipt_acc_tables[table_nr].itemcount = 0;
+	if (dest->data == NULL &&
+	    (dest->data = ipt_acc_zalloc_page()) == NULL) {
+		printk("ACCOUNT: ipt_acc_handle_prepare_read_flush(): "
+			"Out of memory!\n");
+		return -1;
+	}
 
+	dest->itemcount = *count = ipt_acc_data_count(dest->data, dest->depth);
 	return 0;
 }
 
+/* Size of one entry returned by get_data() */
+static size_t ipt_acc_entry_size(uint8_t family, uint8_t flags)
+{
+	size_t size = (family == NFPROTO_IPV6) ?
+	              sizeof(struct ipt_acc_handle_ip6) :
+	              sizeof(struct ipt_acc_handle_ip);
+
+	if (flags & ACCOUNT_F_PROTO)
+		size += ACCOUNT_PROTO_MAX * sizeof(struct ipt_acc_handle_proto);
+	return size;
+}
+
+/* Fill in the exported entry of slot @i of @data, whose first slot is the
+   unit @base */
+static void ipt_acc_fill_entry(void *to, uint8_t family, uint8_t flags,
+			       uint64_t base,
+			       const struct ipt_acc_mask_24 *data,
+			       unsigned int i)
+{
+	const struct ipt_acc_ip *counters = &data->ip[i];
+	uint64_t unit = base | i;
+	struct ipt_acc_handle_proto *proto;
+	unsigned int p;
+
+	if (family == NFPROTO_IPV6) {
+		struct ipt_acc_handle_ip6 *handle_ip6 = to;
+
+		memset(handle_ip6, 0, sizeof(*handle_ip6));
+		handle_ip6->ip.s6_addr32[0] = htonl(unit >> 32);
+		handle_ip6->ip.s6_addr32[1] = htonl(unit);
+		handle_ip6->src_packets = counters->src_packets;
+		handle_ip6->src_bytes = counters->src_bytes;
+		handle_ip6->dst_packets = counters->dst_packets;
+		handle_ip6->dst_bytes = counters->dst_bytes;
+	} else {
+		struct ipt_acc_handle_ip *handle_ip = to;
+
+		memset(handle_ip, 0, sizeof(*handle_ip));
+		handle_ip->ip = unit;
+		handle_ip->src_packets = counters->src_packets;
+		handle_ip->src_bytes = counters->src_bytes;
+		handle_ip->dst_packets = counters->dst_packets;
+		handle_ip->dst_bytes = counters->dst_bytes;
+	}
+
+	if (!(flags & ACCOUNT_F_PROTO))
+		return;
+
+	/* Other protocols get what TCP and UDP leave of the totals */
+	proto = to + ipt_acc_entry_size(family, 0);
+	proto[ACCOUNT_PROTO_OTHER].src_packets = counters->src_packets;
+	proto[ACCOUNT_PROTO_OTHER].src_bytes = counters->src_bytes;
+	proto[ACCOUNT_PROTO_OTHER].dst_packets = counters->dst_packets;
+	proto[ACCOUNT_PROTO_OTHER].dst_bytes = counters->dst_bytes;
+	for (p = 0; p < ACCOUNT_PROTO_OTHER; p++) {
+		if (data->proto == NULL) {
+			memset(&proto[p], 0, sizeof(proto[p]));
+			continue;
+		}
+		counters = &data->proto->ip[p][i];
+		proto[p].src_packets = counters->src_packets;
+		proto[p].src_bytes = counters->src_bytes;
+		proto[p].dst_packets = counters->dst_packets;
+		proto[p].dst_bytes = counters->dst_bytes;
+		proto[ACCOUNT_PROTO_OTHER].src_packets -= counters->src_packets;
+		proto[ACCOUNT_PROTO_OTHER].src_bytes -= counters->src_bytes;
+		proto[ACCOUNT_PROTO_OTHER].dst_packets -= counters->dst_packets;
+		proto[ACCOUNT_PROTO_OTHER].dst_bytes -= counters->dst_bytes;
+	}
+}
+
+/* Call @fn for every 8 bit network of a snapshot, with the unit of its
+   first slot as @base. Stops at the first non-zero return value */
+static int ipt_acc_handle_for_each(const struct ipt_acc_handle *handle,
+	int (*fn)(const struct ipt_acc_mask_24 *, uint64_t, void *),
+	void *priv)
+{
+	uint32_t net_ip = ntohl(handle->ip);
+	int ret;
+
+	/* 8 bit network */
+	if (handle->depth == 0)
+		return fn(handle->data, net_ip, priv);
+
+	/* 16 bit network */
+	if (handle->depth == 1) {
+		const struct ipt_acc_mask_16 *network_16 = handle->data;
+		unsigned int b;
+
+		for (b = 0; b <= 255; b++) {
+			if (network_16->mask_24[b] == NULL)
+				continue;
+			ret = fn(network_16->mask_24[b], net_ip | (b << 8), priv);
+			if (ret != 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	/* 24 bit network */
+	if (handle->depth == 2) {
+		const struct ipt_acc_mask_8 *network_8 = handle->data;
+		const struct ipt_acc_mask_16 *network_16;
+		unsigned int a, b;
+
+		for (a = 0; a <= 255; a++) {
+			network_16 = network_8->mask_16[a];
+			if (network_16 == NULL)
+				continue;
+			for (b = 0; b <= 255; b++) {
+				if (network_16->mask_24[b] == NULL)
+					continue;
+				ret = fn(network_16->mask_24[b],
+					net_ip | (a << 16) | (b << 8), priv);
+				if (ret != 0)
+					return ret;
+			}
+		}
+		return 0;
+	}
+
+	/* Hashed blocks */
+	if (handle->depth == 3) {
+		const struct ipt_acc_hash *hash = handle->data;
+		const struct ipt_acc_block *block;
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(hash->bucket); i++)
+			for (block = hash->bucket[i]; block;
+			     block = block->next) {
+				ret = fn(&block->data, block->key << 8, priv);
+				if (ret != 0)
+					return ret;
+			}
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Where ipt_acc_handle_copy_data() stands */
+struct ipt_acc_copy_pos {
+	void *to_user;
+	unsigned long to_user_pos;
+	unsigned long tmpbuf_pos;
+	uint8_t family;
+	uint8_t flags;
+};
+
 /* Copy 8 bit network data into a prepared buffer.
    We only copy entries != 0 to increase performance.
+   @base is the unit of the first slot; see struct ipt_acc_table
 */
-static int ipt_acc_handle_copy_data(void *to_user, unsigned long *to_user_pos,
-				unsigned long *tmpbuf_pos,
-				struct ipt_acc_mask_24 *data,
-				uint32_t net_ip, uint32_t net_OR_mask)
+static int ipt_acc_handle_copy_data(const struct ipt_acc_mask_24 *data,
+				    uint64_t base, void *priv)
 {
-	struct ipt_acc_handle_ip handle_ip;
-	size_t handle_ip_size = sizeof(struct ipt_acc_handle_ip);
+	struct ipt_acc_copy_pos *pos = priv;
+	size_t handle_ip_size = ipt_acc_entry_size(pos->family, pos->flags);
 	unsigned int i;
 
 	for (i = 0; i <= 255; i++) {
@@ -740,22 +1835,17 @@ static int ipt_acc_handle_copy_data(void *to_user, unsigned long *to_user_pos,
 		    data->ip[i].dst_packets == 0)
 			continue;
 
-		handle_ip.ip = net_ip | net_OR_mask | i;
-		handle_ip.src_packets = data->ip[i].src_packets;
-		handle_ip.src_bytes = data->ip[i].src_bytes;
-		handle_ip.dst_packets = data->ip[i].dst_packets;
-		handle_ip.dst_bytes = data->ip[i].dst_bytes;
-
 		/* Temporary buffer full? Flush to userspace */
-		if (*tmpbuf_pos + handle_ip_size >= PAGE_SIZE) {
-			if (copy_to_user(to_user + *to_user_pos, ipt_acc_tmpbuf,
-			    *tmpbuf_pos))
+		if (pos->tmpbuf_pos + handle_ip_size >= PAGE_SIZE) {
+			if (copy_to_user(pos->to_user + pos->to_user_pos,
+			    ipt_acc_tmpbuf, pos->tmpbuf_pos))
 				return -EFAULT;
-			*to_user_pos = *to_user_pos + *tmpbuf_pos;
-			*tmpbuf_pos = 0;
+			pos->to_user_pos += pos->tmpbuf_pos;
+			pos->tmpbuf_pos = 0;
 		}
-		memcpy(ipt_acc_tmpbuf + *tmpbuf_pos, &handle_ip, handle_ip_size);
-		*tmpbuf_pos += handle_ip_size;
+		ipt_acc_fill_entry(ipt_acc_tmpbuf + pos->tmpbuf_pos,
+			pos->family, pos->flags, base, data, i);
+		pos->tmpbuf_pos += handle_ip_size;
 	}
 
 	return 0;
@@ -767,9 +1857,7 @@ static int ipt_acc_handle_copy_data(void *to_user, unsigned long *to_user_pos,
 */
 static int ipt_acc_handle_get_data(uint32_t handle, void *to_user)
 {
-	unsigned long to_user_pos = 0, tmpbuf_pos = 0;
-	uint32_t net_ip;
-	uint8_t depth;
+	struct ipt_acc_copy_pos pos = {.to_user = to_user};
 
 	if (handle >= ACCOUNT_MAX_HANDLES) {
 		printk("ACCOUNT: invalid handle for ipt_acc_handle_get_data() "
@@ -782,81 +1870,282 @@ static int ipt_acc_handle_get_data(uint32_t handle, void *to_user)
 		return -1;
 	}
 
-	net_ip = ntohl(ipt_acc_handles[handle].ip);
-	depth = ipt_acc_handles[handle].depth;
+	pos.family = ipt_acc_handles[handle].family;
+	pos.flags = ipt_acc_handles[handle].flags;
+	if (ipt_acc_handle_for_each(&ipt_acc_handles[handle],
+	    ipt_acc_handle_copy_data, &pos))
+		return -1;
 
-	/* 8 bit network */
-	if (depth == 0) {
-		struct ipt_acc_mask_24 *network =
-			ipt_acc_handles[handle].data;
-		if (ipt_acc_handle_copy_data(to_user, &to_user_pos, &tmpbuf_pos,
-		    network, net_ip, 0))
+	/* Flush remaining data to userspace */
+	if (pos.tmpbuf_pos)
+		if (copy_to_user(to_user + pos.to_user_pos, ipt_acc_tmpbuf,
+		    pos.tmpbuf_pos))
 			return -1;
 
-		/* Flush remaining data to userspace */
-		if (tmpbuf_pos)
-			if (copy_to_user(to_user + to_user_pos, ipt_acc_tmpbuf, tmpbuf_pos))
-				return -1;
+	return 0;
+}
 
-		return 0;
-	}
+/* Where ipt_acc_handle_export_data() stands */
+struct ipt_acc_export_pos {
+	void *pos;
+	void *end;
+	uint8_t family;
+	uint8_t flags;
+};
 
-	/* 16 bit network */
-	if (depth == 1) {
-		struct ipt_acc_mask_16 *network_16 =
-			ipt_acc_handles[handle].data;
-		unsigned int b;
-		for (b = 0; b <= 255; b++) {
-			if (network_16->mask_24[b]) {
-				struct ipt_acc_mask_24 *network =
-					network_16->mask_24[b];
-				if (ipt_acc_handle_copy_data(to_user, &to_user_pos,
-				    &tmpbuf_pos, network, net_ip, (b << 8)))
-					return -1;
-			}
-		}
+/* Append the entries != 0 of an 8 bit network to a snapshot file */
+static int ipt_acc_handle_export_data(const struct ipt_acc_mask_24 *data,
+				      uint64_t base, void *priv)
+{
+	struct ipt_acc_export_pos *exp = priv;
+	size_t handle_ip_size = ipt_acc_entry_size(exp->family, exp->flags);
+	unsigned int i;
 
-		/* Flush remaining data to userspace */
-		if (tmpbuf_pos)
-			if (copy_to_user(to_user + to_user_pos, ipt_acc_tmpbuf, tmpbuf_pos))
-				return -1;
+	for (i = 0; i <= 255; i++) {
+		if (data->ip[i].src_packets == 0 &&
+		    data->ip[i].dst_packets == 0)
+			continue;
+		if (exp->pos + handle_ip_size > exp->end)
+			return -1;
+		ipt_acc_fill_entry(exp->pos, exp->family, exp->flags, base,
+			data, i);
+		exp->pos += handle_ip_size;
+	}
 
-		return 0;
+	return 0;
+}
+
+/* Take a flat snapshot of a table, see struct ipt_acc_snapshot. Flushes
+   the table if @flush, otherwise only takes the addresses changed since
+   *@generation, like ipt_acc_handle_prepare_read() */
+static struct ipt_acc_snapshot *
+ipt_acc_snapshot_take(const char *name, bool flush, uint32_t *generation)
+{
+	uint64_t missed = 0, refill_failed = 0;
+	struct ipt_acc_snapshot *snap;
+	struct ipt_acc_export_pos exp;
+	struct ipt_acc_table *table;
+	struct ipt_acc_handle dest;
+	uint32_t count;
+	size_t size;
+	int ret;
+
+	mutex_lock(&ipt_acc_mutex);
+	if (flush)
+		ret = ipt_acc_handle_prepare_read_flush(name, &dest, &count);
+	else
+		ret = ipt_acc_handle_prepare_read(name, &dest, &count,
+			generation);
+	if (ret != -1 && (table = ipt_acc_table_find(name)) != NULL) {
+		spin_lock_bh(&table->pool.lock);
+		missed = table->pool.missed;
+		refill_failed = table->pool.refill_failed;
+		spin_unlock_bh(&table->pool.lock);
 	}
+	mutex_unlock(&ipt_acc_mutex);
+	if (ret == -1)
+		return ERR_PTR(-EINVAL);
+
+	/* vmalloc_user() clears it, and allows mapping it to userspace */
+	size = sizeof(*snap) +
+	       (size_t)count * ipt_acc_entry_size(dest.family, dest.flags);
+	snap = vmalloc_user(size);
+	if (snap == NULL) {
+		printk("ACCOUNT: out of memory for snapshot of table %s\n", name);
+		ipt_acc_data_free(dest.data, dest.depth, NULL);
+		return ERR_PTR(-ENOMEM);
+	}
+	snap->version = IPT_ACC_SNAPSHOT_VERSION;
+	snap->itemcount = count;
+	snap->entry_size = ipt_acc_entry_size(dest.family, dest.flags);
+	snap->family = dest.family;
+	snap->flags = dest.flags;
+	snap->missed = missed;
+	snap->refill_failed = refill_failed;
+
+	exp.pos = snap + 1;
+	exp.end = (void *)snap + size;
+	exp.family = dest.family;
+	exp.flags = dest.flags;
+	ret = ipt_acc_handle_for_each(&dest, ipt_acc_handle_export_data, &exp);
+	ipt_acc_data_free(dest.data, dest.depth, NULL);
+	if (ret != 0) {
+		vfree(snap);
+		return ERR_PTR(-EINVAL);
+	}
+	return snap;
+}
 
-	/* 24 bit network */
-	if (depth == 2) {
-		struct ipt_acc_mask_8 *network_8 =
-			ipt_acc_handles[handle].data;
-		unsigned int a, b;
-		for (a = 0; a <= 255; a++) {
-			if (network_8->mask_16[a]) {
-				struct ipt_acc_mask_16 *network_16 =
-					network_8->mask_16[a];
-				for (b = 0; b <= 255; b++) {
-					if (network_16->mask_24[b]) {
-						struct ipt_acc_mask_24 *network =
-							network_16->mask_24[b];
-						if (ipt_acc_handle_copy_data(to_user,
-						    &to_user_pos, &tmpbuf_pos,
-						    network, net_ip, (a << 16) | (b << 8)))
-							return -1;
-					}
-				}
-			}
-		}
+/* Take the snapshot of /proc/net/xt_ACCOUNT/<table>, flushing the table
+   if the file is opened for writing. It lives until the file is closed */
+static int ipt_acc_proc_open(struct inode *inode, struct file *file)
+{
+	struct ipt_acc_snapshot *snap;
+	uint32_t generation = 0;
 
-		/* Flush remaining data to userspace */
-		if (tmpbuf_pos)
-			if (copy_to_user(to_user + to_user_pos, ipt_acc_tmpbuf, tmpbuf_pos))
-				return -1;
+	snap = ipt_acc_snapshot_take(file->f_path.dentry->d_name.name,
+	       file->f_mode & FMODE_WRITE, &generation);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
 
-		return 0;
+	file->private_data = snap;
+	return 0;
+}
+
+static size_t ipt_acc_snapshot_size(const struct ipt_acc_snapshot *snap)
+{
+	return sizeof(*snap) + (size_t)snap->itemcount * snap->entry_size;
+}
+
+static ssize_t ipt_acc_proc_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	const struct ipt_acc_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snap,
+	       ipt_acc_snapshot_size(snap));
+}
+
+/* The snapshot can be mapped, but never written to */
+static int ipt_acc_proc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, file->private_data, vma->vm_pgoff);
+}
+
+static int ipt_acc_proc_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations ipt_acc_proc_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ipt_acc_proc_open,
+	.read    = ipt_acc_proc_read,
+	.llseek  = default_llseek,
+	.mmap    = ipt_acc_proc_mmap,
+	.release = ipt_acc_proc_release,
+};
+
+/*
+ * A netlink dump takes a snapshot with its first call, and then hands out
+ * as many entries as fit per message. cb->args[0] holds the snapshot,
+ * cb->args[1] the generation and cb->args[2] the next entry.
+ */
+static struct genl_family ipt_acc_genl_family = {
+	.id      = GENL_ID_GENERATE,
+	.name    = ACCOUNT_GENL_NAME,
+	.version = ACCOUNT_GENL_VERSION,
+	.maxattr = ACCOUNT_ATTR_MAX,
+};
+
+static const struct nla_policy ipt_acc_genl_policy[ACCOUNT_ATTR_MAX+1] = {
+	[ACCOUNT_ATTR_TABLE]      = {.type = NLA_NUL_STRING,
+	                             .len = ACCOUNT_TABLE_NAME_LEN - 1},
+	[ACCOUNT_ATTR_FLUSH]      = {.type = NLA_FLAG},
+	[ACCOUNT_ATTR_GENERATION] = {.type = NLA_U32},
+};
+
+static int ipt_acc_genl_start(struct netlink_callback *cb)
+{
+	struct nlattr *tb[ACCOUNT_ATTR_MAX+1];
+	struct ipt_acc_snapshot *snap;
+	uint32_t generation = 0;
+	int ret;
+
+	ret = nlmsg_parse(cb->nlh, GENL_HDRLEN, tb, ACCOUNT_ATTR_MAX,
+	      ipt_acc_genl_policy);
+	if (ret < 0)
+		return ret;
+	if (tb[ACCOUNT_ATTR_TABLE] == NULL)
+		return -EINVAL;
+	if (tb[ACCOUNT_ATTR_GENERATION] != NULL)
+		generation = nla_get_u32(tb[ACCOUNT_ATTR_GENERATION]);
+
+	snap = ipt_acc_snapshot_take(nla_data(tb[ACCOUNT_ATTR_TABLE]),
+	       tb[ACCOUNT_ATTR_FLUSH] != NULL, &generation);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+
+	cb->args[0] = (unsigned long)snap;
+	cb->args[1] = generation;
+	cb->args[2] = 0;
+	return 0;
+}
+
+static int ipt_acc_genl_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	const struct ipt_acc_snapshot *snap;
+	unsigned long pos, n;
+	struct nlattr *attr;
+	void *hdr;
+	int ret;
+
+	if (cb->args[0] == 0) {
+		ret = ipt_acc_genl_start(cb);
+		if (ret < 0)
+			return ret;
 	}
+	snap = (const void *)cb->args[0];
+	pos = cb->args[2];
+	/* The last message may come without entries, even for empty tables */
+	if (pos >= snap->itemcount && pos != 0)
+		return 0;
 
-	return -1;
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+	      &ipt_acc_genl_family, NLM_F_MULTI, ACCOUNT_CMD_GET);
+	if (hdr == NULL)
+		return -EMSGSIZE;
+	if (nla_put_u8(skb, ACCOUNT_ATTR_FAMILY, snap->family) != 0 ||
+	    nla_put_u8(skb, ACCOUNT_ATTR_FLAGS, snap->flags) != 0 ||
+	    nla_put_u32(skb, ACCOUNT_ATTR_GENERATION, cb->args[1]) != 0 ||
+	    nla_put_u32(skb, ACCOUNT_ATTR_ITEMCOUNT, snap->itemcount) != 0 ||
+	    nla_put_u64(skb, ACCOUNT_ATTR_MISSED, snap->missed) != 0 ||
+	    nla_put_u64(skb, ACCOUNT_ATTR_REFILL_FAILED,
+	    snap->refill_failed) != 0)
+		goto nla_put_failure;
+
+	/* As many entries as fit */
+	n = skb_tailroom(skb);
+	n = (n > nla_total_size(0)) ?
+	    (n - nla_total_size(0)) / snap->entry_size : 0;
+	n = min_t(unsigned long, n, snap->itemcount - pos);
+	if (n == 0 && pos < snap->itemcount)
+		goto nla_put_failure;
+	attr = nla_reserve(skb, ACCOUNT_ATTR_ENTRIES, n * snap->entry_size);
+	if (attr == NULL)
+		goto nla_put_failure;
+	memcpy(nla_data(attr), (const void *)(snap + 1) +
+	       pos * snap->entry_size, n * snap->entry_size);
+
+	cb->args[2] = pos + max(n, 1UL);
+	genlmsg_end(skb, hdr);
+	return skb->len;
+
+ nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+static int ipt_acc_genl_done(struct netlink_callback *cb)
+{
+	vfree((void *)cb->args[0]);
+	return 0;
 }
 
+static struct genl_ops ipt_acc_genl_ops[] = {
+	{
+		.cmd    = ACCOUNT_CMD_GET,
+		.flags  = GENL_ADMIN_PERM,
+		.policy = ipt_acc_genl_policy,
+		.dumpit = ipt_acc_genl_dump,
+		.done   = ipt_acc_genl_done,
+	},
+};
+
 static int ipt_acc_set_ctl(struct sock *sk, int cmd,
 			void *user, unsigned int len)
 {
@@ -868,7 +2157,8 @@ static int ipt_acc_set_ctl(struct sock *sk, int cmd,
 
 	switch (cmd) {
 	case IPT_SO_SET_ACCOUNT_HANDLE_FREE:
-		if (len != sizeof(struct ipt_acc_handle_sockopt)) {
+		if (len != sizeof(struct ipt_acc_handle_sockopt) &&
+		    len != IPT_ACC_HANDLE_SOCKOPT_V1_SIZE) {
 			printk("ACCOUNT: ipt_acc_set_ctl: wrong data size (%u != %zu) "
 				"for IPT_SO_SET_HANDLE_FREE\n",
 				len, sizeof(struct ipt_acc_handle_sockopt));
@@ -904,37 +2194,51 @@ static int ipt_acc_set_ctl(struct sock *sk, int cmd,
 static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 {
 	struct ipt_acc_handle_sockopt handle;
+	/* Older userspace passes the handle without family and entry_size,
+	   or without generation */
+	size_t hsize = min_t(size_t, *len, sizeof(handle));
 	int ret = -EINVAL;
 
 	if (!capable(CAP_NET_ADMIN))
 		return -EPERM;
 
+	memset(&handle, 0, sizeof(handle));
+
 	switch (cmd) {
 	case IPT_SO_GET_ACCOUNT_PREPARE_READ_FLUSH:
 	case IPT_SO_GET_ACCOUNT_PREPARE_READ: {
 		struct ipt_acc_handle dest;
+		const struct ipt_acc_table *table;
 
-		if (*len < sizeof(struct ipt_acc_handle_sockopt)) {
+		if (hsize < IPT_ACC_HANDLE_SOCKOPT_V1_SIZE) {
 			printk("ACCOUNT: ipt_acc_get_ctl: wrong data size (%u != %zu) "
 				"for IPT_SO_GET_ACCOUNT_PREPARE_READ/READ_FLUSH\n",
 				*len, sizeof(struct ipt_acc_handle_sockopt));
 			break;
 		}
 
-		if (copy_from_user (&handle, user,
-		    sizeof(struct ipt_acc_handle_sockopt))) {
+		if (copy_from_user (&handle, user, hsize)) {
 			return -EFAULT;
 			break;
 		}
 
-		spin_lock_bh(&ipt_acc_lock);
+		mutex_lock(&ipt_acc_mutex);
+		/* Older userspace can only parse plain IPv4 entries */
+		table = ipt_acc_table_find(handle.name);
+		if (table != NULL && hsize < IPT_ACC_HANDLE_SOCKOPT_V2_SIZE &&
+		    (table->family != NFPROTO_IPV4 || table->flags != 0)) {
+			mutex_unlock(&ipt_acc_mutex);
+			printk("ACCOUNT: ipt_acc_get_ctl: table %s needs a newer "
+				"libxt_ACCOUNT_cl\n", handle.name);
+			return -EINVAL;
+		}
 		if (cmd == IPT_SO_GET_ACCOUNT_PREPARE_READ_FLUSH)
 			ret = ipt_acc_handle_prepare_read_flush(
 				handle.name, &dest, &handle.itemcount);
 		else
-			ret = ipt_acc_handle_prepare_read(
-				handle.name, &dest, &handle.itemcount);
-		spin_unlock_bh(&ipt_acc_lock);
+			ret = ipt_acc_handle_prepare_read(handle.name, &dest,
+				&handle.itemcount, &handle.generation);
+		mutex_unlock(&ipt_acc_mutex);
 		// Error occured during prepare_read?
 		if (ret == -1)
 			return -EINVAL;
@@ -942,7 +2246,7 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 		/* Allocate a userspace handle */
 		down(&ipt_acc_userspace_mutex);
 		if ((handle.handle_nr = ipt_acc_handle_find_slot()) == -1) {
-			ipt_acc_data_free(dest.data, dest.depth);
+			ipt_acc_data_free(dest.data, dest.depth, NULL);
 			up(&ipt_acc_userspace_mutex);
 			return -EINVAL;
 		}
@@ -950,24 +2254,27 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 			sizeof(struct ipt_acc_handle));
 		up(&ipt_acc_userspace_mutex);
 
-		if (copy_to_user(user, &handle,
-		    sizeof(struct ipt_acc_handle_sockopt))) {
+		handle.family = dest.family;
+		handle.flags = dest.flags;
+		handle.entry_size = ipt_acc_entry_size(dest.family, dest.flags);
+		if (copy_to_user(user, &handle, hsize)) {
 			return -EFAULT;
 			break;
 		}
 		ret = 0;
 		break;
 	}
-	case IPT_SO_GET_ACCOUNT_GET_DATA:
-		if (*len < sizeof(struct ipt_acc_handle_sockopt)) {
+	case IPT_SO_GET_ACCOUNT_GET_DATA: {
+		size_t entry_size;
+
+		if (hsize < IPT_ACC_HANDLE_SOCKOPT_V1_SIZE) {
 			printk("ACCOUNT: ipt_acc_get_ctl: wrong data size (%u != %zu)"
 				" for IPT_SO_GET_ACCOUNT_PREPARE_READ/READ_FLUSH\n",
 				*len, sizeof(struct ipt_acc_handle_sockopt));
 			break;
 		}
 
-		if (copy_from_user(&handle, user,
-		    sizeof(struct ipt_acc_handle_sockopt))) {
+		if (copy_from_user(&handle, user, IPT_ACC_HANDLE_SOCKOPT_V1_SIZE)) {
 			return -EFAULT;
 			break;
 		}
@@ -977,12 +2284,15 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 			break;
 		}
 
+		entry_size = ipt_acc_entry_size(
+			ipt_acc_handles[handle.handle_nr].family,
+			ipt_acc_handles[handle.handle_nr].flags);
 		if (*len < ipt_acc_handles[handle.handle_nr].itemcount
-		    * sizeof(struct ipt_acc_handle_ip)) {
+		    * entry_size) {
 			printk("ACCOUNT: ipt_acc_get_ctl: not enough space (%u < %zu)"
 				" to store data from IPT_SO_GET_ACCOUNT_GET_DATA\n",
 				*len, ipt_acc_handles[handle.handle_nr].itemcount
-				* sizeof(struct ipt_acc_handle_ip));
+				* entry_size);
 			ret = -ENOMEM;
 			break;
 		}
@@ -998,9 +2308,10 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 
 		ret = 0;
 		break;
+	}
 	case IPT_SO_GET_ACCOUNT_GET_HANDLE_USAGE: {
 		unsigned int i;
-		if (*len < sizeof(struct ipt_acc_handle_sockopt)) {
+		if (hsize < IPT_ACC_HANDLE_SOCKOPT_V1_SIZE) {
 			printk("ACCOUNT: ipt_acc_get_ctl: wrong data size (%u != %zu)"
 				" for IPT_SO_GET_ACCOUNT_GET_HANDLE_USAGE\n",
 				*len, sizeof(struct ipt_acc_handle_sockopt));
@@ -1015,8 +2326,7 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 				handle.itemcount++;
 		up(&ipt_acc_userspace_mutex);
 
-		if (copy_to_user(user, &handle,
-		    sizeof(struct ipt_acc_handle_sockopt))) {
+		if (copy_to_user(user, &handle, hsize)) {
 			return -EFAULT;
 			break;
 		}
@@ -1024,44 +2334,49 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 		break;
 	}
 	case IPT_SO_GET_ACCOUNT_GET_TABLE_NAMES: {
+		const struct ipt_acc_table_slots *slots;
 		uint32_t size = 0, i, name_len;
-		char *tnames;
+		char *names, *tnames;
 
-		spin_lock_bh(&ipt_acc_lock);
+		mutex_lock(&ipt_acc_mutex);
+		slots = rcu_dereference_protected(ipt_acc_table_slots,
+			lockdep_is_held(&ipt_acc_mutex));
 
 		/* Determine size of table names */
-		for (i = 0; i < ACCOUNT_MAX_TABLES; i++) {
-			if (ipt_acc_tables[i].name[0] != 0)
-				size += strlen(ipt_acc_tables[i].name) + 1;
+		for (i = 0; i < slots->size; i++) {
+			if (slots->table[i] != NULL)
+				size += strlen(slots->table[i]->name) + 1;
 		}
 		size += 1;	/* Terminating NULL character */
 
-		if (*len < size || size > PAGE_SIZE) {
-			spin_unlock_bh(&ipt_acc_lock);
-			printk("ACCOUNT: ipt_acc_get_ctl: not enough space (%u < %u < %lu)"
-				" to store table names\n", *len, size, PAGE_SIZE);
+		if (*len < size) {
+			mutex_unlock(&ipt_acc_mutex);
+			printk("ACCOUNT: ipt_acc_get_ctl: not enough space (%u < %u)"
+				" to store table names\n", *len, size);
 			ret = -ENOMEM;
 			break;
 		}
-		/* Copy table names to userspace */
-		tnames = ipt_acc_tmpbuf;
-		for (i = 0; i < ACCOUNT_MAX_TABLES; i++) {
-			if (ipt_acc_tables[i].name[0] != 0) {
-				name_len = strlen(ipt_acc_tables[i].name) + 1;
-				memcpy(tnames, ipt_acc_tables[i].name, name_len);
+		/* There is no limit to the tables, so no fixed buffer */
+		if ((names = vmalloc(size)) == NULL) {
+			mutex_unlock(&ipt_acc_mutex);
+			return -ENOMEM;
+		}
+		tnames = names;
+		for (i = 0; i < slots->size; i++) {
+			if (slots->table[i] != NULL) {
+				name_len = strlen(slots->table[i]->name) + 1;
+				memcpy(tnames, slots->table[i]->name, name_len);
 				tnames += name_len;
 			}
 		}
-		spin_unlock_bh(&ipt_acc_lock);
+		mutex_unlock(&ipt_acc_mutex);
 
 		/* Terminating NULL character */
 		*tnames = 0;
 
 		/* Transfer to userspace */
-		if (copy_to_user(user, ipt_acc_tmpbuf, size))
-			return -EFAULT;
-
-		ret = 0;
+		ret = copy_to_user(user, names, size) ? -EFAULT : 0;
+		vfree(names);
 		break;
 	}
 	default:
@@ -1071,15 +2386,37 @@ static int ipt_acc_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 	return ret;
 }
 
-static struct xt_target xt_acc_reg __read_mostly = {
-	.name = "ACCOUNT",
-	.revision = 1,
-	.family     = NFPROTO_IPV4,
-	.target = ipt_acc_target,
-	.targetsize = sizeof(struct ipt_acc_info),
-	.checkentry = ipt_acc_checkentry,
-	.destroy = ipt_acc_destroy,
-	.me = THIS_MODULE
+static struct xt_target xt_acc_reg[] __read_mostly = {
+	{
+		.name = "ACCOUNT",
+		.revision = 1,
+		.family     = NFPROTO_IPV4,
+		.target = ipt_acc_target,
+		.targetsize = sizeof(struct ipt_acc_info),
+		.checkentry = ipt_acc_checkentry,
+		.destroy = ipt_acc_destroy,
+		.me = THIS_MODULE
+	},
+	{
+		.name = "ACCOUNT",
+		.revision = 2,
+		.family     = NFPROTO_IPV4,
+		.target = ipt_acc_target_v2,
+		.targetsize = sizeof(struct ipt_acc_info_v2),
+		.checkentry = ipt_acc_checkentry_v2,
+		.destroy = ipt_acc_destroy_v2,
+		.me = THIS_MODULE
+	},
+	{
+		.name = "ACCOUNT",
+		.revision = 2,
+		.family     = NFPROTO_IPV6,
+		.target = ipt_acc_target_v2,
+		.targetsize = sizeof(struct ipt_acc_info_v2),
+		.checkentry = ipt_acc_checkentry_v2,
+		.destroy = ipt_acc_destroy_v2,
+		.me = THIS_MODULE
+	},
 };
 
 static struct nf_sockopt_ops ipt_acc_sockopts = {
@@ -1094,16 +2431,28 @@ static struct nf_sockopt_ops ipt_acc_sockopts = {
 
 static int __init account_tg_init(void)
 {
+	struct ipt_acc_table_slots *slots;
+
+	/* Blocks are allocated with ipt_acc_zalloc_page() */
+	BUILD_BUG_ON(sizeof(struct ipt_acc_block) > PAGE_SIZE << 2);
+	BUILD_BUG_ON(sizeof(struct ipt_acc_mask_24_proto) > PAGE_SIZE << 2);
+
 	sema_init(&ipt_acc_userspace_mutex, 1);
 
-	if ((ipt_acc_tables =
-	    kmalloc(ACCOUNT_MAX_TABLES *
-	    sizeof(struct ipt_acc_table), GFP_KERNEL)) == NULL) {
-		printk("ACCOUNT: Out of memory allocating account_tables structure");
+	/* The table registry starts out small and grows as needed */
+	ipt_acc_table_hash_bits = IPT_ACC_TABLE_HASH_MIN_BITS;
+	if ((ipt_acc_table_hash = kcalloc(1U << ipt_acc_table_hash_bits,
+	    sizeof(*ipt_acc_table_hash), GFP_KERNEL)) == NULL) {
+		printk("ACCOUNT: Out of memory allocating table hash");
+		goto error_cleanup;
+	}
+	if ((slots = kzalloc(sizeof(*slots) + (1U << ipt_acc_table_hash_bits) *
+	    sizeof(slots->table[0]), GFP_KERNEL)) == NULL) {
+		printk("ACCOUNT: Out of memory allocating table slots");
 		goto error_cleanup;
 	}
-	memset(ipt_acc_tables, 0,
-		ACCOUNT_MAX_TABLES * sizeof(struct ipt_acc_table));
+	slots->size = 1U << ipt_acc_table_hash_bits;
+	RCU_INIT_POINTER(ipt_acc_table_slots, slots);
 
 	if ((ipt_acc_handles =
 	    kmalloc(ACCOUNT_MAX_HANDLES *
@@ -1120,20 +2469,44 @@ static int __init account_tg_init(void)
 		goto error_cleanup;
 	}
 
+	/* One snapshot file per table goes in here */
+	if ((ipt_acc_proc_dir = proc_mkdir("xt_ACCOUNT", init_net.proc_net))
+	    == NULL) {
+		printk("ACCOUNT: Can't create /proc/net/xt_ACCOUNT\n");
+		goto error_cleanup;
+	}
+
 	/* Register setsockopt */
 	if (nf_register_sockopt(&ipt_acc_sockopts) < 0) {
 		printk("ACCOUNT: Can't register sockopts. Aborting\n");
 		goto error_cleanup;
 	}
 
-	if (xt_register_target(&xt_acc_reg))
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+	if (genl_register_family_with_ops(&ipt_acc_genl_family,
+	    ipt_acc_genl_ops, ARRAY_SIZE(ipt_acc_genl_ops)) < 0) {
+#else
+	if (genl_register_family_with_ops(&ipt_acc_genl_family,
+	    ipt_acc_genl_ops) < 0) {
+#endif
+		printk("ACCOUNT: Can't register netlink family. Aborting\n");
+		nf_unregister_sockopt(&ipt_acc_sockopts);
+		goto error_cleanup;
+	}
+
+	if (xt_register_targets(xt_acc_reg, ARRAY_SIZE(xt_acc_reg))) {
+		genl_unregister_family(&ipt_acc_genl_family);
+		nf_unregister_sockopt(&ipt_acc_sockopts);
 		goto error_cleanup;
+	}
 
 	return 0;
 
 error_cleanup:
-	if (ipt_acc_tables)
-		kfree(ipt_acc_tables);
+	if (ipt_acc_proc_dir)
+		remove_proc_entry("xt_ACCOUNT", init_net.proc_net);
+	kfree(ipt_acc_table_hash);
+	kfree(rcu_dereference_protected(ipt_acc_table_slots, 1));
 	if (ipt_acc_handles)
 		kfree(ipt_acc_handles);
 	if (ipt_acc_tmpbuf)
@@ -1144,11 +2517,15 @@ error_cleanup:
 
 static void __exit account_tg_exit(void)
 {
-	xt_unregister_target(&xt_acc_reg);
+	xt_unregister_targets(xt_acc_reg, ARRAY_SIZE(xt_acc_reg));
 
+	genl_unregister_family(&ipt_acc_genl_family);
 	nf_unregister_sockopt(&ipt_acc_sockopts);
+	remove_proc_entry("xt_ACCOUNT", init_net.proc_net);
 
-	kfree(ipt_acc_tables);
+	/* All rules, and thus tables, are gone */
+	kfree(ipt_acc_table_hash);
+	kfree(rcu_dereference_protected(ipt_acc_table_slots, 1));
 	kfree(ipt_acc_handles);
 	free_pages((unsigned long)ipt_acc_tmpbuf, 2);
 }
@@ -1158,4 +2535,5 @@ module_exit(account_tg_exit);
 MODULE_DESCRIPTION("Xtables: per-IP accounting for large prefixes");
 MODULE_AUTHOR("Intra2net AG <opensource@intra2net.com>");
 MODULE_ALIAS("ipt_ACCOUNT");
+MODULE_ALIAS("ip6t_ACCOUNT");
 MODULE_LICENSE("GPL");
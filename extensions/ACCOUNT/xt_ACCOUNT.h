@@ -34,7 +34,6 @@
 #define IPT_SO_GET_ACCOUNT_GET_TABLE_NAMES (SO_ACCOUNT_BASE_CTL + 8)
 #define IPT_SO_GET_ACCOUNT_MAX	  IPT_SO_GET_ACCOUNT_GET_TABLE_NAMES
 
-#define ACCOUNT_MAX_TABLES 128
 #define ACCOUNT_TABLE_NAME_LEN 32
 #define ACCOUNT_MAX_HANDLES 10
 
@@ -46,6 +45,25 @@ struct ipt_acc_info {
 	int32_t table_nr;
 };
 
+/*
+ * Table flags, set by the rule that creates a table
+ * ACCOUNT_F_PROTO	also count TCP, UDP and other protocols separately
+ */
+#define ACCOUNT_F_PROTO 0x01
+
+/*
+ * Revision 2, for IPv4 and IPv6. IPv6 traffic is accounted per /64, so
+ * @net_prefix can be at most 64 there. Any IPv4 prefix size works.
+ * @flags are ACCOUNT_F_*.
+ */
+struct ipt_acc_info_v2 {
+	union nf_inet_addr net_ip;
+	uint8_t net_prefix;
+	uint8_t flags;
+	char table_name[ACCOUNT_TABLE_NAME_LEN];
+	int32_t table_nr;
+};
+
 /* Handle structure for communication with the userspace library */
 struct ipt_acc_handle_sockopt {
 	uint32_t handle_nr;				   /* Used for HANDLE_FREE */
@@ -53,8 +71,26 @@ struct ipt_acc_handle_sockopt {
 												 HANDLE_READ_FLUSH */
 	uint32_t itemcount;				   /* Used for HANDLE_PREPARE_READ/
 												 HANDLE_READ_FLUSH */
+	uint8_t family;					   /* Returned by HANDLE_PREPARE_READ/
+												 HANDLE_READ_FLUSH */
+	uint8_t flags;					   /* Likewise, ACCOUNT_F_* */
+	uint8_t __pad0[2];
+	uint32_t entry_size;			   /* Size of one GET_DATA entry */
+	uint32_t generation;			   /* HANDLE_PREPARE_READ: changes
+												 since, 0 for all; returns next */
 };
 
+/*
+ * Size of struct ipt_acc_handle_sockopt before @family was added. Still
+ * accepted by the kernel, but only for IPv4 tables.
+ */
+#define IPT_ACC_HANDLE_SOCKOPT_V1_SIZE \
+	offsetof(struct ipt_acc_handle_sockopt, family)
+
+/* Size before @generation was added, which then reads all addresses */
+#define IPT_ACC_HANDLE_SOCKOPT_V2_SIZE \
+	offsetof(struct ipt_acc_handle_sockopt, generation)
+
 /*
 	Used for every IP when returning data
 */
@@ -66,4 +102,105 @@ struct ipt_acc_handle_ip {
 	uint64_t dst_bytes;
 };
 
+/*
+	Used for every /64 when returning data of an IPv6 table
+*/
+struct ipt_acc_handle_ip6 {
+	struct in6_addr ip;
+	uint64_t src_packets;
+	uint64_t src_bytes;
+	uint64_t dst_packets;
+	uint64_t dst_bytes;
+};
+
+/*
+ * In tables with ACCOUNT_F_PROTO, every entry is followed by one of these
+ * for each ACCOUNT_PROTO_*, in that order. They add up to the totals of
+ * the entry.
+ */
+enum {
+	ACCOUNT_PROTO_TCP,
+	ACCOUNT_PROTO_UDP,
+	ACCOUNT_PROTO_OTHER,
+	ACCOUNT_PROTO_MAX,
+};
+
+struct ipt_acc_handle_proto {
+	uint64_t src_packets;
+	uint64_t src_bytes;
+	uint64_t dst_packets;
+	uint64_t dst_bytes;
+};
+
+/*
+ * /proc/net/xt_ACCOUNT/<table> holds a snapshot of the table, taken when
+ * the file is opened, and flushing the table if it is opened for writing.
+ * It is this header, followed by @itemcount entries of @entry_size bytes,
+ * each a struct ipt_acc_handle_ip or ipt_acc_handle_ip6 depending on
+ * @family, and followed by the protocol split if @flags has
+ * ACCOUNT_F_PROTO. The file can be read, or mmap()ed read-only.
+ * @missed and @refill_failed count, since the table was created, how often
+ * the packet path could get no block for a new part of the table, neither
+ * from the pool nor by allocating one, and thus left an address uncounted,
+ * and how often refilling the pool failed. See the pool_blocks module
+ * parameter.
+ */
+#define IPT_ACC_SNAPSHOT_VERSION 2
+
+struct ipt_acc_snapshot {
+	uint32_t version;
+	uint32_t itemcount;
+	uint32_t entry_size;
+	uint8_t family;
+	uint8_t flags;
+	uint8_t __pad0[2];
+	uint64_t missed;
+	uint64_t refill_failed;
+};
+
+/*
+ * Generic netlink family ACCOUNT_GENL_NAME. ACCOUNT_CMD_GET dumps a table
+ * in as many messages as it takes, each with a batch of entries. There is
+ * no limit on concurrent dumps, as there is on sockopt handles.
+ */
+#define ACCOUNT_GENL_NAME "xt_ACCOUNT"
+#define ACCOUNT_GENL_VERSION 1
+
+enum {
+	ACCOUNT_CMD_UNSPEC,
+	ACCOUNT_CMD_GET,
+	__ACCOUNT_CMD_MAX,
+};
+#define ACCOUNT_CMD_MAX (__ACCOUNT_CMD_MAX - 1)
+
+/**
+ * @ACCOUNT_ATTR_TABLE:		request: table name (string)
+ * @ACCOUNT_ATTR_FLUSH:		request: flush the table (flag)
+ * @ACCOUNT_ATTR_GENERATION:	request: only addresses changed since, without
+ * 				flush; reply: the one to pass next (u32)
+ * @ACCOUNT_ATTR_FAMILY:	reply: %NFPROTO_IPV4 or %NFPROTO_IPV6 (u8)
+ * @ACCOUNT_ATTR_ITEMCOUNT:	reply: entries in the whole dump (u32)
+ * @ACCOUNT_ATTR_ENTRIES:	reply: array of struct ipt_acc_handle_ip or
+ * 				ipt_acc_handle_ip6, depending on the family,
+ * 				each followed by the protocol split if the
+ * 				flags have ACCOUNT_F_PROTO
+ * @ACCOUNT_ATTR_FLAGS:		reply: ACCOUNT_F_* of the table (u8)
+ * @ACCOUNT_ATTR_MISSED:	reply: see struct ipt_acc_snapshot (u64)
+ * @ACCOUNT_ATTR_REFILL_FAILED:	reply: see struct ipt_acc_snapshot (u64)
+ */
+enum {
+	ACCOUNT_ATTR_UNSPEC,
+	ACCOUNT_ATTR_TABLE,
+	ACCOUNT_ATTR_FLUSH,
+	ACCOUNT_ATTR_GENERATION,
+	ACCOUNT_ATTR_FAMILY,
+	ACCOUNT_ATTR_ITEMCOUNT,
+	ACCOUNT_ATTR_ENTRIES,
+	ACCOUNT_ATTR_FLAGS,
+	ACCOUNT_ATTR_MISSED,
+	ACCOUNT_ATTR_REFILL_FAILED,
+	__ACCOUNT_ATTR_MAX,
+};
+#define ACCOUNT_ATTR_MAX (__ACCOUNT_ATTR_MAX - 1)
+
 #endif /* _IPT_ACCOUNT_H */
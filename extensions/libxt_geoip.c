@@ -9,6 +9,7 @@
  *	version 2 of the License, or any later version, as published by the
  *	Free Software Foundation.
  */
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <ctype.h>
@@ -16,6 +17,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,8 +27,15 @@
 #include <unistd.h>
 #include <xtables.h>
 #include "xt_geoip.h"
+#include "xt_geoip_db.h"
 #include "compat_user.h"
 #define GEOIP_DB_DIR "/usr/share/xt_geoip"
+#define GEOIP_DB_PROC "/proc/net/xt_geoip/database"
+#if __BYTE_ORDER == __BIG_ENDIAN
+#	define GEOIP_DB_CONTAINER GEOIP_DB_DIR "/BE/" XT_GEOIP_DB_FILE
+#else
+#	define GEOIP_DB_CONTAINER GEOIP_DB_DIR "/LE/" XT_GEOIP_DB_FILE
+#endif
 
 static void geoip_help(void)
 {
@@ -36,6 +46,7 @@ static void geoip_help(void)
 	"[!] --dst-cc, --destination-country country[,country...]\n"
 	"	Match packet going to (one of) the specified country(ies)\n"
 	"\n"
+	"Both may be given to match on source and destination country at once.\n"
 	"NOTE: The country is inputed by its ISO3166 code.\n"
 	"\n"
 	);
@@ -49,23 +60,75 @@ static struct option geoip_opts[] = {
 	{NULL},
 };
 
+/*
+ * Map the xt_geoip.db container once. It stays mapped, since the ranges
+ * are handed to the kernel straight from it. Returns %NULL if there is
+ * none, in which case the per-country files are used.
+ */
+static const void *geoip_db_map(void)
+{
+	static const void *base;
+	static bool mapped;
+	const char *err;
+	struct stat sb;
+	void *p;
+	int fd;
+
+	if (mapped)
+		return base;
+	mapped = true;
+	fd = open(GEOIP_DB_CONTAINER, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			xtables_error(OTHER_PROBLEM, "Could not open %s: %s",
+				GEOIP_DB_CONTAINER, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0)
+		xtables_error(OTHER_PROBLEM, "Could not stat %s: %s",
+			GEOIP_DB_CONTAINER, strerror(errno));
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		xtables_error(OTHER_PROBLEM, "Could not map %s: %s",
+			GEOIP_DB_CONTAINER, strerror(errno));
+	/* The full checksum is left to xt_geoip_load; it reads the whole file */
+	err = geoip_db_check(p, sb.st_size);
+	if (err != NULL)
+		xtables_error(OTHER_PROBLEM, "%s: %s", GEOIP_DB_CONTAINER, err);
+	base = p;
+	return base;
+}
+
 static void *
 geoip_get_subnets(const char *code, uint32_t *count, uint8_t nfproto)
 {
+	const struct geoip_db_entry *ent;
+	const void *db = geoip_db_map();
 	void *subnets;
 	struct stat sb;
 	char buf[256];
 	int fd;
 
+	if (db != NULL) {
+		ent = geoip_db_find(db, (code[0] << 8) | code[1], nfproto);
+		if (ent == NULL)
+			xtables_error(OTHER_PROBLEM,
+				"geoip: %s is not in %s", code, GEOIP_DB_CONTAINER);
+		*count = ent->count;
+		return (void *)(db + ent->offset +
+		       sizeof(struct geoip_db_record));
+	}
+
 	/* Use simple integer vector files */
 	if (nfproto == NFPROTO_IPV6) {
-#if __BYTE_ORDER == _BIG_ENDIAN
+#if __BYTE_ORDER == __BIG_ENDIAN
 		snprintf(buf, sizeof(buf), GEOIP_DB_DIR "/BE/%s.iv6", code);
 #else
 		snprintf(buf, sizeof(buf), GEOIP_DB_DIR "/LE/%s.iv6", code);
 #endif
 	} else {
-#if __BYTE_ORDER == _BIG_ENDIAN
+#if __BYTE_ORDER == __BIG_ENDIAN
 		snprintf(buf, sizeof(buf), GEOIP_DB_DIR "/BE/%s.iv4", code);
 #else
 		snprintf(buf, sizeof(buf), GEOIP_DB_DIR "/LE/%s.iv4", code);
@@ -101,6 +164,40 @@ geoip_get_subnets(const char *code, uint32_t *count, uint8_t nfproto)
 	return subnets;
 }
 
+/*
+ * Whether @cc was loaded into the kernel with xt_geoip_load, in which case
+ * the rule only needs to carry the country code.
+ */
+static bool geoip_preloaded(unsigned short cc, uint8_t nfproto)
+{
+	static unsigned char map[2][(1 << 16) / CHAR_BIT];
+	static bool scanned;
+	char line[64], code[3], family[8];
+	unsigned int count, id;
+	FILE *fp;
+
+	if (!scanned) {
+		scanned = true;
+		fp = fopen(GEOIP_DB_PROC, "r");
+		if (fp == NULL)
+			return false;
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			/* Skips the "generation" line */
+			if (sscanf(line, "%2s %7s %u", code, family, &count) != 3 ||
+			    strlen(code) != 2)
+				continue;
+			id = (code[0] << 8) | code[1];
+			if (strcmp(family, "ipv6") == 0)
+				map[1][id / CHAR_BIT] |= 1 << (id % CHAR_BIT);
+			else if (strcmp(family, "ipv4") == 0)
+				map[0][id / CHAR_BIT] |= 1 << (id % CHAR_BIT);
+		}
+		fclose(fp);
+	}
+	return map[nfproto == NFPROTO_IPV6][cc / CHAR_BIT] &
+	       (1 << (cc % CHAR_BIT));
+}
+
 static struct geoip_country_user *geoip_load_cc(const char *code,
     unsigned short cc, uint8_t nfproto)
 {
@@ -171,11 +268,14 @@ static unsigned int parse_geoip_cc(const char *ccstr, uint16_t *cc,
 		if (next) *next++ = '\0';
 
 		if ((cctmp = check_geoip_cc(cp, cc, count)) != 0) {
-			if ((mem[count++].user =
+			/* A null pointer tells the kernel to use its database */
+			if (geoip_preloaded(cctmp, nfproto))
+				mem[count].user = 0;
+			else if ((mem[count].user =
 			    (unsigned long)geoip_load_cc(cp, cctmp, nfproto)) == 0)
 				xtables_error(OTHER_PROBLEM,
 					"geoip: insufficient memory available");
-			cc[count-1] = cctmp;
+			cc[count++] = cctmp;
 		}
 	}
 
@@ -243,6 +343,54 @@ static int geoip_parse4(int c, char **argv, int invert, unsigned int *flags,
 	       (void *)(*match)->data, NFPROTO_IPV4);
 }
 
+static int geoip_parse_v2(int c, bool invert, unsigned int *flags,
+    const char *arg, struct xt_geoip_mtinfo2 *info, uint8_t nfproto)
+{
+	switch (c) {
+	case '1':
+		if (*flags & XT_GEOIP_SRC)
+			xtables_error(PARAMETER_PROBLEM,
+				"geoip: --source-country may only be "
+				"specified once");
+		*flags |= XT_GEOIP_SRC;
+		if (invert)
+			*flags |= XT_GEOIP_INV;
+		info->src_count = parse_geoip_cc(arg, info->src_cc,
+		                  info->src_mem, nfproto);
+		info->flags = *flags;
+		return true;
+
+	case '2':
+		if (*flags & XT_GEOIP_DST)
+			xtables_error(PARAMETER_PROBLEM,
+				"geoip: --destination-country may only be "
+				"specified once");
+		*flags |= XT_GEOIP_DST;
+		if (invert)
+			*flags |= XT_GEOIP_DST_INV;
+		info->dst_count = parse_geoip_cc(arg, info->dst_cc,
+		                  info->dst_mem, nfproto);
+		info->flags = *flags;
+		return true;
+	}
+
+	return false;
+}
+
+static int geoip_parse6_v2(int c, char **argv, int invert,
+    unsigned int *flags, const void *entry, struct xt_entry_match **match)
+{
+	return geoip_parse_v2(c, invert, flags, optarg,
+	       (void *)(*match)->data, NFPROTO_IPV6);
+}
+
+static int geoip_parse4_v2(int c, char **argv, int invert,
+    unsigned int *flags, const void *entry, struct xt_entry_match **match)
+{
+	return geoip_parse_v2(c, invert, flags, optarg,
+	       (void *)(*match)->data, NFPROTO_IPV4);
+}
+
 static void
 geoip_final_check(unsigned int flags)
 {
@@ -277,6 +425,42 @@ geoip_print(const void *ip, const struct xt_entry_match *match, int numeric)
 	geoip_save(ip, match);
 }
 
+static void geoip_save_list(const uint16_t *cc, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		printf("%s%c%c", i ? "," : "", COUNTRY(cc[i]));
+}
+
+static void
+geoip_save_v2(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_geoip_mtinfo2 *info = (void *)match->data;
+
+	if (info->flags & XT_GEOIP_SRC) {
+		if (info->flags & XT_GEOIP_INV)
+			printf(" !");
+		printf(" --source-country ");
+		geoip_save_list(info->src_cc, info->src_count);
+	}
+	if (info->flags & XT_GEOIP_DST) {
+		if (info->flags & XT_GEOIP_DST_INV)
+			printf(" !");
+		printf(" --destination-country ");
+		geoip_save_list(info->dst_cc, info->dst_count);
+	}
+	printf(" ");
+}
+
+static void
+geoip_print_v2(const void *ip, const struct xt_entry_match *match,
+    int numeric)
+{
+	printf(" -m geoip");
+	geoip_save_v2(ip, match);
+}
+
 static struct xtables_match geoip_match[] = {
 	{
 		.family        = NFPROTO_IPV6,
@@ -306,6 +490,34 @@ static struct xtables_match geoip_match[] = {
 		.save          = geoip_save,
 		.extra_opts    = geoip_opts,
 	},
+	{
+		.family        = NFPROTO_IPV6,
+		.name          = "geoip",
+		.revision      = 2,
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof(struct xt_geoip_mtinfo2)),
+		.userspacesize = offsetof(struct xt_geoip_mtinfo2, src_mem),
+		.help          = geoip_help,
+		.parse         = geoip_parse6_v2,
+		.final_check   = geoip_final_check,
+		.print         = geoip_print_v2,
+		.save          = geoip_save_v2,
+		.extra_opts    = geoip_opts,
+	},
+	{
+		.family        = NFPROTO_IPV4,
+		.name          = "geoip",
+		.revision      = 2,
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof(struct xt_geoip_mtinfo2)),
+		.userspacesize = offsetof(struct xt_geoip_mtinfo2, src_mem),
+		.help          = geoip_help,
+		.parse         = geoip_parse4_v2,
+		.final_check   = geoip_final_check,
+		.print         = geoip_print_v2,
+		.save          = geoip_save_v2,
+		.extra_opts    = geoip_opts,
+	},
 };
 
 static __attribute__((constructor)) void geoip_mt_ldr(void)
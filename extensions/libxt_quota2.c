@@ -9,7 +9,9 @@
  *	Free Software Foundation.
  */
 #include <getopt.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +25,11 @@ enum {
 	FL_GROW      = 1 << 2,
 	FL_PACKET    = 1 << 3,
 	FL_NO_CHANGE = 1 << 4,
+	FL_REFILL    = 1 << 5,
+	FL_INTERVAL  = 1 << 6,
+	FL_BURST     = 1 << 7,
+	FL_NOTIFY    = 1 << 8,
+	FL_WATERMARK = 1 << 9,
 };
 
 static const struct option quota_mt2_opts[] = {
@@ -34,6 +41,28 @@ static const struct option quota_mt2_opts[] = {
 	{NULL},
 };
 
+static const struct option quota_mt3_opts[] = {
+	{.name = "grow",      .has_arg = false, .val = 'g'},
+	{.name = "no-change", .has_arg = false, .val = 'c'},
+	{.name = "name",      .has_arg = true,  .val = 'n'},
+	{.name = "quota",     .has_arg = true,  .val = 'q'},
+	{.name = "packets",   .has_arg = false, .val = 'p'},
+	{.name = "refill",    .has_arg = true,  .val = 'r'},
+	{.name = "interval",  .has_arg = true,  .val = 'i'},
+	{.name = "burst",     .has_arg = true,  .val = 'b'},
+	{.name = "notify",    .has_arg = false, .val = 'e'},
+	{.name = "watermark", .has_arg = true,  .val = 'w'},
+	{NULL},
+};
+
+/* Interval suffixes, largest first for printing */
+static const struct {
+	const char *suffix;
+	unsigned int ms;
+} quota_units[] = {
+	{"d", 86400000}, {"h", 3600000}, {"m", 60000}, {"s", 1000}, {"ms", 1},
+};
+
 static void quota_mt2_help(void)
 {
 	printf(
@@ -46,44 +75,55 @@ static void quota_mt2_help(void)
 	);
 }
 
+static void quota_mt3_help(void)
+{
+	quota_mt2_help();
+	printf(
+	"    --refill amount  add this much to the quota every interval\n"
+	"    --interval time  refill interval (number with ms, s, m, h or d)\n"
+	"    --burst amount   refill no further than this (default: refill)\n"
+	"    --notify         send netlink events when the quota runs out\n"
+	"    --watermark n    also when it crosses n (implies --notify)\n"
+	);
+}
+
 static int
-quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
-	        const void *entry, struct xt_entry_match **match)
+quota_parse_common(int c, int invert, unsigned int *flags, char *name,
+                   u_int8_t *qflags, __u64 *quota)
 {
-	struct xt_quota_mtinfo2 *info = (void *)(*match)->data;
 	char *end;
 
 	switch (c) {
 	case 'g':
 		xtables_param_act(XTF_ONLY_ONCE, "quota", "--grow", *flags & FL_GROW);
 		xtables_param_act(XTF_NO_INVERT, "quota", "--grow", invert);
-		info->flags |= XT_QUOTA_GROW;
+		*qflags |= XT_QUOTA_GROW;
 		*flags |= FL_GROW;
 		return true;
 	case 'c': /* no-change */
 		xtables_param_act(XTF_ONLY_ONCE, "quota", "--no-change", *flags & FL_NO_CHANGE);
 		xtables_param_act(XTF_NO_INVERT, "quota", "--no-change", invert);
-		info->flags |= XT_QUOTA_NO_CHANGE;
+		*qflags |= XT_QUOTA_NO_CHANGE;
 		*flags |= FL_NO_CHANGE;
 		return true;
 	case 'n':
 		/* zero termination done on behalf of the kernel module */
 		xtables_param_act(XTF_ONLY_ONCE, "quota", "--name", *flags & FL_NAME);
 		xtables_param_act(XTF_NO_INVERT, "quota", "--name", invert);
-		strncpy(info->name, optarg, sizeof(info->name));
+		strncpy(name, optarg, sizeof(((struct xt_quota_mtinfo2 *)NULL)->name));
 		*flags |= FL_NAME;
 		return true;
 	case 'p':
 		xtables_param_act(XTF_ONLY_ONCE, "quota", "--packets", *flags & FL_PACKET);
 		xtables_param_act(XTF_NO_INVERT, "quota", "--packets", invert);
-		info->flags |= XT_QUOTA_PACKET;
+		*qflags |= XT_QUOTA_PACKET;
 		*flags |= FL_PACKET;
 		return true;
 	case 'q':
 		xtables_param_act(XTF_ONLY_ONCE, "quota", "--quota", *flags & FL_QUOTA);
 		if (invert)
-			info->flags |= XT_QUOTA_INVERT;
-		info->quota = strtoull(optarg, &end, 0);
+			*qflags |= XT_QUOTA_INVERT;
+		*quota = strtoull(optarg, &end, 0);
 		if (*end != '\0')
 			xtables_error(PARAMETER_PROBLEM, "quota match: "
 			           "invalid value for --quota");
@@ -93,22 +133,150 @@ quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
 	return false;
 }
 
-static void
-quota_mt2_save(const void *ip, const struct xt_entry_match *match)
+static int
+quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
+	        const void *entry, struct xt_entry_match **match)
 {
-	const struct xt_quota_mtinfo2 *q = (void *)match->data;
+	struct xt_quota_mtinfo2 *info = (void *)(*match)->data;
+
+	return quota_parse_common(c, invert, flags, info->name,
+	       &info->flags, &info->quota);
+}
+
+static u_int64_t quota_parse_amount(const char *arg, const char *opt)
+{
+	unsigned long long value;
+	char *end;
+
+	value = strtoull(arg, &end, 0);
+	if (*end != '\0' || value == 0)
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "invalid value for %s", opt);
+	return value;
+}
+
+static u_int32_t quota_parse_interval(const char *arg)
+{
+	unsigned int i, units = sizeof(quota_units) / sizeof(*quota_units);
+	unsigned long long value;
+	const char *unit;
+	char *end;
+
+	value = strtoull(arg, &end, 0);
+	unit  = (*end != '\0') ? end : "s";
+	for (i = 0; i < units; ++i)
+		if (strcmp(unit, quota_units[i].suffix) == 0)
+			break;
+	if (end == arg || i == units || value == 0 ||
+	    value > UINT32_MAX / quota_units[i].ms)
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "invalid value for --interval");
+	return value * quota_units[i].ms;
+}
 
-	if (q->flags & XT_QUOTA_GROW)
+static int
+quota_mt3_parse(int c, char **argv, int invert, unsigned int *flags,
+	        const void *entry, struct xt_entry_match **match)
+{
+	struct xt_quota_mtinfo3 *info = (void *)(*match)->data;
+
+	switch (c) {
+	case 'r':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--refill", *flags & FL_REFILL);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--refill", invert);
+		info->refill = quota_parse_amount(optarg, "--refill");
+		*flags |= FL_REFILL;
+		return true;
+	case 'i':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--interval", *flags & FL_INTERVAL);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--interval", invert);
+		info->interval = quota_parse_interval(optarg);
+		*flags |= FL_INTERVAL;
+		return true;
+	case 'b':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--burst", *flags & FL_BURST);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--burst", invert);
+		info->burst = quota_parse_amount(optarg, "--burst");
+		*flags |= FL_BURST;
+		return true;
+	case 'e':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--notify", *flags & FL_NOTIFY);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--notify", invert);
+		info->flags |= XT_QUOTA_NOTIFY;
+		*flags |= FL_NOTIFY;
+		return true;
+	case 'w':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--watermark", *flags & FL_WATERMARK);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--watermark", invert);
+		info->watermark = quota_parse_amount(optarg, "--watermark");
+		info->flags |= XT_QUOTA_NOTIFY;
+		*flags |= FL_WATERMARK;
+		return true;
+	}
+	return quota_parse_common(c, invert, flags, info->name,
+	       &info->flags, &info->quota);
+}
+
+static void quota_mt3_check(unsigned int flags)
+{
+	if (!(flags & FL_REFILL) != !(flags & FL_INTERVAL))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--refill and --interval go together");
+	if ((flags & FL_BURST) && !(flags & FL_REFILL))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--burst needs --refill");
+	if ((flags & FL_REFILL) && (flags & FL_GROW))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--refill cannot be used with --grow");
+	if ((flags & (FL_NOTIFY | FL_WATERMARK)) && !(flags & FL_NAME))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--notify and --watermark need --name");
+}
+
+static void
+quota_save_common(const char *name, u_int8_t flags, u_int64_t quota)
+{
+	if (flags & XT_QUOTA_GROW)
 		printf(" --grow ");
-	if (q->flags & XT_QUOTA_NO_CHANGE)
+	if (flags & XT_QUOTA_NO_CHANGE)
 		printf(" --no-change ");
-	if (q->flags & XT_QUOTA_PACKET)
+	if (flags & XT_QUOTA_PACKET)
 		printf(" --packets ");
-	if (*q->name != '\0')
-		printf(" --name %s ", q->name);
-	if (q->flags & XT_QUOTA_INVERT)
+	if (*name != '\0')
+		printf(" --name %s ", name);
+	if (flags & XT_QUOTA_INVERT)
 		printf(" !");
-	printf(" --quota %llu ", (unsigned long long)q->quota);
+	printf(" --quota %llu ", (unsigned long long)quota);
+}
+
+static void
+quota_mt2_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_quota_mtinfo2 *q = (void *)match->data;
+
+	quota_save_common(q->name, q->flags, q->quota);
+}
+
+static void
+quota_mt3_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_quota_mtinfo3 *q = (void *)match->data;
+	unsigned int i;
+
+	quota_save_common(q->name, q->flags, q->quota);
+	if (q->refill != 0) {
+		for (i = 0; q->interval % quota_units[i].ms != 0; ++i)
+			;
+		printf(" --refill %llu --interval %u%s ",
+		       (unsigned long long)q->refill,
+		       q->interval / quota_units[i].ms, quota_units[i].suffix);
+		if (q->burst != 0)
+			printf(" --burst %llu ", (unsigned long long)q->burst);
+	}
+	if (q->watermark != 0)
+		printf(" --watermark %llu ", (unsigned long long)q->watermark);
+	else if (q->flags & XT_QUOTA_NOTIFY)
+		printf(" --notify ");
 }
 
 static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
@@ -118,21 +286,45 @@ static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
 	quota_mt2_save(ip, match);
 }
 
-static struct xtables_match quota_mt2_reg = {
-	.family        = NFPROTO_UNSPEC,
-	.revision      = 3,
-	.name          = "quota2",
-	.version       = XTABLES_VERSION,
-	.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
-	.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
-	.help          = quota_mt2_help,
-	.parse         = quota_mt2_parse,
-	.print         = quota_mt2_print,
-	.save          = quota_mt2_save,
-	.extra_opts    = quota_mt2_opts,
+static void quota_mt3_print(const void *ip, const struct xt_entry_match *match,
+                            int numeric)
+{
+	printf(" -m quota");
+	quota_mt3_save(ip, match);
+}
+
+static struct xtables_match quota_mt2_reg[] = {
+	{
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 3,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
+		.help          = quota_mt2_help,
+		.parse         = quota_mt2_parse,
+		.print         = quota_mt2_print,
+		.save          = quota_mt2_save,
+		.extra_opts    = quota_mt2_opts,
+	},
+	{
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 4,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo3)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo3, quota),
+		.help          = quota_mt3_help,
+		.parse         = quota_mt3_parse,
+		.final_check   = quota_mt3_check,
+		.print         = quota_mt3_print,
+		.save          = quota_mt3_save,
+		.extra_opts    = quota_mt3_opts,
+	},
 };
 
 static __attribute__((constructor)) void quota2_mt_ldr(void)
 {
-	xtables_register_match(&quota_mt2_reg);
+	xtables_register_matches(quota_mt2_reg,
+		sizeof(quota_mt2_reg) / sizeof(*quota_mt2_reg));
 }
@@ -13,15 +13,24 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
 #include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <linux/netfilter/x_tables.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
+#include <net/net_namespace.h>
 #include "xt_geoip.h"
+#include "xt_geoip_index.h"
 #include "compat_xtables.h"
 
 MODULE_LICENSE("GPL");
@@ -37,22 +46,115 @@ enum geoip_proto {
 	__GEOIPROTO_MAX,
 };
 
+/* Per-CPU match statistics of one country */
+struct geoip_country_stats {
+	u64 lookups, hits;
+};
+
 /**
  * @list:	anchor point for geoip_head
  * @subnets:	packed ordered list of ranges (either v6 or v4)
  * @count:	number of ranges
+ * @supplied:	number of ranges before normalization
  * @cc:		country code
+ * @db:		country was loaded through /proc/net/xt_geoip/database,
+ * 		which then holds one reference
+ * @stats:	how often rules asked for this country, and how often the
+ * 		address was in it
  */
 struct geoip_country_kernel {
 	struct list_head list;
 	void *subnets;
+	struct geoip_country_stats __percpu *stats;
 	atomic_t ref;
-	unsigned int count;
+	unsigned int count, supplied;
 	unsigned short cc;
+	bool db;
+};
+
+/**
+ * Write state of an open /proc/net/xt_geoip/database
+ * @rec:	header of the record being received
+ * @rec_fill:	bytes of @rec received so far
+ * @cur:	country being received, %NULL while in a header
+ * @cur_size:	size of @cur->subnets
+ * @cur_fill:	bytes of @cur->subnets received so far
+ * @proto:	family of @cur
+ * @staged:	countries received completely
+ * @broken:	stream was malformed, discard everything on close
+ * @closed:	the countries were committed or discarded, no more writes
+ */
+struct geoip_loader {
+	struct geoip_db_record rec;
+	size_t rec_fill;
+	struct geoip_country_kernel *cur;
+	size_t cur_size, cur_fill;
+	enum geoip_proto proto;
+	struct list_head staged[__GEOIPROTO_MAX];
+	bool broken, closed;
+};
+
+/**
+ * Merged lookup index over all loaded countries of one address family
+ * @count:	number of ranges
+ * @begin:	start addresses of disjoint ranges (u32 or in6_addr)
+ * @end:	inclusive end addresses
+ * @set:	offset into @cc_pool of the country set owning each range
+ * @cc_pool:	country sets, each being a length followed by that many
+ * 		country codes
+ * @fine:	IPv6 only, full-width ranges of the /64s marked
+ * 		%GEOIP_SET_FULL; shares @cc_pool with its parent
+ *
+ * Where countries overlap, ranges are split so that every address maps
+ * to exactly one set; a lookup thus needs a single search no matter how
+ * many countries a rule lists.
+ *
+ * While being built, the arrays are in sorted order. The published index
+ * has @count + 1 entries laid out as described in xt_geoip_index.h.
+ * For IPv6, @begin and @end then hold the upper 64 bits of addresses only
+ * (see geoip_split6).
+ */
+struct geoip_index {
+	unsigned int count;
+	void *begin, *end;
+	unsigned int *set;
+	u16 *cc_pool;
+	struct geoip_index *fine;
+};
+
+/**
+ * One generation of the lookup indexes, published as a whole
+ * @index:	per-family index, %NULL if the family has no ranges
+ * @generation:	bumped on every change, starting at 1
+ *
+ * Rules refer to countries by code, so replacing the ranges of a country
+ * only takes building new indexes and flipping the geoip_db pointer;
+ * packets see either the old or the new generation in full.
+ */
+struct geoip_db {
+	struct geoip_index *index[__GEOIPROTO_MAX];
+	unsigned long generation;
+};
+
+/* Lookup times in log2(ns) buckets, the last one catching everything above */
+#define GEOIP_LATENCY_BUCKETS 32
+struct geoip_latency {
+	u64 bucket[__GEOIPROTO_MAX][GEOIP_LATENCY_BUCKETS];
 };
 
 static struct list_head geoip_head[__GEOIPROTO_MAX];
-static DEFINE_SPINLOCK(geoip_lock);
+static struct geoip_db __rcu *geoip_db;
+static DEFINE_MUTEX(geoip_mutex);
+static struct proc_dir_entry *geoip_proc_dir;
+
+/* Upper bound for a single country, well above any real one */
+static const unsigned int geoip_max_ranges = 1 << 22;
+
+static struct geoip_latency __percpu *geoip_latency;
+static bool geoip_latency_stats;
+module_param_named(latency_stats, geoip_latency_stats, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_stats, "record lookup times in "
+	"/proc/net/xt_geoip/stats (default: off)");
 
 static const enum geoip_proto nfp2geo[] = {
 	[NFPROTO_IPV6] = GEOIPROTO_IPV6,
@@ -62,7 +164,291 @@ static const size_t geoproto_size[] = {
 	[GEOIPROTO_IPV6] = sizeof(struct geoip_subnet6),
 	[GEOIPROTO_IPV4] = sizeof(struct geoip_subnet4),
 };
+static const char *const geoproto_name[] = {
+	[GEOIPROTO_IPV6] = "ipv6",
+	[GEOIPROTO_IPV4] = "ipv4",
+};
+
+/**
+ * geoip_node_normalize - sort and coalesce the ranges of a new country
+ *
+ * Overlapping, adjacent and contained ranges are merged, inverted ones
+ * dropped, and the array is shrunk to fit. Userspace need not hand in
+ * sorted data, and the index build has less to chew on.
+ */
+static void geoip_node_normalize(struct geoip_country_kernel *p,
+    enum geoip_proto proto)
+{
+	size_t esize = geoproto_size[proto];
+	unsigned int n;
+	void *shrunk;
+
+	p->supplied = p->count;
+	if (p->count == 0)
+		return;
+	sort(p->subnets, p->count, esize, (proto == GEOIPROTO_IPV4) ?
+	     geoip_subnet4_cmp : geoip_subnet6_cmp, NULL);
+	n = geoip_coalesce(p->subnets, p->count, proto == GEOIPROTO_IPV6);
+
+	if (n == p->count)
+		return;
+	p->count = n;
+	shrunk = (n > 0) ? vmalloc(n * esize) : NULL;
+	if (n > 0 && shrunk == NULL)
+		return;
+	if (n > 0)
+		memcpy(shrunk, p->subnets, n * esize);
+	vfree(p->subnets);
+	p->subnets = shrunk;
+}
+
+static void geoip_index_free(struct geoip_index *idx)
+{
+	if (idx == NULL)
+		return;
+	vfree(idx->begin);
+	vfree(idx->end);
+	vfree(idx->set);
+	kfree(idx->cc_pool);
+	geoip_index_free(idx->fine);
+	kfree(idx);
+}
+
+/**
+ * geoip_index_layout - convert sorted arrays of @idx into Eytzinger order
+ * @asize:	size of one address
+ */
+static int geoip_index_layout(struct geoip_index *idx, size_t asize)
+{
+	unsigned int n = idx->count, *perm, *set;
+	void *begin, *end;
+
+	perm  = vmalloc((n + 1) * sizeof(*perm));
+	begin = vmalloc((n + 1) * asize);
+	end   = vmalloc((n + 1) * asize);
+	set   = vmalloc((n + 1) * sizeof(*set));
+	if (perm == NULL || begin == NULL || end == NULL || set == NULL) {
+		vfree(perm);
+		vfree(begin);
+		vfree(end);
+		vfree(set);
+		return -ENOMEM;
+	}
+
+	geoip_eytz_layout(perm, idx->begin, idx->end, idx->set, n, asize,
+	                  begin, end, set);
+	vfree(perm);
+	vfree(idx->begin);
+	vfree(idx->end);
+	vfree(idx->set);
+	idx->begin = begin;
+	idx->end   = end;
+	idx->set   = set;
+	return 0;
+}
+
+/**
+ * geoip_index_compress6 - turn sorted full-width IPv6 arrays of @idx into
+ * the /64 prefix index plus its full-width fallback, both in Eytzinger order
+ */
+static int geoip_index_compress6(struct geoip_index *idx)
+{
+	const struct in6_addr *begin = idx->begin, *end = idx->end;
+	unsigned int n = idx->count, i, j, nfine, *fine = NULL, *cset = NULL;
+	struct in6_addr *fbegin, *fend;
+	u64 *cbegin = NULL, *cend = NULL;
+	int ret = -ENOMEM;
+
+	cbegin = vmalloc(3 * n * sizeof(*cbegin));
+	cend   = vmalloc(3 * n * sizeof(*cend));
+	cset   = vmalloc(3 * n * sizeof(*cset));
+	fine   = vmalloc(n * sizeof(*fine));
+	if (cbegin == NULL || cend == NULL || cset == NULL || fine == NULL)
+		goto out;
+	i = geoip_split6(begin, end, idx->set, n, cbegin, cend, cset,
+	    fine, &nfine);
+
+	if (nfine > 0) {
+		idx->fine = kzalloc(sizeof(*idx->fine), GFP_KERNEL);
+		if (idx->fine == NULL)
+			goto out;
+		idx->fine->begin = fbegin = vmalloc(nfine * sizeof(*fbegin));
+		idx->fine->end   = fend   = vmalloc(nfine * sizeof(*fend));
+		idx->fine->set   = vmalloc(nfine * sizeof(*idx->fine->set));
+		if (fbegin == NULL || fend == NULL || idx->fine->set == NULL)
+			goto out;
+		idx->fine->count = nfine;
+		for (j = 0; j < nfine; ++j) {
+			fbegin[j] = begin[fine[j]];
+			fend[j]   = end[fine[j]];
+			idx->fine->set[j] = idx->set[fine[j]];
+		}
+		ret = geoip_index_layout(idx->fine, sizeof(*fbegin));
+		if (ret < 0)
+			goto out;
+	}
+
+	vfree(idx->begin);
+	vfree(idx->end);
+	vfree(idx->set);
+	idx->begin = cbegin;
+	idx->end   = cend;
+	idx->set   = cset;
+	idx->count = i;
+	cbegin = cend = NULL;
+	cset = NULL;
+	ret = geoip_index_layout(idx, sizeof(u64));
+ out:
+	vfree(cbegin);
+	vfree(cend);
+	vfree(cset);
+	vfree(fine);
+	return ret;
+}
+
+/**
+ * geoip_index_build - build a merged index from all countries of @proto
+ *
+ * Returns %NULL if there is nothing to index. Caller holds geoip_mutex.
+ */
+static struct geoip_index *geoip_index_build(enum geoip_proto proto)
+{
+	const struct geoip_country_kernel *p;
+	struct geoip_builder b = {};
+	struct geoip_event *ev = NULL;
+	struct geoip_index *idx = NULL;
+	size_t asize = geoproto_size[proto] / 2;
+	bool v6 = proto == GEOIPROTO_IPV6;
+	unsigned int k, nev = 0;
+	u16 *cc = NULL;
+	int ret = -ENOMEM;
+
+	list_for_each_entry(p, &geoip_head[proto], list) {
+		++b.nslots;
+		nev += 2 * p->count;
+	}
+	if (nev == 0)
+		return NULL;
+
+	b.cc = cc = kmalloc(b.nslots * sizeof(*cc), GFP_KERNEL);
+	b.active  = kcalloc(b.nslots, sizeof(*b.active), GFP_KERNEL);
+	b.scratch = kmalloc((b.nslots + 1) * sizeof(*b.scratch), GFP_KERNEL);
+	b.pool_size = 2 * b.nslots;
+	b.pool    = kmalloc(b.pool_size * sizeof(*b.pool), GFP_KERNEL);
+	ev        = vmalloc(nev * sizeof(*ev));
+	idx       = kzalloc(sizeof(*idx), GFP_KERNEL);
+	if (cc == NULL || b.active == NULL || b.scratch == NULL ||
+	    b.pool == NULL || ev == NULL || idx == NULL)
+		goto out;
+
+	/* Upper bound; the real size is known after the sweep */
+	idx->begin = vmalloc(nev * asize);
+	idx->end   = vmalloc(nev * asize);
+	idx->set   = vmalloc(nev * sizeof(*idx->set));
+	if (idx->begin == NULL || idx->end == NULL || idx->set == NULL)
+		goto out;
+
+	nev = 0;
+	k = 0;
+	list_for_each_entry(p, &geoip_head[proto], list) {
+		cc[k] = p->cc;
+		b.pool[2*k] = 1;
+		b.pool[2*k+1] = p->cc;
+		nev += geoip_events_add(&ev[nev], v6, p->subnets, p->count, k);
+		++k;
+	}
+	b.pool_len = 2 * b.nslots;
+
+	sort(ev, nev, sizeof(*ev), geoip_event_cmp, NULL);
+	ret = geoip_index_sweep(&b, v6, ev, nev, idx->begin, idx->end,
+	      idx->set);
+	if (ret < 0)
+		goto out;
+	idx->count = ret;
+	vfree(ev);
+	ev = NULL;
+
+	if (idx->count == 0) {
+		ret = 0;
+		goto out;
+	}
+	if (v6)
+		ret = geoip_index_compress6(idx);
+	else
+		ret = geoip_index_layout(idx, asize);
+	if (ret < 0)
+		goto out;
+	idx->cc_pool = b.pool;
+	b.pool = NULL;
+	ret = 0;
+
+ out:
+	vfree(ev);
+	kfree(cc);
+	kfree(b.active);
+	kfree(b.scratch);
+	kfree(b.pool);
+	if (ret < 0 || idx->count == 0) {
+		geoip_index_free(idx);
+		return (ret < 0) ? ERR_PTR(ret) : NULL;
+	}
+	return idx;
+}
+
+/**
+ * geoip_db_rebuild - publish a new generation after a list change
+ * @protos:	bitmask of the families whose lists changed
+ *
+ * The indexes of the other families are carried over. Nothing is
+ * published if any index fails to build. Caller holds geoip_mutex.
+ */
+static int geoip_db_rebuild(unsigned int protos)
+{
+	struct geoip_db *db, *old;
+	unsigned int proto;
+	int ret;
+
+	old = rcu_dereference_protected(geoip_db,
+	      lockdep_is_held(&geoip_mutex));
+	db = kzalloc(sizeof(*db), GFP_KERNEL);
+	if (db == NULL)
+		return -ENOMEM;
 
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto) {
+		if (!(protos & (1 << proto))) {
+			db->index[proto] = (old != NULL) ? old->index[proto] : NULL;
+			continue;
+		}
+		db->index[proto] = geoip_index_build(proto);
+		if (IS_ERR(db->index[proto])) {
+			ret = PTR_ERR(db->index[proto]);
+			goto out;
+		}
+	}
+	db->generation = (old != NULL) ? old->generation + 1 : 1;
+
+	rcu_assign_pointer(geoip_db, db);
+	if (old == NULL)
+		return 0;
+	synchronize_rcu();
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		if (protos & (1 << proto))
+			geoip_index_free(old->index[proto]);
+	kfree(old);
+	return 0;
+
+ out:
+	while (proto-- > 0)
+		if (protos & (1 << proto))
+			geoip_index_free(db->index[proto]);
+	kfree(db);
+	return ret;
+}
+
+/*
+ * Load a country handed in by a rule. Caller holds geoip_mutex and
+ * rebuilds the index once all countries of the rule are in.
+ */
 static struct geoip_country_kernel *
 geoip_add_node(const struct geoip_country_user __user *umem_ptr,
                enum geoip_proto proto)
@@ -79,6 +465,11 @@ geoip_add_node(const struct geoip_country_user __user *umem_ptr,
 	p = kmalloc(sizeof(struct geoip_country_kernel), GFP_KERNEL);
 	if (p == NULL)
 		return ERR_PTR(-ENOMEM);
+	p->stats = alloc_percpu(struct geoip_country_stats);
+	if (p->stats == NULL) {
+		ret = -ENOMEM;
+		goto free_p;
+	}
 
 	p->count   = umem.count;
 	p->cc      = umem.cc;
@@ -103,231 +494,794 @@ geoip_add_node(const struct geoip_country_user __user *umem_ptr,
 	}
 
 	p->subnets = subnet;
+	p->db      = false;
 	atomic_set(&p->ref, 1);
 	INIT_LIST_HEAD(&p->list);
-
-	spin_lock(&geoip_lock);
-	list_add_tail_rcu(&p->list, &geoip_head[proto]);
-	spin_unlock(&geoip_lock);
-
+	geoip_node_normalize(p, proto);
+	list_add_tail(&p->list, &geoip_head[proto]);
 	return p;
 
  free_s:
 	vfree(subnet);
  free_p:
+	free_percpu(p->stats);
 	kfree(p);
 	return ERR_PTR(ret);
 }
 
-static void geoip_try_remove_node(struct geoip_country_kernel *p)
+static void geoip_node_free(struct geoip_country_kernel *p)
 {
-	spin_lock(&geoip_lock);
-	if (!atomic_dec_and_test(&p->ref)) {
-		spin_unlock(&geoip_lock);
-		return;
-	}
+	vfree(p->subnets);
+	free_percpu(p->stats);
+	kfree(p);
+}
+
+/* Exchange the ranges of two nodes of the same family */
+static void geoip_node_swap(struct geoip_country_kernel *a,
+    struct geoip_country_kernel *b)
+{
+	swap(a->subnets, b->subnets);
+	swap(a->count, b->count);
+	swap(a->supplied, b->supplied);
+}
+
+/*
+ * Drop a reference to @p; returns true if that was the last one. The
+ * packet path only looks at the index, which holds its own copy of the
+ * ranges, so the node can go right away and the caller rebuilds the index
+ * once for all countries of a rule. Caller holds geoip_mutex.
+ */
+static bool geoip_put_node(struct geoip_country_kernel *p)
+{
+	if (!atomic_dec_and_test(&p->ref))
+		return false;
 
 	/* So now am unlinked or the only one alive, right ?
 	 * What are you waiting ? Free up some memory!
 	 */
-	list_del_rcu(&p->list);
-	spin_unlock(&geoip_lock);
+	list_del(&p->list);
+	geoip_node_free(p);
+	return true;
+}
 
-	synchronize_rcu();
-	vfree(p->subnets);
-	kfree(p);
+/* Rebuild after geoip_put_node() dropped countries; caller holds geoip_mutex */
+static void geoip_db_shrink(enum geoip_proto proto)
+{
+	/*
+	 * Should the rebuild fail, the old index just keeps answering for
+	 * countries that no rule asks about anymore.
+	 */
+	if (geoip_db_rebuild(1 << proto) < 0)
+		printk(KERN_WARNING "xt_geoip: could not shrink index\n");
 }
 
-static struct geoip_country_kernel *find_node(unsigned short cc,
+/* Caller holds geoip_mutex */
+static struct geoip_country_kernel *__find_node(unsigned short cc,
     enum geoip_proto proto)
 {
 	struct geoip_country_kernel *p;
-	spin_lock(&geoip_lock);
 
-	list_for_each_entry_rcu(p, &geoip_head[proto], list)
-		if (p->cc == cc) {
-			atomic_inc(&p->ref);
-			spin_unlock(&geoip_lock);
+	list_for_each_entry(p, &geoip_head[proto], list)
+		if (p->cc == cc)
 			return p;
+	return NULL;
+}
+
+static void geoip_loader_free(struct geoip_loader *ld)
+{
+	struct geoip_country_kernel *p, *next;
+	unsigned int proto;
+
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		list_for_each_entry_safe(p, next, &ld->staged[proto], list) {
+			list_del(&p->list);
+			geoip_node_free(p);
 		}
+	if (ld->cur != NULL)
+		geoip_node_free(ld->cur);
+	kfree(ld);
+}
 
-	spin_unlock(&geoip_lock);
-	return NULL;
+/**
+ * geoip_loader_commit - make staged countries available to rules
+ *
+ * Countries that are already loaded, be it by rules or an earlier database
+ * load, get the new ranges swapped into their existing node, so rules
+ * referring to them pick up the new data without being reloaded. All
+ * families are switched over in a single generation; if that fails, the
+ * previous ranges are swapped back, nothing changes and the error is
+ * returned.
+ */
+static int geoip_loader_commit(struct geoip_loader *ld)
+{
+	struct geoip_country_kernel *p, *next, *old;
+	struct list_head *tail[__GEOIPROTO_MAX];
+	unsigned int proto, touched = 0;
+	int ret;
+
+	mutex_lock(&geoip_mutex);
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto) {
+		tail[proto] = geoip_head[proto].prev;
+		list_for_each_entry_safe(p, next, &ld->staged[proto], list) {
+			touched |= 1 << proto;
+			old = __find_node(p->cc, proto);
+			if (old == NULL) {
+				p->db = true;
+				atomic_set(&p->ref, 1);
+				list_move_tail(&p->list, &geoip_head[proto]);
+				continue;
+			}
+			/* @p stays staged, holding the old ranges from now on */
+			geoip_node_swap(old, p);
+		}
+	}
+
+	ret = (touched != 0) ? geoip_db_rebuild(touched) : 0;
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto) {
+		if (ret == 0) {
+			list_for_each_entry(p, &ld->staged[proto], list) {
+				old = __find_node(p->cc, proto);
+				if (!old->db) {
+					old->db = true;
+					atomic_inc(&old->ref);
+				}
+			}
+			continue;
+		}
+		/* Backwards, in case a country was sent more than once */
+		list_for_each_entry_reverse(p, &ld->staged[proto], list)
+			geoip_node_swap(__find_node(p->cc, proto), p);
+		while (geoip_head[proto].prev != tail[proto]) {
+			p = list_entry(geoip_head[proto].prev,
+			    struct geoip_country_kernel, list);
+			list_del(&p->list);
+			geoip_node_free(p);
+		}
+	}
+	if (ret < 0)
+		printk(KERN_ERR "xt_geoip: could not index database: %d\n", ret);
+	mutex_unlock(&geoip_mutex);
+	return ret;
 }
 
-static inline int
-ipv6_cmp(const struct in6_addr *p, const struct in6_addr *q)
+/* Start a country once its record header is complete */
+static int geoip_loader_begin(struct geoip_loader *ld)
 {
-	unsigned int i;
+	const struct geoip_db_record *rec = &ld->rec;
+	struct geoip_country_kernel *p;
+	enum geoip_proto proto;
+
+	if (rec->nfproto == NFPROTO_IPV4)
+		proto = GEOIPROTO_IPV4;
+	else if (rec->nfproto == NFPROTO_IPV6)
+		proto = GEOIPROTO_IPV6;
+	else
+		return -EINVAL;
+	if (rec->count > geoip_max_ranges)
+		return -E2BIG;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (p == NULL)
+		return -ENOMEM;
+	p->cc    = rec->cc;
+	p->count = rec->count;
+	INIT_LIST_HEAD(&p->list);
+	p->stats = alloc_percpu(struct geoip_country_stats);
+	if (p->count > 0)
+		p->subnets = vmalloc(p->count * geoproto_size[proto]);
+	if (p->stats == NULL || (p->count > 0 && p->subnets == NULL)) {
+		geoip_node_free(p);
+		return -ENOMEM;
+	}
+	ld->cur      = p;
+	ld->cur_size = p->count * geoproto_size[proto];
+	ld->cur_fill = 0;
+	ld->proto    = proto;
+	ld->rec_fill = 0;
+	return 0;
+}
+
+static ssize_t geoip_db_write(struct file *file, const char __user *buf,
+    size_t size, loff_t *ppos)
+{
+	struct geoip_loader *ld = file->private_data;
+	size_t done = 0, len;
+	int ret;
+
+	if (ld->broken || ld->closed)
+		return -EINVAL;
+
+	while (done < size) {
+		if (ld->cur == NULL) {
+			len = min(size - done, sizeof(ld->rec) - ld->rec_fill);
+			if (copy_from_user((void *)&ld->rec + ld->rec_fill,
+			    buf + done, len) != 0) {
+				ret = -EFAULT;
+				goto broken;
+			}
+			done += len;
+			ld->rec_fill += len;
+			if (ld->rec_fill < sizeof(ld->rec))
+				break;
+			ret = geoip_loader_begin(ld);
+			if (ret < 0)
+				goto broken;
+		} else {
+			len = min(size - done, ld->cur_size - ld->cur_fill);
+			if (copy_from_user(ld->cur->subnets + ld->cur_fill,
+			    buf + done, len) != 0) {
+				ret = -EFAULT;
+				goto broken;
+			}
+			done += len;
+			ld->cur_fill += len;
+		}
 
-	for (i = 0; i < 4; ++i) {
-		if (p->s6_addr32[i] < q->s6_addr32[i])
-			return -1;
-		else if (p->s6_addr32[i] > q->s6_addr32[i])
-			return 1;
+		if (ld->cur != NULL && ld->cur_fill == ld->cur_size) {
+			geoip_node_normalize(ld->cur, ld->proto);
+			list_add_tail(&ld->cur->list, &ld->staged[ld->proto]);
+			ld->cur = NULL;
+		}
 	}
 
+	*ppos += done;
+	return done;
+
+ broken:
+	ld->broken = true;
+	return ret;
+}
+
+static int geoip_db_show(struct seq_file *m, void *data)
+{
+	const struct geoip_country_kernel *p;
+	const struct geoip_db *db;
+	unsigned int proto;
+
+	mutex_lock(&geoip_mutex);
+	db = rcu_dereference_protected(geoip_db,
+	     lockdep_is_held(&geoip_mutex));
+	seq_printf(m, "generation %lu\n", (db != NULL) ? db->generation : 0);
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		list_for_each_entry(p, &geoip_head[proto], list)
+			if (p->db)
+				seq_printf(m, "%c%c %s %u %u\n", COUNTRY(p->cc),
+				           geoproto_name[proto], p->count,
+				           p->supplied);
+	mutex_unlock(&geoip_mutex);
 	return 0;
 }
 
-static bool geoip_bsearch6(const struct geoip_subnet6 *range,
-    const struct in6_addr *addr, int lo, int hi)
+static int geoip_db_open(struct inode *inode, struct file *file)
 {
-	int mid;
+	struct geoip_loader *ld;
+	unsigned int proto;
 
-	while (true) {
-		if (hi <= lo)
-			return false;
-		mid = (lo + hi) / 2;
-		if (ipv6_cmp(&range[mid].begin, addr) <= 0 &&
-		    ipv6_cmp(addr, &range[mid].end) <= 0)
-			return true;
-		if (ipv6_cmp(&range[mid].begin, addr) > 0)
-			hi = mid;
-		else if (ipv6_cmp(&range[mid].end, addr) < 0)
-			lo = mid + 1;
-		else
-			break;
+	if (!(file->f_mode & FMODE_WRITE))
+		return single_open(file, geoip_db_show, NULL);
+	if (file->f_mode & FMODE_READ)
+		return -EINVAL;
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (ld == NULL)
+		return -ENOMEM;
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		INIT_LIST_HEAD(&ld->staged[proto]);
+	file->private_data = ld;
+	return 0;
+}
+
+/*
+ * The countries are committed on the first close() of the writer, here
+ * rather than in ->release, so that close() fails with the error when the
+ * stream was malformed or the index could not be built.
+ */
+static int geoip_db_flush(struct file *file, fl_owner_t id)
+{
+	struct geoip_loader *ld = file->private_data;
+
+	if (!(file->f_mode & FMODE_WRITE) || ld->closed)
+		return 0;
+	ld->closed = true;
+	if (ld->broken || ld->cur != NULL || ld->rec_fill != 0) {
+		printk(KERN_ERR "xt_geoip: malformed database, "
+		       "nothing loaded\n");
+		return -EINVAL;
+	}
+	return geoip_loader_commit(ld);
+}
+
+static int geoip_db_release(struct inode *inode, struct file *file)
+{
+	if (!(file->f_mode & FMODE_WRITE))
+		return single_release(inode, file);
+	geoip_loader_free(file->private_data);
+	return 0;
+}
+
+static const struct file_operations geoip_db_fops = {
+	.open    = geoip_db_open,
+	.read    = seq_read,
+	.write   = geoip_db_write,
+	.llseek  = seq_lseek,
+	.flush   = geoip_db_flush,
+	.release = geoip_db_release,
+};
+
+static int geoip_stats_show(struct seq_file *m, void *data)
+{
+	const struct geoip_country_stats *s;
+	const struct geoip_country_kernel *p;
+	unsigned int proto, b;
+	u64 lookups, hits, n;
+	int cpu;
+
+	seq_puts(m, "# country family lookups hits ranges supplied\n");
+	mutex_lock(&geoip_mutex);
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		list_for_each_entry(p, &geoip_head[proto], list) {
+			lookups = hits = 0;
+			for_each_possible_cpu(cpu) {
+				s = per_cpu_ptr(p->stats, cpu);
+				lookups += s->lookups;
+				hits    += s->hits;
+			}
+			seq_printf(m, "%c%c %s %llu %llu %u %u\n",
+			           COUNTRY(p->cc), geoproto_name[proto],
+			           (unsigned long long)lookups,
+			           (unsigned long long)hits, p->count,
+			           p->supplied);
+		}
+	mutex_unlock(&geoip_mutex);
+
+	seq_puts(m, "# latency family ns_from count\n");
+	for (proto = 0; proto < __GEOIPROTO_MAX; ++proto)
+		for (b = 0; b < GEOIP_LATENCY_BUCKETS; ++b) {
+			n = 0;
+			for_each_possible_cpu(cpu)
+				n += per_cpu_ptr(geoip_latency, cpu)->bucket[proto][b];
+			if (n != 0)
+				seq_printf(m, "latency %s %llu %llu\n",
+				           geoproto_name[proto],
+				           (b == 0) ? 0ULL : 1ULL << (b - 1),
+				           (unsigned long long)n);
+		}
+	return 0;
+}
+
+static int geoip_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, geoip_stats_show, NULL);
+}
+
+static const struct file_operations geoip_stats_fops = {
+	.open    = geoip_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Index of the first country of @cc found in @set, or -1 */
+static int geoip_set_match(const u16 *set, const u16 *cc, unsigned int count)
+{
+	unsigned int i, j;
+
+	if (set == NULL)
+		return -1;
+	for (i = 1; i <= set[0]; ++i)
+		for (j = 0; j < count; ++j)
+			if (set[i] == cc[j])
+				return j;
+	return -1;
+}
+
+/**
+ * geoip_account - update the country statistics after a lookup
+ * @mem:	countries of the rule
+ * @hit:	index of the matching country in @mem, or -1
+ */
+static void geoip_account(const union geoip_country_group *mem,
+    unsigned int count, int hit)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		this_cpu_inc(mem[i].kernel->stats->lookups);
+	if (hit >= 0)
+		this_cpu_inc(mem[hit].kernel->stats->hits);
+}
+
+/* @start:	local_clock() before the lookup, 0 when not timing */
+static void geoip_account_latency(enum geoip_proto proto, u64 start)
+{
+	if (start != 0)
+		this_cpu_inc(geoip_latency->bucket[proto][min(fls64(local_clock() -
+		             start), GEOIP_LATENCY_BUCKETS - 1)]);
+}
+
+/* Finish a lookup in the IPv6 index, given the node of the prefix search */
+static const u16 *geoip_lookup6_node(const struct geoip_index *idx,
+    const struct in6_addr *addr, unsigned int k)
+{
+	const struct geoip_index *fine = idx->fine;
+	const struct in6_addr *fend;
+	const u64 *end = idx->end;
+	unsigned int set = idx->set[k];
+
+	if (set == GEOIP_SET_NONE || geoip_ipv6_hi(addr) > end[k])
+		return NULL;
+	if (set == GEOIP_SET_FULL) {
+		k    = geoip_eytz_search6(fine->begin, fine->count, addr);
+		fend = fine->end;
+		set  = fine->set[k];
+		if (set == GEOIP_SET_NONE || geoip_ipv6_cmp(addr, &fend[k]) > 0)
+			return NULL;
 	}
+	return &idx->cc_pool[set];
+}
 
-	WARN_ON(true);
-	return false;
+static const u16 *geoip_lookup6(const struct geoip_index *idx,
+    const struct in6_addr *addr)
+{
+	if (idx == NULL)
+		return NULL;
+	return geoip_lookup6_node(idx, addr, geoip_eytz_search64(idx->begin,
+	       idx->count, geoip_ipv6_hi(addr)));
+}
+
+/* Look up both addresses, interleaving the two searches */
+static void geoip_lookup6_pair(const struct geoip_index *idx,
+    const struct in6_addr *addr, const u16 **set)
+{
+	unsigned int node[2];
+	u64 hi[2];
+
+	if (idx == NULL) {
+		set[0] = set[1] = NULL;
+		return;
+	}
+	hi[0] = geoip_ipv6_hi(&addr[0]);
+	hi[1] = geoip_ipv6_hi(&addr[1]);
+	geoip_eytz_search64_batch(idx->begin, idx->count, hi, node, 2);
+	set[0] = geoip_lookup6_node(idx, &addr[0], node[0]);
+	set[1] = geoip_lookup6_node(idx, &addr[1], node[1]);
+}
+
+static void geoip_ipv6_load(struct in6_addr *ip, const struct in6_addr *addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i)
+		ip->s6_addr32[i] = ntohl(addr->s6_addr32[i]);
 }
 
 static bool
 xt_geoip_mt6(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_geoip_match_info *info = par->matchinfo;
-	const struct geoip_country_kernel *node;
 	const struct ipv6hdr *iph = ipv6_hdr(skb);
-	unsigned int i;
+	const struct geoip_db *db;
+	const u16 *set;
 	struct in6_addr ip;
+	u64 start = geoip_latency_stats ? local_clock() : 0;
+	int hit;
 
-	memcpy(&ip, (info->flags & XT_GEOIP_SRC) ? &iph->saddr : &iph->daddr,
-	       sizeof(ip));
-	for (i = 0; i < 4; ++i)
-		ip.s6_addr32[i] = ntohl(ip.s6_addr32[i]);
-
+	geoip_ipv6_load(&ip, (info->flags & XT_GEOIP_SRC) ?
+	                &iph->saddr : &iph->daddr);
 	rcu_read_lock();
-	for (i = 0; i < info->count; i++) {
-		if ((node = info->mem[i].kernel) == NULL) {
-			printk(KERN_ERR "xt_geoip: what the hell ?? '%c%c' isn't loaded into memory... skip it!\n",
-					COUNTRY(info->cc[i]));
-			continue;
-		}
-		if (geoip_bsearch6(node->subnets, &ip, 0, node->count)) {
-			rcu_read_unlock();
-			return !(info->flags & XT_GEOIP_INV);
-		}
-	}
-
+	db  = rcu_dereference(geoip_db);
+	set = (db != NULL) ? geoip_lookup6(db->index[GEOIPROTO_IPV6], &ip) : NULL;
+	hit = geoip_set_match(set, info->cc, info->count);
 	rcu_read_unlock();
-	return info->flags & XT_GEOIP_INV;
+	geoip_account(info->mem, info->count, hit);
+	geoip_account_latency(GEOIPROTO_IPV6, start);
+	return (hit >= 0) ^ !!(info->flags & XT_GEOIP_INV);
 }
 
-static bool geoip_bsearch4(const struct geoip_subnet4 *range,
-    uint32_t addr, int lo, int hi)
+static const u16 *geoip_lookup4_node(const struct geoip_index *idx,
+    uint32_t addr, unsigned int k)
 {
-	int mid;
+	const u32 *end = idx->end;
 
-	while (true) {
-		if (hi <= lo)
-			return false;
-		mid = (lo + hi) / 2;
-		if (range[mid].begin <= addr && addr <= range[mid].end)
-			return true;
-		if (range[mid].begin > addr)
-			hi = mid;
-		else if (range[mid].end < addr)
-			lo = mid + 1;
-		else
-			break;
-	}
+	if (idx->set[k] == GEOIP_SET_NONE || addr > end[k])
+		return NULL;
+	return &idx->cc_pool[idx->set[k]];
+}
+
+static const u16 *geoip_lookup4(const struct geoip_index *idx, uint32_t addr)
+{
+	if (idx == NULL)
+		return NULL;
+	return geoip_lookup4_node(idx, addr,
+	       geoip_eytz_search4(idx->begin, idx->count, addr));
+}
+
+/* Look up both addresses, interleaving the two searches */
+static void geoip_lookup4_pair(const struct geoip_index *idx,
+    const u32 *addr, const u16 **set)
+{
+	unsigned int node[2];
 
-	WARN_ON(true);
-	return false;
+	if (idx == NULL) {
+		set[0] = set[1] = NULL;
+		return;
+	}
+	geoip_eytz_search4_batch(idx->begin, idx->count, addr, node, 2);
+	set[0] = geoip_lookup4_node(idx, addr[0], node[0]);
+	set[1] = geoip_lookup4_node(idx, addr[1], node[1]);
 }
 
 static bool
 xt_geoip_mt4(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_geoip_match_info *info = par->matchinfo;
-	const struct geoip_country_kernel *node;
 	const struct iphdr *iph = ip_hdr(skb);
-	unsigned int i;
+	const struct geoip_db *db;
+	const u16 *set;
 	uint32_t ip;
+	u64 start = geoip_latency_stats ? local_clock() : 0;
+	int hit;
 
 	ip = ntohl((info->flags & XT_GEOIP_SRC) ? iph->saddr : iph->daddr);
 	rcu_read_lock();
-	for (i = 0; i < info->count; i++) {
-		if ((node = info->mem[i].kernel) == NULL) {
-			printk(KERN_ERR "xt_geoip: what the hell ?? '%c%c' isn't loaded into memory... skip it!\n",
-					COUNTRY(info->cc[i]));
-			continue;
-		}
-		if (geoip_bsearch4(node->subnets, ip, 0, node->count)) {
-			rcu_read_unlock();
-			return !(info->flags & XT_GEOIP_INV);
-		}
+	db  = rcu_dereference(geoip_db);
+	set = (db != NULL) ? geoip_lookup4(db->index[GEOIPROTO_IPV4], ip) : NULL;
+	hit = geoip_set_match(set, info->cc, info->count);
+	rcu_read_unlock();
+	geoip_account(info->mem, info->count, hit);
+	geoip_account_latency(GEOIPROTO_IPV4, start);
+	return (hit >= 0) ^ !!(info->flags & XT_GEOIP_INV);
+}
+
+/**
+ * geoip_mt_v2 - evaluate a revision 2 rule once its sets are looked up
+ * @set:	country sets of source and destination address
+ */
+static bool geoip_mt_v2(const struct xt_geoip_mtinfo2 *info,
+    const u16 *const *set)
+{
+	bool ret = true;
+	int hit;
+
+	if (info->flags & XT_GEOIP_SRC) {
+		hit = geoip_set_match(set[0], info->src_cc, info->src_count);
+		geoip_account(info->src_mem, info->src_count, hit);
+		ret &= (hit >= 0) ^ !!(info->flags & XT_GEOIP_INV);
+	}
+	if (info->flags & XT_GEOIP_DST) {
+		hit = geoip_set_match(set[1], info->dst_cc, info->dst_count);
+		geoip_account(info->dst_mem, info->dst_count, hit);
+		ret &= (hit >= 0) ^ !!(info->flags & XT_GEOIP_DST_INV);
 	}
+	return ret;
+}
+
+static bool
+xt_geoip_mt6_v2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct xt_geoip_mtinfo2 *info = par->matchinfo;
+	const struct ipv6hdr *iph = ipv6_hdr(skb);
+	const struct geoip_index *idx;
+	const struct geoip_db *db;
+	const u16 *set[2] = {};
+	struct in6_addr ip[2];
+	u64 start = geoip_latency_stats ? local_clock() : 0;
+	bool ret;
 
+	geoip_ipv6_load(&ip[0], &iph->saddr);
+	geoip_ipv6_load(&ip[1], &iph->daddr);
+	rcu_read_lock();
+	db  = rcu_dereference(geoip_db);
+	idx = (db != NULL) ? db->index[GEOIPROTO_IPV6] : NULL;
+	if ((info->flags & (XT_GEOIP_SRC | XT_GEOIP_DST)) ==
+	    (XT_GEOIP_SRC | XT_GEOIP_DST))
+		geoip_lookup6_pair(idx, ip, set);
+	else if (info->flags & XT_GEOIP_SRC)
+		set[0] = geoip_lookup6(idx, &ip[0]);
+	else
+		set[1] = geoip_lookup6(idx, &ip[1]);
+	/* The country sets live in the index */
+	ret = geoip_mt_v2(info, set);
 	rcu_read_unlock();
-	return info->flags & XT_GEOIP_INV;
+	geoip_account_latency(GEOIPROTO_IPV6, start);
+	return ret;
 }
 
-static int xt_geoip_mt_checkentry(const struct xt_mtchk_param *par)
+static bool
+xt_geoip_mt4_v2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct xt_geoip_mtinfo2 *info = par->matchinfo;
+	const struct iphdr *iph = ip_hdr(skb);
+	const struct geoip_index *idx;
+	const struct geoip_db *db;
+	const u16 *set[2] = {};
+	u32 ip[2];
+	u64 start = geoip_latency_stats ? local_clock() : 0;
+	bool ret;
+
+	ip[0] = ntohl(iph->saddr);
+	ip[1] = ntohl(iph->daddr);
+	rcu_read_lock();
+	db  = rcu_dereference(geoip_db);
+	idx = (db != NULL) ? db->index[GEOIPROTO_IPV4] : NULL;
+	if ((info->flags & (XT_GEOIP_SRC | XT_GEOIP_DST)) ==
+	    (XT_GEOIP_SRC | XT_GEOIP_DST))
+		geoip_lookup4_pair(idx, ip, set);
+	else if (info->flags & XT_GEOIP_SRC)
+		set[0] = geoip_lookup4(idx, ip[0]);
+	else
+		set[1] = geoip_lookup4(idx, ip[1]);
+	ret = geoip_mt_v2(info, set);
+	rcu_read_unlock();
+	geoip_account_latency(GEOIPROTO_IPV4, start);
+	return ret;
+}
+
+/**
+ * geoip_put_countries - drop the references taken by geoip_get_countries()
+ * @dropped:	set if a country went away, so the index should shrink
+ *
+ * Caller holds geoip_mutex.
+ */
+static void geoip_put_countries(union geoip_country_group *mem,
+    unsigned int count, bool *dropped)
 {
-	struct xt_geoip_match_info *info = par->matchinfo;
 	struct geoip_country_kernel *node;
 	unsigned int i;
 
-	for (i = 0; i < info->count; i++) {
-		node = find_node(info->cc[i], nfp2geo[par->family]);
-		if (node == NULL) {
-			node = geoip_add_node((const void __user *)(unsigned long)info->mem[i].user,
-			       nfp2geo[par->family]);
-			if (IS_ERR(node)) {
+	for (i = 0; i < count; i++)
+		if ((node = mem[i].kernel) != NULL) {
+			/* Free up some memory if that node isn't used
+			 * anymore. */
+			if (geoip_put_node(node))
+				*dropped = true;
+		}
+		else
+			/* Something strange happened. There's no memory allocated for this
+			 * country.  Please send this bug to the mailing list. */
+			printk(KERN_ERR
+					"xt_geoip: What happened peejix ? What happened acidfu ?\n"
+					"xt_geoip: please report this bug to the maintainers\n");
+}
+
+/**
+ * geoip_get_countries - look up or load the countries of a rule
+ * @loaded:	set if a country had to be loaded, so the index needs a rebuild
+ *
+ * Takes a reference on each, replacing the userspace pointers in @mem.
+ * On error, nothing is held and countries loaded here are gone again.
+ * Caller holds geoip_mutex.
+ */
+static int geoip_get_countries(const u16 *cc, union geoip_country_group *mem,
+    unsigned int count, enum geoip_proto proto, bool *loaded)
+{
+	struct geoip_country_kernel *node;
+	unsigned int i;
+	bool dropped;
+
+	for (i = 0; i < count; i++) {
+		node = __find_node(cc[i], proto);
+		if (node != NULL) {
+			atomic_inc(&node->ref);
+		} else if (mem[i].user == 0) {
+			/* Userspace expected it to be in the database */
+			printk(KERN_ERR "xt_geoip: '%c%c' is not loaded\n",
+			       COUNTRY(cc[i]));
+			node = ERR_PTR(-ENOENT);
+		} else {
+			node = geoip_add_node((const void __user *)(unsigned long)mem[i].user,
+			       proto);
+			if (IS_ERR(node))
 				printk(KERN_ERR
 						"xt_geoip: unable to load '%c%c' into memory: %ld\n",
-						COUNTRY(info->cc[i]), PTR_ERR(node));
-				return PTR_ERR(node);
-			}
+						COUNTRY(cc[i]), PTR_ERR(node));
+			else
+				*loaded = true;
+		}
+		if (IS_ERR(node)) {
+			/* Not in the index yet, so no rebuild either */
+			geoip_put_countries(mem, i, &dropped);
+			return PTR_ERR(node);
 		}
 
-		/* Overwrite the now-useless pointer info->mem[i] with
+		/* Overwrite the now-useless pointer mem[i] with
 		 * a pointer to the node's kernelspace structure.
 		 * This avoids searching for a node in the match() and
 		 * destroy() functions.
 		 */
-		info->mem[i].kernel = node;
+		mem[i].kernel = node;
 	}
 
 	return 0;
 }
 
+/*
+ * Rules only ever add countries in checkentry, so the index is rebuilt
+ * once per rule there, not once per country.
+ */
+static int xt_geoip_mt_checkentry(const struct xt_mtchk_param *par)
+{
+	struct xt_geoip_match_info *info = par->matchinfo;
+	enum geoip_proto proto = nfp2geo[par->family];
+	bool loaded = false, dropped;
+	int ret;
+
+	mutex_lock(&geoip_mutex);
+	ret = geoip_get_countries(info->cc, info->mem, info->count, proto,
+	      &loaded);
+	if (ret == 0 && loaded) {
+		ret = geoip_db_rebuild(1 << proto);
+		if (ret < 0)
+			geoip_put_countries(info->mem, info->count, &dropped);
+	}
+	mutex_unlock(&geoip_mutex);
+	return ret;
+}
+
 static void xt_geoip_mt_destroy(const struct xt_mtdtor_param *par)
 {
 	struct xt_geoip_match_info *info = par->matchinfo;
-	struct geoip_country_kernel *node;
-	unsigned int i;
+	bool dropped = false;
 
 	/* This entry has been removed from the table so
 	 * decrease the refcount of all countries it is
 	 * using.
 	 */
+	mutex_lock(&geoip_mutex);
+	geoip_put_countries(info->mem, info->count, &dropped);
+	if (dropped)
+		geoip_db_shrink(nfp2geo[par->family]);
+	mutex_unlock(&geoip_mutex);
+}
 
-	for (i = 0; i < info->count; i++)
-		if ((node = info->mem[i].kernel) != NULL) {
-			/* Free up some memory if that node isn't used
-			 * anymore. */
-			geoip_try_remove_node(node);
-		}
-		else
-			/* Something strange happened. There's no memory allocated for this
-			 * country.  Please send this bug to the mailing list. */
-			printk(KERN_ERR
-					"xt_geoip: What happened peejix ? What happened acidfu ?\n"
-					"xt_geoip: please report this bug to the maintainers\n");
+static int xt_geoip_mt_check_v2(const struct xt_mtchk_param *par)
+{
+	struct xt_geoip_mtinfo2 *info = par->matchinfo;
+	enum geoip_proto proto = nfp2geo[par->family];
+	bool loaded = false, dropped;
+	int ret;
+
+	if (!(info->flags & (XT_GEOIP_SRC | XT_GEOIP_DST)) ||
+	    info->src_count > XT_GEOIP_MAX || info->dst_count > XT_GEOIP_MAX)
+		return -EINVAL;
+	if (!(info->flags & XT_GEOIP_SRC))
+		info->src_count = 0;
+	if (!(info->flags & XT_GEOIP_DST))
+		info->dst_count = 0;
+
+	mutex_lock(&geoip_mutex);
+	ret = geoip_get_countries(info->src_cc, info->src_mem,
+	      info->src_count, proto, &loaded);
+	if (ret < 0)
+		goto out;
+	ret = geoip_get_countries(info->dst_cc, info->dst_mem,
+	      info->dst_count, proto, &loaded);
+	if (ret == 0 && loaded) {
+		ret = geoip_db_rebuild(1 << proto);
+		if (ret < 0)
+			geoip_put_countries(info->dst_mem, info->dst_count,
+				&dropped);
+	}
+	if (ret < 0)
+		geoip_put_countries(info->src_mem, info->src_count, &dropped);
+ out:
+	mutex_unlock(&geoip_mutex);
+	return ret;
+}
+
+static void xt_geoip_mt_destroy_v2(const struct xt_mtdtor_param *par)
+{
+	struct xt_geoip_mtinfo2 *info = par->matchinfo;
+	bool dropped = false;
+
+	mutex_lock(&geoip_mutex);
+	geoip_put_countries(info->src_mem, info->src_count, &dropped);
+	geoip_put_countries(info->dst_mem, info->dst_count, &dropped);
+	if (dropped)
+		geoip_db_shrink(nfp2geo[par->family]);
+	mutex_unlock(&geoip_mutex);
 }
 
 static struct xt_match xt_geoip_match[] __read_mostly = {
@@ -351,20 +1305,88 @@ static struct xt_match xt_geoip_match[] __read_mostly = {
 		.matchsize  = sizeof(struct xt_geoip_match_info),
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "geoip",
+		.revision   = 2,
+		.family     = NFPROTO_IPV6,
+		.match      = xt_geoip_mt6_v2,
+		.checkentry = xt_geoip_mt_check_v2,
+		.destroy    = xt_geoip_mt_destroy_v2,
+		.matchsize  = sizeof(struct xt_geoip_mtinfo2),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "geoip",
+		.revision   = 2,
+		.family     = NFPROTO_IPV4,
+		.match      = xt_geoip_mt4_v2,
+		.checkentry = xt_geoip_mt_check_v2,
+		.destroy    = xt_geoip_mt_destroy_v2,
+		.matchsize  = sizeof(struct xt_geoip_mtinfo2),
+		.me         = THIS_MODULE,
+	},
 };
 
 static int __init xt_geoip_mt_init(void)
 {
 	unsigned int i;
+	int ret;
 
 	for (i = 0; i < ARRAY_SIZE(geoip_head); ++i)
 		INIT_LIST_HEAD(&geoip_head[i]);
-	return xt_register_matches(xt_geoip_match, ARRAY_SIZE(xt_geoip_match));
+	geoip_latency = alloc_percpu(struct geoip_latency);
+	if (geoip_latency == NULL)
+		return -ENOMEM;
+
+	ret = -EACCES;
+	geoip_proc_dir = proc_mkdir("xt_geoip", init_net.proc_net);
+	if (geoip_proc_dir == NULL)
+		goto out;
+	ret = -ENOMEM;
+	if (proc_create("database", S_IRUGO | S_IWUSR, geoip_proc_dir,
+	    &geoip_db_fops) == NULL)
+		goto out_dir;
+	if (proc_create("stats", S_IRUGO, geoip_proc_dir,
+	    &geoip_stats_fops) == NULL)
+		goto out_db;
+
+	ret = xt_register_matches(xt_geoip_match, ARRAY_SIZE(xt_geoip_match));
+	if (ret == 0)
+		return 0;
+	remove_proc_entry("stats", geoip_proc_dir);
+ out_db:
+	remove_proc_entry("database", geoip_proc_dir);
+ out_dir:
+	remove_proc_entry("xt_geoip", init_net.proc_net);
+ out:
+	free_percpu(geoip_latency);
+	return ret;
 }
 
 static void __exit xt_geoip_mt_fini(void)
 {
+	struct geoip_country_kernel *p, *next;
+	struct geoip_db *db;
+	unsigned int i;
+
 	xt_unregister_matches(xt_geoip_match, ARRAY_SIZE(xt_geoip_match));
+	remove_proc_entry("stats", geoip_proc_dir);
+	remove_proc_entry("database", geoip_proc_dir);
+	remove_proc_entry("xt_geoip", init_net.proc_net);
+	free_percpu(geoip_latency);
+
+	/* Without rules, only the database is left holding countries */
+	for (i = 0; i < ARRAY_SIZE(geoip_head); ++i)
+		list_for_each_entry_safe(p, next, &geoip_head[i], list) {
+			list_del(&p->list);
+			geoip_node_free(p);
+		}
+	db = rcu_dereference_protected(geoip_db, true);
+	if (db != NULL) {
+		for (i = 0; i < ARRAY_SIZE(db->index); ++i)
+			geoip_index_free(db->index[i]);
+		kfree(db);
+	}
 }
 
 module_init(xt_geoip_mt_init);
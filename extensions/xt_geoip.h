@@ -17,6 +17,7 @@ enum {
 	XT_GEOIP_SRC = 1 << 0,	/* Perform check on Source IP */
 	XT_GEOIP_DST = 1 << 1,	/* Perform check on Destination IP */
 	XT_GEOIP_INV = 1 << 2,	/* Negate the condition */
+	XT_GEOIP_DST_INV = 1 << 3, /* Revision 2: negate the destination one */
 
 	XT_GEOIP_MAX = 15,	/* Maximum of countries */
 };
@@ -37,6 +38,17 @@ struct geoip_country_user {
 	__u16 cc;
 };
 
+/*
+ * Record stream written to /proc/net/xt_geoip/database: each header is
+ * followed by @count geoip_subnet4 or geoip_subnet6 in host byte order.
+ */
+struct geoip_db_record {
+	__u16 cc;
+	__u8 nfproto;
+	__u8 pad;
+	__u32 count;
+};
+
 struct geoip_country_kernel;
 
 union geoip_country_group {
@@ -53,6 +65,23 @@ struct xt_geoip_match_info {
 	union geoip_country_group mem[XT_GEOIP_MAX];
 };
 
+/*
+ * Revision 2 checks source and destination in one match. XT_GEOIP_SRC and
+ * XT_GEOIP_DST tell which lists are in use, XT_GEOIP_INV negates the
+ * source condition and XT_GEOIP_DST_INV the destination condition; the
+ * match is true if all conditions in use hold.
+ */
+struct xt_geoip_mtinfo2 {
+	__u8 flags;
+	__u8 src_count, dst_count;
+	__u8 pad;
+	__u16 src_cc[XT_GEOIP_MAX], dst_cc[XT_GEOIP_MAX];
+
+	/* Used internally by the kernel */
+	union geoip_country_group src_mem[XT_GEOIP_MAX];
+	union geoip_country_group dst_mem[XT_GEOIP_MAX];
+};
+
 #define COUNTRY(cc) ((cc) >> 8), ((cc) & 0x00FF)
 
 #endif /* _LINUX_NETFILTER_XT_GEOIP_H */
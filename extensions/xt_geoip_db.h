@@ -0,0 +1,153 @@
+/*
+ *	On-disk container format of the xt_geoip database, shared by
+ *	xt_geoip_load and libxt_geoip. Written by xt_geoip_build.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License; either
+ *	version 2 of the License, or any later version, as published by the
+ *	Free Software Foundation.
+ */
+#ifndef _LINUX_NETFILTER_XT_GEOIP_DB_H
+#define _LINUX_NETFILTER_XT_GEOIP_DB_H 1
+
+/*
+ * LE/xt_geoip.db and BE/xt_geoip.db hold all countries in the respective
+ * byte order, so that a host can mmap the one in its own:
+ *
+ *	struct geoip_db_header
+ *	struct geoip_db_entry[count], sorted by cc, then nfproto
+ *	records
+ *
+ * The records are exactly what /proc/net/xt_geoip/database takes, each a
+ * struct geoip_db_record followed by its ranges, back to back. Loading
+ * everything thus is a single write of the record area. Every part is a
+ * multiple of 8 bytes, keeping all ranges naturally aligned.
+ */
+#define XT_GEOIP_DB_FILE    "xt_geoip.db"
+#define XT_GEOIP_DB_MAGIC   "xtgeoip"
+#define XT_GEOIP_DB_VERSION 1
+
+/**
+ * @magic:	%XT_GEOIP_DB_MAGIC, NUL-padded
+ * @version:	%XT_GEOIP_DB_VERSION
+ * @count:	number of entries
+ * @size:	size of the whole file
+ * @checksum:	sum of all 32-bit words after the header, modulo 2^32
+ */
+struct geoip_db_header {
+	char magic[8];
+	__u32 version;
+	__u32 count;
+	aligned_u64 size;
+	__u32 checksum;
+	__u32 pad;
+};
+
+/**
+ * @cc:		country code
+ * @nfproto:	%NFPROTO_IPV4 or %NFPROTO_IPV6
+ * @count:	number of ranges
+ * @offset:	file offset of the struct geoip_db_record
+ */
+struct geoip_db_entry {
+	__u16 cc;
+	__u8 nfproto;
+	__u8 pad;
+	__u32 count;
+	aligned_u64 offset;
+};
+
+static inline size_t geoip_db_range_size(__u8 nfproto)
+{
+	return (nfproto == NFPROTO_IPV6) ? sizeof(struct geoip_subnet6) :
+	       sizeof(struct geoip_subnet4);
+}
+
+/**
+ * geoip_db_check - check the header and table of contents of a container
+ *
+ * Only touches the start of the file, so it is cheap enough for every
+ * iptables run. Returns a static error description, or %NULL if all
+ * entries point to records within the file.
+ */
+static inline const char *geoip_db_check(const void *base, size_t size)
+{
+	const struct geoip_db_header *hdr = base;
+	const struct geoip_db_entry *ent = base + sizeof(*hdr);
+	unsigned int i;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, XT_GEOIP_DB_MAGIC, sizeof(hdr->magic)) != 0)
+		return "not an xt_geoip database";
+	if (hdr->version != XT_GEOIP_DB_VERSION)
+		return "unsupported database version";
+	if (hdr->size != size || size % 8 != 0 ||
+	    hdr->count > (size - sizeof(*hdr)) / sizeof(*ent))
+		return "database is truncated";
+
+	for (i = 0; i < hdr->count; ++i)
+		if (ent[i].offset < sizeof(*hdr) + hdr->count * sizeof(*ent) ||
+		    ent[i].offset % 8 != 0 ||
+		    ent[i].offset + sizeof(struct geoip_db_record) > size ||
+		    (size - ent[i].offset - sizeof(struct geoip_db_record)) /
+		    geoip_db_range_size(ent[i].nfproto) < ent[i].count)
+			return "database entry out of bounds";
+	return NULL;
+}
+
+/**
+ * geoip_db_verify - geoip_db_check(), plus the checksum over the whole
+ * file and a check that every record agrees with its entry
+ *
+ * Reads the entire file; used by xt_geoip_load before handing the records
+ * to the kernel.
+ */
+static inline const char *geoip_db_verify(const void *base, size_t size)
+{
+	const struct geoip_db_header *hdr = base;
+	const struct geoip_db_entry *ent = base + sizeof(*hdr);
+	const struct geoip_db_record *rec;
+	const char *err = geoip_db_check(base, size);
+	const __u32 *word;
+	__u32 sum = 0;
+	unsigned int i;
+
+	if (err != NULL)
+		return err;
+	for (word = base + sizeof(*hdr); (const void *)word < base + size; ++word)
+		sum += *word;
+	if (sum != hdr->checksum)
+		return "database checksum mismatch";
+
+	for (i = 0; i < hdr->count; ++i) {
+		rec = base + ent[i].offset;
+		if (rec->cc != ent[i].cc || rec->nfproto != ent[i].nfproto ||
+		    rec->count != ent[i].count)
+			return "database entry does not match its record";
+	}
+	return NULL;
+}
+
+/* Look up a country in a checked container; %NULL if it is not there */
+static inline const struct geoip_db_entry *
+geoip_db_find(const void *base, __u16 cc, __u8 nfproto)
+{
+	const struct geoip_db_header *hdr = base;
+	const struct geoip_db_entry *ent = base + sizeof(*hdr);
+	unsigned int lo = 0, hi = hdr->count, mid;
+	__u32 key = (__u32)cc << 8 | nfproto, k;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k   = (__u32)ent[mid].cc << 8 | ent[mid].nfproto;
+		if (k == key)
+			return &ent[mid];
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+#endif /* _LINUX_NETFILTER_XT_GEOIP_DB_H */
@@ -0,0 +1,559 @@
+/*
+ *	Build and search helpers for the xt_geoip lookup index, shared by the
+ *	kernel module and the userspace benchmark (geoip/xt_geoip_bench).
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License; either
+ *	version 2 of the License, or any later version, as published by the
+ *	Free Software Foundation.
+ */
+#ifndef _LINUX_NETFILTER_XT_GEOIP_INDEX_H
+#define _LINUX_NETFILTER_XT_GEOIP_INDEX_H 1
+
+/*
+ * Only the search helpers are inline. The build helpers are too big or
+ * recursive for that, and each user of this header takes only some.
+ */
+#ifndef __maybe_unused
+#	define __maybe_unused __attribute__((unused))
+#endif
+
+/*
+ * Keys are kept in Eytzinger (BFS) order: node k has children 2k and 2k+1,
+ * slot 0 is unused. The first levels of the tree share a few cache lines,
+ * and since the nodes of the next levels are contiguous they can be
+ * prefetched before they are needed, unlike with a sorted array where
+ * every probe of a big country lands on a fresh cache line (or page).
+ *
+ * A search yields the node of the first key above the address. The payload
+ * arrays (end address, country set) at that node hold the data of the
+ * range *preceding* it in sorted order, and slot 0 the data of the very
+ * last range, so the candidate range is found without mapping back.
+ */
+#define GEOIP_SET_NONE (~0U)
+/* IPv6 prefix index only: the /64 is not uniform, ask the full-width one */
+#define GEOIP_SET_FULL (~1U)
+
+/**
+ * geoip_eytz_perm - compute the sorted index stored at each node
+ * @perm:	array of @n + 1 entries, filled from index 1
+ * @n:		number of keys
+ * @i:		next sorted index to hand out (0 on the initial call)
+ * @k:		current node (1 on the initial call)
+ */
+static __maybe_unused unsigned int
+geoip_eytz_perm(unsigned int *perm, unsigned int n, unsigned int i,
+    unsigned int k)
+{
+	if (k <= n) {
+		i = geoip_eytz_perm(perm, n, i, 2 * k);
+		perm[k] = i++;
+		i = geoip_eytz_perm(perm, n, i, 2 * k + 1);
+	}
+	return i;
+}
+
+/**
+ * geoip_eytz_layout - lay out sorted ranges in Eytzinger order
+ * @perm:	scratch array of @n + 1 entries
+ * @begin, @end, @set:	@n > 0 ranges in sorted order
+ * @asize:	size of one address
+ * @ebegin, @eend, @eset: output arrays of @n + 1 entries
+ *
+ * Slot 0 means "no key above the address", i.e. the candidate is the last
+ * range. Nodes whose key is the first begin hold %GEOIP_SET_NONE.
+ */
+static __maybe_unused void
+geoip_eytz_layout(unsigned int *perm, const void *begin, const void *end,
+    const unsigned int *set, unsigned int n, size_t asize, void *ebegin,
+    void *eend, unsigned int *eset)
+{
+	const char *b = begin, *e = end;
+	char *eb = ebegin, *ee = eend;
+	unsigned int i, k;
+
+	geoip_eytz_perm(perm, n, 0, 1);
+	memset(eb, 0, asize);
+	memcpy(ee, e + (n - 1) * asize, asize);
+	eset[0] = set[n-1];
+	for (k = 1; k <= n; ++k) {
+		i = perm[k];
+		memcpy(eb + k * asize, b + i * asize, asize);
+		if (i == 0) {
+			memset(ee + k * asize, 0, asize);
+			eset[k] = GEOIP_SET_NONE;
+			continue;
+		}
+		memcpy(ee + k * asize, e + (i - 1) * asize, asize);
+		eset[k] = set[i-1];
+	}
+}
+
+/* Node of the first key greater than @addr, 0 if there is none */
+static inline unsigned int
+geoip_eytz_search4(const __u32 *key, unsigned int n, __u32 addr)
+{
+	unsigned int k = 1;
+
+	while (k <= n) {
+		/* 16 keys per cache line: fetch the line four levels down */
+		__builtin_prefetch(key + 16 * k);
+		k = 2 * k + (key[k] <= addr);
+	}
+	return k >> __builtin_ffs(~k);
+}
+
+/**
+ * geoip_eytz_search4_batch - geoip_eytz_search4() for several addresses
+ * @node:	output, one node per address
+ * @nb:		number of addresses
+ *
+ * The searches advance one level at a time in lockstep, so the memory
+ * accesses of the independent addresses overlap instead of each search
+ * waiting for its own cache misses in turn.
+ */
+static inline void
+geoip_eytz_search4_batch(const __u32 *key, unsigned int n,
+    const __u32 *addr, unsigned int *node, unsigned int nb)
+{
+	unsigned int i, k, pending = nb;
+
+	for (i = 0; i < nb; ++i)
+		node[i] = 1;
+	while (pending > 0) {
+		pending = 0;
+		for (i = 0; i < nb; ++i) {
+			k = node[i];
+			if (k > n)
+				continue;
+			__builtin_prefetch(key + 16 * k);
+			node[i] = 2 * k + (key[k] <= addr[i]);
+			++pending;
+		}
+	}
+	for (i = 0; i < nb; ++i)
+		node[i] >>= __builtin_ffs(~node[i]);
+}
+
+/* Node of the first key greater than @addr, 0 if there is none */
+static inline unsigned int
+geoip_eytz_search64(const __u64 *key, unsigned int n, __u64 addr)
+{
+	unsigned int k = 1;
+
+	while (k <= n) {
+		/* 8 keys per cache line: fetch the line three levels down */
+		__builtin_prefetch(key + 8 * k);
+		k = 2 * k + (key[k] <= addr);
+	}
+	return k >> __builtin_ffs(~k);
+}
+
+/* Same as geoip_eytz_search4_batch(), on the IPv6 prefix keys */
+static inline void
+geoip_eytz_search64_batch(const __u64 *key, unsigned int n,
+    const __u64 *addr, unsigned int *node, unsigned int nb)
+{
+	unsigned int i, k, pending = nb;
+
+	for (i = 0; i < nb; ++i)
+		node[i] = 1;
+	while (pending > 0) {
+		pending = 0;
+		for (i = 0; i < nb; ++i) {
+			k = node[i];
+			if (k > n)
+				continue;
+			__builtin_prefetch(key + 8 * k);
+			node[i] = 2 * k + (key[k] <= addr[i]);
+			++pending;
+		}
+	}
+	for (i = 0; i < nb; ++i)
+		node[i] >>= __builtin_ffs(~node[i]);
+}
+
+static inline int
+geoip_ipv6_cmp(const struct in6_addr *p, const struct in6_addr *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i) {
+		if (p->s6_addr32[i] < q->s6_addr32[i])
+			return -1;
+		else if (p->s6_addr32[i] > q->s6_addr32[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+static inline unsigned int
+geoip_eytz_search6(const struct in6_addr *key, unsigned int n,
+    const struct in6_addr *addr)
+{
+	unsigned int k = 1;
+
+	while (k <= n) {
+		__builtin_prefetch(key + 4 * k);
+		k = 2 * k + (geoip_ipv6_cmp(&key[k], addr) <= 0);
+	}
+	return k >> __builtin_ffs(~k);
+}
+
+static inline __u64 geoip_ipv6_hi(const struct in6_addr *a)
+{
+	return (__u64)a->s6_addr32[0] << 32 | a->s6_addr32[1];
+}
+
+static inline __u64 geoip_ipv6_lo(const struct in6_addr *a)
+{
+	return (__u64)a->s6_addr32[2] << 32 | a->s6_addr32[3];
+}
+
+/**
+ * geoip_split6 - derive the /64 prefix index from sorted IPv6 ranges
+ * @begin, @end, @set:	@n disjoint ranges in sorted order
+ * @cbegin, @cend, @cset: output prefix ranges, room for 3 * @n
+ * @fine:	output sorted indexes of the ranges needing full width,
+ * 		room for @n
+ * @nfine:	output number of entries in @fine
+ *
+ * Allocations live at /64 granularity or coarser, so nearly every range
+ * is fully described by its upper 64 bits, halving key size and compare
+ * cost. A /64 that holds a boundary elsewhere is emitted as a single
+ * prefix range with set %GEOIP_SET_FULL; the ranges touching it are
+ * listed in @fine, to be searched at full width.
+ *
+ * Returns the number of prefix ranges.
+ */
+static __maybe_unused unsigned int
+geoip_split6(const struct in6_addr *begin, const struct in6_addr *end,
+    const unsigned int *set, unsigned int n, __u64 *cbegin, __u64 *cend,
+    unsigned int *cset, unsigned int *fine, unsigned int *nfine)
+{
+	__u64 bh, bl, eh, el, lo, hi, mixed = 0;
+	bool have_mixed = false;
+	unsigned int i, c = 0;
+
+	*nfine = 0;
+	for (i = 0; i < n; ++i) {
+		bh = geoip_ipv6_hi(&begin[i]);
+		bl = geoip_ipv6_lo(&begin[i]);
+		eh = geoip_ipv6_hi(&end[i]);
+		el = geoip_ipv6_lo(&end[i]);
+
+		if (bl != 0 || el != ~0ULL)
+			fine[(*nfine)++] = i;
+		if (bl != 0 && !(have_mixed && mixed == bh)) {
+			cbegin[c] = cend[c] = mixed = bh;
+			cset[c++] = GEOIP_SET_FULL;
+			have_mixed = true;
+		}
+
+		/* The /64s covered completely */
+		lo = bh + (bl != 0);
+		hi = eh - (el != ~0ULL);
+		if ((bl == 0 || bh != ~0ULL) && (el == ~0ULL || eh != 0) &&
+		    lo <= hi) {
+			cbegin[c] = lo;
+			cend[c]   = hi;
+			cset[c++] = set[i];
+		}
+
+		if (el != ~0ULL && !(have_mixed && mixed == eh)) {
+			cbegin[c] = cend[c] = mixed = eh;
+			cset[c++] = GEOIP_SET_FULL;
+			have_mixed = true;
+		}
+	}
+	return c;
+}
+
+/* Range boundary used while building the index; @inf is "one past the end" */
+struct geoip_pos {
+	__u64 hi, lo;
+	bool inf;
+};
+
+struct geoip_event {
+	struct geoip_pos pos;
+	unsigned int slot;
+	int delta;
+};
+
+/**
+ * State for geoip_index_sweep()
+ * @cc:		country code of each slot
+ * @active:	number of currently open ranges per slot
+ * @nactive:	number of slots with open ranges
+ * @hint:	slot most recently opened
+ * @pool:	country sets, the single-country set of slot k preset at
+ * 		offset 2k; becomes geoip_index->cc_pool
+ * @scratch:	temporary country set, room for @nslots + 1
+ */
+struct geoip_builder {
+	const __u16 *cc;
+	unsigned int *active;
+	unsigned int nslots, nactive, hint;
+	__u16 *pool, *scratch;
+	unsigned int pool_len, pool_size;
+};
+
+#ifdef __KERNEL__
+#	define geoip_index_realloc(p, size) krealloc((p), (size), GFP_KERNEL)
+#else
+#	define geoip_index_realloc(p, size) realloc((p), (size))
+#endif
+
+static inline void geoip_pos_inc(struct geoip_pos *p)
+{
+	if (++p->lo == 0 && ++p->hi == 0)
+		p->inf = true;
+}
+
+static inline void geoip_pos_dec(struct geoip_pos *p)
+{
+	if (p->inf) {
+		p->inf = false;
+		p->hi = p->lo = ~0ULL;
+		return;
+	}
+	if (p->lo-- == 0)
+		--p->hi;
+}
+
+static inline int
+geoip_pos_cmp(const struct geoip_pos *a, const struct geoip_pos *b)
+{
+	if (a->inf != b->inf)
+		return a->inf ? 1 : -1;
+	if (a->hi != b->hi)
+		return a->hi < b->hi ? -1 : 1;
+	if (a->lo != b->lo)
+		return a->lo < b->lo ? -1 : 1;
+	return 0;
+}
+
+static inline int geoip_event_cmp(const void *a, const void *b)
+{
+	return geoip_pos_cmp(&((const struct geoip_event *)a)->pos,
+	       &((const struct geoip_event *)b)->pos);
+}
+
+static inline void geoip_pos_load(struct geoip_pos *pos, bool v6,
+    const void *subnets, unsigned int i, bool end)
+{
+	pos->inf = false;
+	if (!v6) {
+		const struct geoip_subnet4 *s = subnets;
+
+		pos->hi = 0;
+		pos->lo = end ? s[i].end : s[i].begin;
+	} else {
+		const struct geoip_subnet6 *s = subnets;
+		const struct in6_addr *a = end ? &s[i].end : &s[i].begin;
+
+		pos->hi = geoip_ipv6_hi(a);
+		pos->lo = geoip_ipv6_lo(a);
+	}
+}
+
+static inline void geoip_pos_store(const struct geoip_pos *pos, bool v6,
+    void *array, unsigned int i)
+{
+	if (!v6) {
+		((__u32 *)array)[i] = pos->lo;
+	} else {
+		struct in6_addr *a = &((struct in6_addr *)array)[i];
+
+		a->s6_addr32[0] = pos->hi >> 32;
+		a->s6_addr32[1] = pos->hi;
+		a->s6_addr32[2] = pos->lo >> 32;
+		a->s6_addr32[3] = pos->lo;
+	}
+}
+
+static inline int geoip_subnet4_cmp(const void *a, const void *b)
+{
+	const struct geoip_subnet4 *x = a, *y = b;
+
+	return (x->begin > y->begin) - (x->begin < y->begin);
+}
+
+static inline int geoip_subnet6_cmp(const void *a, const void *b)
+{
+	const struct geoip_subnet6 *x = a, *y = b;
+
+	return geoip_ipv6_cmp(&x->begin, &y->begin);
+}
+
+/**
+ * geoip_coalesce - merge the ranges of one country, sorted by begin
+ *
+ * Overlapping, adjacent and contained ranges are merged and inverted ones
+ * dropped, in place. Returns the new number of ranges.
+ */
+static __maybe_unused unsigned int
+geoip_coalesce(void *subnets, unsigned int count, bool v6)
+{
+	size_t esize = v6 ? sizeof(struct geoip_subnet6) :
+	               sizeof(struct geoip_subnet4);
+	struct geoip_pos begin, end, next, last = {};
+	unsigned int i, n = 0;
+
+	for (i = 0; i < count; ++i) {
+		geoip_pos_load(&begin, v6, subnets, i, false);
+		geoip_pos_load(&end, v6, subnets, i, true);
+		if (geoip_pos_cmp(&begin, &end) > 0)
+			continue;
+		next = last;
+		geoip_pos_inc(&next);
+		if (n > 0 && (next.inf || geoip_pos_cmp(&begin, &next) <= 0)) {
+			if (geoip_pos_cmp(&end, &last) > 0) {
+				last = end;
+				/* Viewed as an address array, range k ends at 2k+1 */
+				geoip_pos_store(&end, v6, subnets, 2 * n - 1);
+			}
+			continue;
+		}
+		if (n != i)
+			memcpy((char *)subnets + n * esize,
+			       (char *)subnets + i * esize, esize);
+		last = end;
+		++n;
+	}
+	return n;
+}
+
+/**
+ * geoip_events_add - emit the sweep events of one country
+ * @ev:		output, room for 2 * @count
+ *
+ * Every range contributes an opening event at its start and a closing
+ * event one past its end. Returns the number of events written.
+ */
+static __maybe_unused unsigned int
+geoip_events_add(struct geoip_event *ev, bool v6, const void *subnets,
+    unsigned int count, unsigned int slot)
+{
+	unsigned int i, nev = 0;
+
+	for (i = 0; i < count; ++i) {
+		struct geoip_event *e = &ev[nev];
+
+		geoip_pos_load(&e[0].pos, v6, subnets, i, false);
+		geoip_pos_load(&e[1].pos, v6, subnets, i, true);
+		if (geoip_pos_cmp(&e[0].pos, &e[1].pos) > 0)
+			continue;
+		geoip_pos_inc(&e[1].pos);
+		e[0].slot  = e[1].slot = slot;
+		e[0].delta = 1;
+		e[1].delta = -1;
+		nev += 2;
+	}
+	return nev;
+}
+
+/**
+ * geoip_set_get - return cc_pool offset for the currently open countries
+ *
+ * Sets of a single country are preallocated at offset 2*slot; sets of
+ * several countries only arise from overlapping input and are deduplicated
+ * with a linear scan.
+ */
+static __maybe_unused int geoip_set_get(struct geoip_builder *b)
+{
+	unsigned int i, n = 0, off;
+	__u16 *pool;
+
+	if (b->nactive == 1) {
+		if (b->active[b->hint] == 0)
+			for (b->hint = 0; b->active[b->hint] == 0; ++b->hint)
+				;
+		return 2 * b->hint;
+	}
+
+	for (i = 0; i < b->nslots; ++i)
+		if (b->active[i] != 0)
+			b->scratch[++n] = b->cc[i];
+	b->scratch[0] = n;
+
+	for (off = 2 * b->nslots; off < b->pool_len; off += b->pool[off] + 1)
+		if (b->pool[off] == n && memcmp(&b->pool[off+1],
+		    &b->scratch[1], n * sizeof(*b->scratch)) == 0)
+			return off;
+
+	if (b->pool_len + n + 1 > b->pool_size) {
+		pool = geoip_index_realloc(b->pool, 2 * (b->pool_size + n + 1) *
+		       sizeof(*pool));
+		if (pool == NULL)
+			return -ENOMEM;
+		b->pool = pool;
+		b->pool_size = 2 * (b->pool_size + n + 1);
+	}
+	off = b->pool_len;
+	memcpy(&b->pool[off], b->scratch, (n + 1) * sizeof(*b->scratch));
+	b->pool_len += n + 1;
+	return off;
+}
+
+/**
+ * geoip_index_sweep - merge the ranges of all slots of @b
+ * @ev:		events of geoip_events_add(), sorted by geoip_event_cmp()
+ * @begin, @end, @set:	output sorted ranges, room for @nev
+ *
+ * Walking the sorted events yields elementary ranges, each covered by
+ * a fixed set of countries; neighbours with the same set are coalesced.
+ * Returns the number of ranges, or a negative errno.
+ */
+static __maybe_unused int
+geoip_index_sweep(struct geoip_builder *b, bool v6,
+    const struct geoip_event *ev, unsigned int nev, void *begin, void *end,
+    unsigned int *set)
+{
+	struct geoip_pos pos, last, last_end = {};
+	unsigned int i = 0, k, count = 0;
+	int s;
+
+	while (i < nev) {
+		pos = ev[i].pos;
+		for (; i < nev && geoip_pos_cmp(&ev[i].pos, &pos) == 0; ++i) {
+			k = ev[i].slot;
+			if (ev[i].delta > 0) {
+				if (b->active[k]++ == 0) {
+					++b->nactive;
+					b->hint = k;
+				}
+			} else if (--b->active[k] == 0) {
+				--b->nactive;
+			}
+		}
+		if (b->nactive == 0 || i == nev)
+			continue;
+
+		s = geoip_set_get(b);
+		if (s < 0)
+			return s;
+		last = ev[i].pos;
+		geoip_pos_dec(&last);
+
+		if (count > 0 && set[count-1] == s) {
+			struct geoip_pos next = last_end;
+
+			geoip_pos_inc(&next);
+			if (geoip_pos_cmp(&next, &pos) == 0) {
+				geoip_pos_store(&last, v6, end, count - 1);
+				last_end = last;
+				continue;
+			}
+		}
+		geoip_pos_store(&pos, v6, begin, count);
+		geoip_pos_store(&last, v6, end, count);
+		set[count++] = s;
+		last_end = last;
+	}
+	return count;
+}
+
+#endif /* _LINUX_NETFILTER_XT_GEOIP_INDEX_H */
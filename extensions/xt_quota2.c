@@ -11,12 +11,19 @@
  *	it under the terms of the GNU General Public License
  *	version 2, as published by the Free Software Foundation.
  */
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/nsproxy.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/uidgid.h>
 #include <linux/version.h>
@@ -24,35 +31,97 @@
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <net/dst.h>
+#include <net/genetlink.h>
 
 #include <linux/netfilter/x_tables.h>
 #include "xt_quota2.h"
 #include "compat_xtables.h"
 
+/**
+ * Share of a counter that one CPU works on without taking the lock.
+ * @seen:	value of the counter at the last synchronization
+ * @used:	amount counted down since then
+ * @added:	amount counted up since then
+ * @peeked:	amount --no-change rules let through since then
+ * @due:	jiffies of the next refill as of the last synchronization
+ * @gen:	generation of the counter at the last synchronization
+ */
+struct quota2_cpu {
+	u_int64_t seen, used, added, peeked, due;
+	unsigned int gen;
+};
+
 /**
  * @lock:	lock to protect quota writers from each other
+ * @gen:	bumped when the quota grows while a CPU has run out of it,
+ * 		so that it does not go on refusing packets on a stale value
+ * @reset:	generation of the last time the quota was set from procfs;
+ * 		what CPUs counted before it no longer applies
+ * @starved:	some CPU has run out of quota
+ * @refill:	amount added every @interval, up to @burst
+ * @interval:	refill interval in 1/1000 jiffies, a whole number for any
+ * 		interval in milliseconds
+ * @next:	time of the next refill in 1/1000 jiffies
+ * @due:	jiffies of the next refill, rounded up from @next; all ones if
+ * 		there is none
+ * @notify:	send events; only named counters do
+ * @event_due:	jiffies from which an event of each kind may be sent again
  */
 struct xt_quota_counter {
 	u_int64_t quota;
 	spinlock_t lock;
+	unsigned int gen, reset;
+	bool starved, notify;
+	struct quota2_cpu __percpu *cpu;
+	u_int64_t refill, burst, interval, next, due;
 	struct list_head list;
+	struct hlist_node node;
 	atomic_t ref;
 	char name[sizeof(((struct xt_quota_mtinfo2 *)NULL)->name)];
 	struct proc_dir_entry *procfs_entry;
+	struct net *net;
+	u_int64_t watermark;
+	unsigned long event_due[__XT_QUOTA2_EVENT_MAX];
 };
 
+/*
+ * Named counters are looked up in a hash that starts out with this many
+ * bits and doubles whenever there are more counters than buckets.
+ */
+#define QUOTA2_HASH_MIN_BITS 6
+
+/**
+ * @counter_list:	named counters in order of creation
+ * @counter_hash:	named counters by name
+ */
 struct quota2_net {
 	struct list_head counter_list;
+	struct hlist_head *counter_hash;
+	unsigned int hash_bits, counter_count;
 	struct proc_dir_entry *proc_xt_quota;
 };
 
+/**
+ * Write state of an open /proc/net/xt_quota/.all
+ * @line:	line being received
+ * @fill:	bytes of @line received so far
+ * @broken:	a line was malformed or named an unknown counter
+ */
+struct quota2_batch {
+	struct quota2_net *net;
+	char line[64];
+	unsigned int fill;
+	bool broken;
+};
+
 static int quota2_net_id;
 static inline struct quota2_net *quota2_pernet(struct net *net)
 {
 	return net_generic(net, quota2_net_id);
 }
 
-static DEFINE_SPINLOCK(counter_list_lock);
+/* Protects the counter lists and hashes; proc files are created under it */
+static DEFINE_MUTEX(counter_list_mutex);
 
 static unsigned int quota_list_perms = S_IRUGO | S_IWUSR;
 static unsigned int quota_list_uid   = 0;
@@ -61,13 +130,205 @@ module_param_named(perms, quota_list_perms, uint, S_IRUGO | S_IWUSR);
 module_param_named(uid, quota_list_uid, uint, S_IRUGO | S_IWUSR);
 module_param_named(gid, quota_list_gid, uint, S_IRUGO | S_IWUSR);
 
+/*
+ * How much each CPU may count before it has to synchronize with the shared
+ * counter. A countdown quota can thus be exceeded by this much per CPU, and
+ * what another CPU counted up may become usable only that much later.
+ */
+static unsigned int quota_reserve_bytes   = 65536;
+static unsigned int quota_reserve_packets = 16;
+module_param_named(reserve_bytes, quota_reserve_bytes, uint, S_IRUGO | S_IWUSR);
+module_param_named(reserve_packets, quota_reserve_packets, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reserve_bytes,
+	"bytes a CPU counts on its own (0 = always lock)");
+MODULE_PARM_DESC(reserve_packets,
+	"packets a CPU counts on its own (0 = always lock)");
+
+static unsigned int quota_event_interval = 1000;
+module_param_named(event_interval, quota_event_interval, uint,
+	S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(event_interval,
+	"milliseconds between events of a kind for one counter");
+
+static struct genl_family quota2_genl_family = {
+	.id      = GENL_ID_GENERATE,
+	.name    = XT_QUOTA2_GENL_NAME,
+	.version = XT_QUOTA2_GENL_VERSION,
+	.maxattr = XT_QUOTA2_ATTR_MAX,
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+static struct genl_multicast_group quota2_genl_group = {
+	.name = XT_QUOTA2_GENL_GROUP,
+};
+#else
+static const struct genl_multicast_group quota2_genl_groups[] = {
+	{.name = XT_QUOTA2_GENL_GROUP},
+};
+#endif
+
+/**
+ * quota2_crossed - see which events a change of the quota makes
+ * @old:	quota before the change
+ *
+ * Must be called with @e->lock held. Returns a bitmask of
+ * enum xt_quota2_event, without those of which one went out recently.
+ */
+static unsigned int
+quota2_crossed(struct xt_quota_counter *e, u_int64_t old)
+{
+	unsigned int events = 0, i;
+
+	if (!e->notify || e->quota == old)
+		return 0;
+	if (e->quota == 0)
+		events |= 1 << XT_QUOTA2_EVENT_EMPTY;
+	if (e->watermark != 0) {
+		if (old > e->watermark && e->quota <= e->watermark)
+			events |= 1 << XT_QUOTA2_EVENT_LOW;
+		else if (old < e->watermark && e->quota >= e->watermark)
+			events |= 1 << XT_QUOTA2_EVENT_HIGH;
+	}
+
+	for (i = 0; i < __XT_QUOTA2_EVENT_MAX; ++i) {
+		if (!(events & (1 << i)))
+			continue;
+		if (time_before(jiffies, e->event_due[i]))
+			events &= ~(1 << i);
+		else
+			e->event_due[i] = jiffies +
+				msecs_to_jiffies(quota_event_interval);
+	}
+	return events;
+}
+
+/* Send the @events found by quota2_crossed(), after dropping the lock */
+static void quota2_notify(const struct xt_quota_counter *e,
+                          unsigned int events, u_int64_t quota)
+{
+	struct sk_buff *skb;
+	unsigned int i;
+	void *hdr;
+
+	for (i = 0; i < __XT_QUOTA2_EVENT_MAX; ++i) {
+		if (!(events & (1 << i)))
+			continue;
+		skb = genlmsg_new(nla_total_size(sizeof(e->name)) +
+		      nla_total_size(sizeof(u_int8_t)) +
+		      2 * nla_total_size(sizeof(u_int64_t)), GFP_ATOMIC);
+		if (skb == NULL)
+			return;
+		hdr = genlmsg_put(skb, 0, 0, &quota2_genl_family, 0,
+		      XT_QUOTA2_CMD_EVENT);
+		if (hdr == NULL ||
+		    nla_put_string(skb, XT_QUOTA2_ATTR_NAME, e->name) < 0 ||
+		    nla_put_u8(skb, XT_QUOTA2_ATTR_EVENT, i) < 0 ||
+		    nla_put_u64(skb, XT_QUOTA2_ATTR_QUOTA, quota) < 0 ||
+		    nla_put_u64(skb, XT_QUOTA2_ATTR_WATERMARK,
+		    e->watermark) < 0) {
+			kfree_skb(skb);
+			return;
+		}
+		genlmsg_end(skb, hdr);
+		/* Fails with -ESRCH if nobody listens, which is fine */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+		genlmsg_multicast_netns(e->net, skb, 0, quota2_genl_group.id,
+		                        GFP_ATOMIC);
+#else
+		genlmsg_multicast_netns(&quota2_genl_family, e->net, skb, 0, 0,
+		                        GFP_ATOMIC);
+#endif
+	}
+}
+
+/* Must be called with @e->lock held after the quota grew */
+static void quota2_grown(struct xt_quota_counter *e)
+{
+	if (e->starved) {
+		e->starved = false;
+		++e->gen;
+	}
+}
+
+/**
+ * quota2_refill - add what has accrued since the last refill
+ *
+ * Must be called with @e->lock held. Counters are only refilled when they
+ * are looked at, so this works out how many intervals have passed. That is
+ * done in 1/1000 jiffies, so that intervals which are not a whole number of
+ * jiffies still refill at the given rate on average.
+ */
+static void quota2_refill(struct xt_quota_counter *e, u_int64_t now)
+{
+	u_int64_t ticks, add;
+
+	if (now < e->due)
+		return;
+	ticks    = div64_u64(now * 1000 - e->next, e->interval) + 1;
+	e->next += ticks * e->interval;
+	e->due   = div64_u64(e->next + 999, 1000);
+	if (e->quota >= e->burst)
+		return;
+	add = (ticks > div64_u64(e->burst, e->refill)) ?
+	      e->burst : ticks * e->refill;
+	e->quota = min(e->quota + add, e->burst);
+	quota2_grown(e);
+}
+
+/**
+ * quota2_sync - fold the share of a CPU into the counter
+ *
+ * Must be called with @e->lock held.
+ */
+static void quota2_sync(struct xt_quota_counter *e, struct quota2_cpu *c)
+{
+	if ((int)(c->gen - e->reset) < 0) {
+		c->used = c->added = 0;
+		return;
+	}
+	if (c->added != 0) {
+		e->quota += c->added;
+		quota2_grown(e);
+	}
+	if (c->used < e->quota)
+		e->quota -= c->used;
+	else
+		e->quota = 0;
+	c->used  = c->added = 0;
+}
+
+/* Counter value including what the CPUs have not synchronized yet */
+static u_int64_t quota2_value(const struct xt_quota_counter *e)
+{
+	u_int64_t added = 0, used = 0;
+	const struct quota2_cpu *c;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(e->cpu, cpu);
+		if ((int)(ACCESS_ONCE(c->gen) - e->reset) < 0)
+			continue;
+		added += ACCESS_ONCE(c->added);
+		used  += ACCESS_ONCE(c->used);
+	}
+	added += e->quota;
+	return (used < added) ? added - used : 0;
+}
+
 static int quota_proc_show(struct seq_file *m, void *data)
 {
 	struct xt_quota_counter *e = m->private;
+	unsigned int events;
+	u_int64_t old;
 
 	spin_lock_bh(&e->lock);
-	seq_printf(m, "%llu\n", e->quota);
+	old = e->quota;
+	quota2_refill(e, get_jiffies_64());
+	events = quota2_crossed(e, old);
+	old = e->quota;
+	seq_printf(m, "%llu\n", quota2_value(e));
 	spin_unlock_bh(&e->lock);
+	quota2_notify(e, events, old);
 	return 0;
 }
 
@@ -76,44 +337,59 @@ static int quota_proc_open(struct inode *inode, struct file *file)
 	return single_open(file, quota_proc_show, PDE_DATA(inode));
 }
 
-static ssize_t
-quota_proc_write(struct file *file, const char __user *input,
-                 size_t size, loff_t *loff)
+/**
+ * quota2_set - change a counter as written to its proc file
+ * @buf:	"+N" or "-N" to adjust the quota by N, or "N" to set it
+ */
+static void quota2_set(struct xt_quota_counter *e, const char *buf)
 {
-	struct xt_quota_counter *e = PDE_DATA(file_inode(file));
-	char buf[sizeof("+-18446744073709551616")];
-
-	if (size > sizeof(buf))
-		size = sizeof(buf);
-	if (copy_from_user(buf, input, size) != 0)
-		return -EFAULT;
-	buf[sizeof(buf)-1] = '\0';
-	if (size < sizeof(buf))
-		buf[size] = '\0';
+	unsigned int events;
+	u_int64_t old;
 
+	spin_lock_bh(&e->lock);
+	old = e->quota;
 	if (*buf == '+') {
 		int64_t temp = simple_strtoll(buf + 1, NULL, 0);
-		spin_lock_bh(&e->lock);
 		/* Do not let quota become negative if @tmp is very negative */
 		if (temp > 0 || -temp < e->quota)
 			e->quota += temp;
 		else
 			e->quota = 0;
-		spin_unlock_bh(&e->lock);
+		++e->gen;
 	} else if (*buf == '-') {
 		int64_t temp = simple_strtoll(buf + 1, NULL, 0);
-		spin_lock_bh(&e->lock);
 		/* Do not let quota become negative if @tmp is very big */
 		if (temp < 0 || temp < e->quota)
 			e->quota -= temp;
 		else
 			e->quota = 0;
-		spin_unlock_bh(&e->lock);
+		++e->gen;
 	} else {
-		spin_lock_bh(&e->lock);
 		e->quota = simple_strtoull(buf, NULL, 0);
-		spin_unlock_bh(&e->lock);
+		e->reset = ++e->gen;
 	}
+	events = quota2_crossed(e, old);
+	old = e->quota;
+	spin_unlock_bh(&e->lock);
+	quota2_notify(e, events, old);
+}
+
+static ssize_t
+quota_proc_write(struct file *file, const char __user *input,
+                 size_t size, loff_t *loff)
+{
+	struct xt_quota_counter *e = PDE_DATA(file_inode(file));
+	char buf[sizeof("+-18446744073709551616")];
+
+	if (size > sizeof(buf))
+		size = sizeof(buf);
+	if (copy_from_user(buf, input, size) != 0)
+		return -EFAULT;
+	buf[sizeof(buf)-1] = '\0';
+	if (size < sizeof(buf))
+		buf[size] = '\0';
+
+	quota2_set(e, buf);
 	return size;
 }
 
@@ -125,87 +401,339 @@ static const struct file_operations quota_proc_fops = {
 	.release = single_release,
 };
 
+static inline struct hlist_head *
+q2_bucket(const struct quota2_net *quota2_net, const char *name)
+{
+	u_int32_t hash = jhash(name, strlen(name), 0);
+
+	return &quota2_net->counter_hash[hash_32(hash, quota2_net->hash_bits)];
+}
+
+/* Look up a named counter. Must hold counter_list_mutex */
+static struct xt_quota_counter *
+q2_find_counter(const struct quota2_net *quota2_net, const char *name)
+{
+	struct xt_quota_counter *e;
+
+	hlist_for_each_entry(e, q2_bucket(quota2_net, name), node)
+		if (strcmp(e->name, name) == 0)
+			return e;
+	return NULL;
+}
+
+static void *quota2_all_start(struct seq_file *m, loff_t *pos)
+{
+	struct quota2_net *quota2_net = m->private;
+
+	mutex_lock(&counter_list_mutex);
+	return seq_list_start(&quota2_net->counter_list, *pos);
+}
+
+static void *quota2_all_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct quota2_net *quota2_net = m->private;
+
+	return seq_list_next(v, &quota2_net->counter_list, pos);
+}
+
+static void quota2_all_stop(struct seq_file *m, void *v)
+{
+	mutex_unlock(&counter_list_mutex);
+}
+
+static int quota2_all_show(struct seq_file *m, void *v)
+{
+	struct xt_quota_counter *e = list_entry(v, typeof(*e), list);
+	unsigned int events;
+	u_int64_t old;
+
+	spin_lock_bh(&e->lock);
+	old = e->quota;
+	quota2_refill(e, get_jiffies_64());
+	events = quota2_crossed(e, old);
+	old = e->quota;
+	seq_printf(m, "%s %llu\n", e->name, quota2_value(e));
+	spin_unlock_bh(&e->lock);
+	quota2_notify(e, events, old);
+	return 0;
+}
+
+static const struct seq_operations quota2_all_seq_ops = {
+	.start = quota2_all_start,
+	.next  = quota2_all_next,
+	.stop  = quota2_all_stop,
+	.show  = quota2_all_show,
+};
+
+/*
+ * Apply one "name value" line, the value being anything the counter's own
+ * proc file takes. Must hold counter_list_mutex.
+ */
+static int quota2_batch_line(struct quota2_batch *b)
+{
+	struct xt_quota_counter *e;
+	char *value;
+
+	b->line[b->fill] = '\0';
+	b->fill = 0;
+	if (*b->line == '\0')
+		return 0;
+	value = strchr(b->line, ' ');
+	if (value == NULL)
+		return -EINVAL;
+	*value++ = '\0';
+	e = q2_find_counter(b->net, b->line);
+	if (e == NULL)
+		return -ENOENT;
+	quota2_set(e, value);
+	return 0;
+}
+
+static ssize_t
+quota2_all_write(struct file *file, const char __user *input,
+                 size_t size, loff_t *loff)
+{
+	struct quota2_batch *b = file->private_data;
+	size_t done = 0, len, i;
+	char buf[64];
+	int ret = 0;
+
+	if (b->broken)
+		return -EINVAL;
+
+	mutex_lock(&counter_list_mutex);
+	while (done < size && ret == 0) {
+		len = min(size - done, sizeof(buf));
+		if (copy_from_user(buf, input + done, len) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+		for (i = 0; i < len && ret == 0; ++i)
+			if (buf[i] == '\n')
+				ret = quota2_batch_line(b);
+			else if (b->fill < sizeof(b->line) - 1)
+				b->line[b->fill++] = buf[i];
+			else
+				ret = -EINVAL;
+		done += len;
+	}
+	mutex_unlock(&counter_list_mutex);
+
+	if (ret < 0) {
+		b->broken = true;
+		return ret;
+	}
+	*loff += done;
+	return done;
+}
+
+static int quota2_all_open(struct inode *inode, struct file *file)
+{
+	struct quota2_batch *b;
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE)) {
+		ret = seq_open(file, &quota2_all_seq_ops);
+		if (ret == 0)
+			((struct seq_file *)file->private_data)->private =
+				PDE_DATA(inode);
+		return ret;
+	}
+	if (file->f_mode & FMODE_READ)
+		return -EINVAL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+	b->net = PDE_DATA(inode);
+	file->private_data = b;
+	return 0;
+}
+
+static int quota2_all_release(struct inode *inode, struct file *file)
+{
+	struct quota2_batch *b = file->private_data;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return seq_release(inode, file);
+
+	/* A last line without newline still counts */
+	if (!b->broken && b->fill != 0) {
+		mutex_lock(&counter_list_mutex);
+		if (quota2_batch_line(b) < 0)
+			printk(KERN_ERR "xt_quota.3: malformed last line\n");
+		mutex_unlock(&counter_list_mutex);
+	}
+	kfree(b);
+	return 0;
+}
+
+static const struct file_operations quota2_all_fops = {
+	.open    = quota2_all_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.write   = quota2_all_write,
+	.release = quota2_all_release,
+};
+
 static struct xt_quota_counter *
-q2_new_counter(const struct xt_quota_mtinfo2 *q, bool anon)
+q2_new_counter(struct net *net, const struct xt_quota_mtinfo3 *q, bool anon)
 {
 	struct xt_quota_counter *e;
-	unsigned int size;
+	unsigned int size, i;
 
 	/* Do not need all the procfs things for anonymous counters. */
 	size = anon ? offsetof(typeof(*e), list) : sizeof(*e);
 	e = kmalloc(size, GFP_KERNEL);
 	if (e == NULL)
 		return NULL;
+	e->cpu = alloc_percpu(struct quota2_cpu);
+	if (e->cpu == NULL) {
+		kfree(e);
+		return NULL;
+	}
 
 	e->quota = q->quota;
+	e->refill = q->refill;
+	if (q->refill != 0) {
+		e->burst    = (q->burst != 0) ? q->burst : q->refill;
+		/* A millisecond is HZ thousandths of a jiffy */
+		e->interval = (u_int64_t)q->interval * HZ;
+		e->next     = get_jiffies_64() * 1000 + e->interval;
+		e->due      = div64_u64(e->next + 999, 1000);
+	} else {
+		e->burst    = 0;
+		e->interval = 0;
+		e->next     = 0;
+		e->due      = ~0ULL;
+	}
+	/* Never equal to that of a fresh CPU share, which has nothing seen */
+	e->gen     = 1;
+	e->reset   = 1;
+	e->starved = false;
+	e->notify  = !anon && (q->flags & XT_QUOTA_NOTIFY);
 	spin_lock_init(&e->lock);
 	if (!anon) {
 		INIT_LIST_HEAD(&e->list);
 		atomic_set(&e->ref, 1);
 		strncpy(e->name, q->name, sizeof(e->name));
+		e->net       = net;
+		e->watermark = q->watermark;
+		for (i = 0; i < __XT_QUOTA2_EVENT_MAX; ++i)
+			e->event_due[i] = jiffies;
 	}
 	return e;
 }
 
+static void q2_free_counter(struct xt_quota_counter *e)
+{
+	if (e == NULL)
+		return;
+	free_percpu(e->cpu);
+	kfree(e);
+}
+
+/*
+ * Double the hash once there are more counters than buckets. If that
+ * fails, the old one keeps working with longer chains.
+ */
+static void q2_grow_hash(struct quota2_net *quota2_net)
+{
+	unsigned int i, old_size = 1U << quota2_net->hash_bits;
+	struct hlist_head *old_hash = quota2_net->counter_hash;
+	struct xt_quota_counter *e;
+	struct hlist_node *next;
+
+	if (quota2_net->counter_count <= old_size)
+		return;
+	quota2_net->counter_hash = kcalloc(old_size * 2, sizeof(*old_hash),
+	                                   GFP_KERNEL);
+	if (quota2_net->counter_hash == NULL) {
+		quota2_net->counter_hash = old_hash;
+		return;
+	}
+	++quota2_net->hash_bits;
+
+	for (i = 0; i < old_size; ++i)
+		hlist_for_each_entry_safe(e, next, &old_hash[i], node)
+			hlist_add_head(&e->node,
+			               q2_bucket(quota2_net, e->name));
+	kfree(old_hash);
+}
+
 /**
  * q2_get_counter - get ref to counter or create new
  * @name:	name of counter
  */
 static struct xt_quota_counter *
-q2_get_counter(struct net *net, const struct xt_quota_mtinfo2 *q)
+q2_get_counter(struct net *net, const struct xt_quota_mtinfo3 *q)
 {
 	struct proc_dir_entry *p;
 	struct xt_quota_counter *e;
 	struct quota2_net *quota2_net = quota2_pernet(net);
 
 	if (*q->name == '\0')
-		return q2_new_counter(q, true);
+		return q2_new_counter(net, q, true);
 
-	spin_lock_bh(&counter_list_lock);
-	list_for_each_entry(e, &quota2_net->counter_list, list)
-		if (strcmp(e->name, q->name) == 0) {
-			atomic_inc(&e->ref);
-			spin_unlock_bh(&counter_list_lock);
-			return e;
-		}
+	mutex_lock(&counter_list_mutex);
+	e = q2_find_counter(quota2_net, q->name);
+	if (e != NULL) {
+		atomic_inc(&e->ref);
+		mutex_unlock(&counter_list_mutex);
+		return e;
+	}
 
-	e = q2_new_counter(q, false);
+	e = q2_new_counter(net, q, false);
 	if (e == NULL)
 		goto out;
 
 	p = proc_create_data(e->name, quota_list_perms,
 	                     quota2_net->proc_xt_quota,
 	                     &quota_proc_fops, e);
-	if (p == NULL || IS_ERR(p))
+	if (p == NULL || IS_ERR(p)) {
+		q2_free_counter(e);
+		e = NULL;
 		goto out;
+	}
 
 	e->procfs_entry = p;
 	proc_set_user(p, make_kuid(&init_user_ns, quota_list_uid),
 	              make_kgid(&init_user_ns, quota_list_gid));
 	list_add_tail(&e->list, &quota2_net->counter_list);
-	spin_unlock_bh(&counter_list_lock);
-	return e;
+	hlist_add_head(&e->node, q2_bucket(quota2_net, e->name));
+	++quota2_net->counter_count;
+	q2_grow_hash(quota2_net);
 
  out:
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
-	return NULL;
+	mutex_unlock(&counter_list_mutex);
+	return e;
 }
 
-static int quota_mt2_check(const struct xt_mtchk_param *par)
+/* Check the rule and get its counter into @q->master */
+static int quota2_setup(struct net *net, struct xt_quota_mtinfo3 *q)
 {
-	struct xt_quota_mtinfo2 *q = par->matchinfo;
-
 	if (q->flags & ~XT_QUOTA_MASK)
 		return -EINVAL;
+	if (q->refill != 0 &&
+	    (q->interval == 0 || (q->flags & XT_QUOTA_GROW))) {
+		printk(KERN_ERR "xt_quota.3: refill needs an interval "
+		       "and a countdown quota\n");
+		return -EINVAL;
+	}
+	if (q->watermark != 0 && !(q->flags & XT_QUOTA_NOTIFY))
+		return -EINVAL;
 
 	q->name[sizeof(q->name)-1] = '\0';
 	if (*q->name == '.' || strchr(q->name, '/') != NULL) {
 		printk(KERN_ERR "xt_quota.3: illegal name\n");
 		return -EINVAL;
 	}
+	if (*q->name == '\0' && (q->flags & XT_QUOTA_NOTIFY)) {
+		printk(KERN_ERR "xt_quota.3: events need a named counter\n");
+		return -EINVAL;
+	}
 
-	q->master = q2_get_counter(par->net, q);
+	q->master = q2_get_counter(net, q);
 	if (q->master == NULL) {
 		printk(KERN_ERR "xt_quota.3: memory alloc failure\n");
 		return -ENOMEM;
@@ -214,63 +742,203 @@ static int quota_mt2_check(const struct xt_mtchk_param *par)
 	return 0;
 }
 
-static void quota_mt2_destroy(const struct xt_mtdtor_param *par)
+static int quota_mt2_check(const struct xt_mtchk_param *par)
 {
 	struct xt_quota_mtinfo2 *q = par->matchinfo;
-	struct xt_quota_counter *e = q->master;
-	struct quota2_net *quota2_net = quota2_pernet(par->net);
+	struct xt_quota_mtinfo3 q3 = {
+		.flags = q->flags,
+		.quota = q->quota,
+	};
+	int ret;
 
-	if (*q->name == '\0') {
-		kfree(e);
+	memcpy(q3.name, q->name, sizeof(q3.name));
+	ret = quota2_setup(par->net, &q3);
+	memcpy(q->name, q3.name, sizeof(q->name));
+	q->master = q3.master;
+	return ret;
+}
+
+static int quota_mt3_check(const struct xt_mtchk_param *par)
+{
+	return quota2_setup(par->net, par->matchinfo);
+}
+
+static void quota2_put(struct net *net, const char *name,
+                       struct xt_quota_counter *e)
+{
+	struct quota2_net *quota2_net = quota2_pernet(net);
+
+	if (*name == '\0') {
+		q2_free_counter(e);
 		return;
 	}
 
-	spin_lock_bh(&counter_list_lock);
+	mutex_lock(&counter_list_mutex);
 	if (!atomic_dec_and_test(&e->ref)) {
-		spin_unlock_bh(&counter_list_lock);
+		mutex_unlock(&counter_list_mutex);
 		return;
 	}
 
 	list_del(&e->list);
+	hlist_del(&e->node);
+	--quota2_net->counter_count;
 	remove_proc_entry(e->name, quota2_net->proc_xt_quota);
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
+	mutex_unlock(&counter_list_mutex);
+	q2_free_counter(e);
+}
+
+static void quota_mt2_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_quota_mtinfo2 *q = par->matchinfo;
+
+	quota2_put(par->net, q->name, q->master);
 }
 
+static void quota_mt3_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_quota_mtinfo3 *q = par->matchinfo;
+
+	quota2_put(par->net, q->name, q->master);
+}
+
+/*
+ * Counting through the shared counter, as the CPU share was not enough.
+ * Packets are accounted exactly, and the share of this CPU is refreshed.
+ */
 static bool
-quota_mt2(const struct sk_buff *skb, struct xt_action_param *par)
+quota2_locked(struct xt_quota_counter *e, struct quota2_cpu *c,
+              u_int8_t flags, u_int64_t *shown, unsigned int len,
+              u_int64_t now)
 {
-	struct xt_quota_mtinfo2 *q = (void *)par->matchinfo;
-	struct xt_quota_counter *e = q->master;
-	bool ret = q->flags & XT_QUOTA_INVERT;
+	bool ret = flags & XT_QUOTA_INVERT;
+	unsigned int events;
+	u_int64_t old;
 
 	spin_lock_bh(&e->lock);
-	if (q->flags & XT_QUOTA_GROW) {
+	old = e->quota;
+	quota2_sync(e, c);
+	quota2_refill(e, now);
+	if (flags & XT_QUOTA_GROW) {
 		/*
 		 * While no_change is pointless in "grow" mode, we will
 		 * implement it here simply to have a consistent behavior.
 		 */
-		if (!(q->flags & XT_QUOTA_NO_CHANGE)) {
-			e->quota += (q->flags & XT_QUOTA_PACKET) ? 1 : skb->len;
-			q->quota = e->quota;
+		if (!(flags & XT_QUOTA_NO_CHANGE)) {
+			e->quota += len;
+			quota2_grown(e);
 		}
 		ret = true;
 	} else {
-		if (e->quota >= ((q->flags & XT_QUOTA_PACKET) ? 1 : skb->len)) {
-			if (!(q->flags & XT_QUOTA_NO_CHANGE))
-				e->quota -= (q->flags & XT_QUOTA_PACKET) ? 1 : skb->len;
+		if (e->quota >= len) {
+			if (!(flags & XT_QUOTA_NO_CHANGE))
+				e->quota -= len;
 			ret = !ret;
 		} else {
 			/* we do not allow even small packets from now on */
-			if (!(q->flags & XT_QUOTA_NO_CHANGE))
+			if (!(flags & XT_QUOTA_NO_CHANGE))
 				e->quota = 0;
+			e->starved = true;
 		}
-		q->quota = e->quota;
 	}
+	events   = quota2_crossed(e, old);
+	old      = e->quota;
+	*shown   = e->quota;
+	c->seen  = e->quota;
+	c->peeked = 0;
+	c->due   = e->due;
+	c->gen   = e->gen;
 	spin_unlock_bh(&e->lock);
+	quota2_notify(e, events, old);
 	return ret;
 }
 
+/**
+ * quota2_count - count a packet of a rule with @flags
+ * @shown:	quota value of the rule, as listed by iptables
+ */
+static bool
+quota2_count(struct xt_quota_counter *e, u_int8_t flags, u_int64_t *shown,
+             const struct sk_buff *skb)
+{
+	u_int64_t now = get_jiffies_64();
+	unsigned int len, reserve;
+	struct quota2_cpu *c;
+
+	if (flags & XT_QUOTA_PACKET) {
+		len     = 1;
+		reserve = ACCESS_ONCE(quota_reserve_packets);
+	} else {
+		len     = skb->len;
+		reserve = ACCESS_ONCE(quota_reserve_bytes);
+	}
+
+	/*
+	 * Xtables runs matches with BH disabled, so the share of this CPU
+	 * is ours alone. As long as it covers the packet and has not grown
+	 * beyond @reserve, the shared counter is left alone. A refill is
+	 * due at the same time for all CPUs; the first one to notice does it.
+	 */
+	c = this_cpu_ptr(e->cpu);
+	if (c->gen != ACCESS_ONCE(e->gen) || now >= c->due)
+		return quota2_locked(e, c, flags, shown, len, now);
+	if (flags & XT_QUOTA_GROW) {
+		if (flags & XT_QUOTA_NO_CHANGE)
+			return true;
+		if (c->added + len >= reserve)
+			return quota2_locked(e, c, flags, shown, len, now);
+		c->added += len;
+		return true;
+	}
+	if (c->used + len > c->seen + c->added) {
+		/*
+		 * What is left goes, but only the shared counter knows it.
+		 * It also has to learn that this share ran out, or other
+		 * CPUs and --no-change rules would go on seeing it.
+		 */
+		if ((c->used != 0 || c->seen + c->added != 0) &&
+		    !(flags & XT_QUOTA_NO_CHANGE))
+			return quota2_locked(e, c, flags, shown, len, now);
+		/*
+		 * The quota can only have grown since if @gen moved on. The
+		 * unlocked store may race with one growth, but not the next.
+		 */
+		if (!ACCESS_ONCE(e->starved))
+			e->starved = true;
+		return flags & XT_QUOTA_INVERT;
+	}
+	if (flags & XT_QUOTA_NO_CHANGE) {
+		/*
+		 * Nothing is counted here, but other CPUs may have used up
+		 * the counter since it was last seen. Look again after
+		 * @reserve, as a counting rule would.
+		 */
+		if (c->peeked + len >= reserve)
+			return quota2_locked(e, c, flags, shown, len, now);
+		c->peeked += len;
+		return !(flags & XT_QUOTA_INVERT);
+	}
+	if (c->used + len >= reserve)
+		return quota2_locked(e, c, flags, shown, len, now);
+	c->used += len;
+	return !(flags & XT_QUOTA_INVERT);
+}
+
+static bool
+quota_mt2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	struct xt_quota_mtinfo2 *q = (void *)par->matchinfo;
+
+	return quota2_count(q->master, q->flags, &q->quota, skb);
+}
+
+static bool
+quota_mt3(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	struct xt_quota_mtinfo3 *q = (void *)par->matchinfo;
+
+	return quota2_count(q->master, q->flags, &q->quota, skb);
+}
+
 static struct xt_match quota_mt2_reg[] __read_mostly = {
 	{
 		.name       = "quota2",
@@ -292,17 +960,60 @@ static struct xt_match quota_mt2_reg[] __read_mostly = {
 		.matchsize  = sizeof(struct xt_quota_mtinfo2),
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "quota2",
+		.revision   = 4,
+		.family     = NFPROTO_IPV4,
+		.checkentry = quota_mt3_check,
+		.match      = quota_mt3,
+		.destroy    = quota_mt3_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo3),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "quota2",
+		.revision   = 4,
+		.family     = NFPROTO_IPV6,
+		.checkentry = quota_mt3_check,
+		.match      = quota_mt3,
+		.destroy    = quota_mt3_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo3),
+		.me         = THIS_MODULE,
+	},
 };
 
 static int __net_init quota2_net_init(struct net *net)
 {
 	struct quota2_net *quota2_net = quota2_pernet(net);
+	struct proc_dir_entry *p;
+
 	INIT_LIST_HEAD(&quota2_net->counter_list);
+	quota2_net->hash_bits     = QUOTA2_HASH_MIN_BITS;
+	quota2_net->counter_count = 0;
+	quota2_net->counter_hash  = kcalloc(1U << quota2_net->hash_bits,
+	                            sizeof(*quota2_net->counter_hash),
+	                            GFP_KERNEL);
+	if (quota2_net->counter_hash == NULL)
+		return -ENOMEM;
 
 	quota2_net->proc_xt_quota = proc_mkdir("xt_quota", net->proc_net);
 	if (quota2_net->proc_xt_quota == NULL)
-		return -EACCES;
+		goto out;
+	/* Counter names cannot start with a dot, so this one is never taken */
+	p = proc_create_data(".all", quota_list_perms,
+	                     quota2_net->proc_xt_quota,
+	                     &quota2_all_fops, quota2_net);
+	if (p == NULL || IS_ERR(p)) {
+		remove_proc_entry("xt_quota", net->proc_net);
+		goto out;
+	}
+	proc_set_user(p, make_kuid(&init_user_ns, quota_list_uid),
+	              make_kgid(&init_user_ns, quota_list_gid));
 	return 0;
+
+ out:
+	kfree(quota2_net->counter_hash);
+	return -EACCES;
 }
 
 static void __net_exit quota2_net_exit(struct net *net)
@@ -311,16 +1022,18 @@ static void __net_exit quota2_net_exit(struct net *net)
 	struct xt_quota_counter *e = NULL;
 	struct list_head *pos, *q;
 
+	remove_proc_entry(".all", quota2_net->proc_xt_quota);
 	remove_proc_entry("xt_quota", net->proc_net);
 
 	/* destroy counter_list while freeing it's content */
-	spin_lock_bh(&counter_list_lock);
+	mutex_lock(&counter_list_mutex);
 	list_for_each_safe(pos, q, &quota2_net->counter_list) {
 		e = list_entry(pos, struct xt_quota_counter, list);
 		list_del(pos);
-		kfree(e);
+		q2_free_counter(e);
 	}
-	spin_unlock_bh(&counter_list_lock);
+	mutex_unlock(&counter_list_mutex);
+	kfree(quota2_net->counter_hash);
 }
 
 static struct pernet_operations quota2_net_ops = {
@@ -337,9 +1050,28 @@ static int __init quota_mt2_init(void)
 	if (ret < 0)
 		return ret;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+	ret = genl_register_family(&quota2_genl_family);
+	if (ret == 0) {
+		ret = genl_register_mc_group(&quota2_genl_family,
+		      &quota2_genl_group);
+		if (ret < 0)
+			genl_unregister_family(&quota2_genl_family);
+	}
+#else
+	ret = _genl_register_family_with_ops_grps(&quota2_genl_family,
+	      NULL, 0, quota2_genl_groups, ARRAY_SIZE(quota2_genl_groups));
+#endif
+	if (ret < 0) {
+		unregister_pernet_subsys(&quota2_net_ops);
+		return ret;
+	}
+
 	ret = xt_register_matches(quota_mt2_reg, ARRAY_SIZE(quota_mt2_reg));
-	if (ret < 0)
+	if (ret < 0) {
+		genl_unregister_family(&quota2_genl_family);
 		unregister_pernet_subsys(&quota2_net_ops);
+	}
 
 	return ret;
 }
@@ -347,6 +1079,7 @@ static int __init quota_mt2_init(void)
 static void __exit quota_mt2_exit(void)
 {
 	xt_unregister_matches(quota_mt2_reg, ARRAY_SIZE(quota_mt2_reg));
+	genl_unregister_family(&quota2_genl_family);
 	unregister_pernet_subsys(&quota2_net_ops);
 }
 
@@ -6,7 +6,8 @@ enum xt_quota_flags {
 	XT_QUOTA_GROW      = 1 << 1,
 	XT_QUOTA_PACKET    = 1 << 2,
 	XT_QUOTA_NO_CHANGE = 1 << 3,
-	XT_QUOTA_MASK      = 0x0F,
+	XT_QUOTA_NOTIFY    = 1 << 4,
+	XT_QUOTA_MASK      = 0x1F,
 };
 
 struct xt_quota_counter;
@@ -22,4 +23,70 @@ struct xt_quota_mtinfo2 {
 	struct xt_quota_counter *master __attribute__((aligned(8)));
 };
 
+/*
+ * Revision 4 can refill a countdown quota in the kernel: every @interval
+ * milliseconds, @refill is added to it, up to @burst (@refill if 0).
+ * With XT_QUOTA_NOTIFY, a named counter sends events when it crosses
+ * @watermark (none if 0) or reaches zero.
+ */
+struct xt_quota_mtinfo3 {
+	char name[15];
+	u_int8_t flags;
+	u_int32_t interval;
+	u_int32_t pad;
+	aligned_u64 refill;
+	aligned_u64 burst;
+	aligned_u64 watermark;
+
+	/* Comparison-invariant */
+	aligned_u64 quota;
+
+	/* Used internally by the kernel */
+	struct xt_quota_counter *master __attribute__((aligned(8)));
+};
+
+/*
+ * Generic netlink family XT_QUOTA2_GENL_NAME. Counters created with
+ * XT_QUOTA_NOTIFY send XT_QUOTA2_CMD_EVENT messages to its multicast
+ * group XT_QUOTA2_GENL_GROUP, in their network namespace.
+ */
+#define XT_QUOTA2_GENL_NAME    "xt_quota2"
+#define XT_QUOTA2_GENL_VERSION 1
+#define XT_QUOTA2_GENL_GROUP   "events"
+
+enum {
+	XT_QUOTA2_CMD_UNSPEC,
+	XT_QUOTA2_CMD_EVENT,
+	__XT_QUOTA2_CMD_MAX,
+};
+#define XT_QUOTA2_CMD_MAX (__XT_QUOTA2_CMD_MAX - 1)
+
+/**
+ * @XT_QUOTA2_EVENT_EMPTY:	counter reached zero
+ * @XT_QUOTA2_EVENT_LOW:	counter fell to the watermark or below
+ * @XT_QUOTA2_EVENT_HIGH:	counter rose to the watermark or above
+ */
+enum xt_quota2_event {
+	XT_QUOTA2_EVENT_EMPTY,
+	XT_QUOTA2_EVENT_LOW,
+	XT_QUOTA2_EVENT_HIGH,
+	__XT_QUOTA2_EVENT_MAX,
+};
+
+/**
+ * @XT_QUOTA2_ATTR_NAME:	counter name (string)
+ * @XT_QUOTA2_ATTR_EVENT:	enum xt_quota2_event (u8)
+ * @XT_QUOTA2_ATTR_QUOTA:	counter value (u64)
+ * @XT_QUOTA2_ATTR_WATERMARK:	watermark of the counter (u64)
+ */
+enum {
+	XT_QUOTA2_ATTR_UNSPEC,
+	XT_QUOTA2_ATTR_NAME,
+	XT_QUOTA2_ATTR_EVENT,
+	XT_QUOTA2_ATTR_QUOTA,
+	XT_QUOTA2_ATTR_WATERMARK,
+	__XT_QUOTA2_ATTR_MAX,
+};
+#define XT_QUOTA2_ATTR_MAX (__XT_QUOTA2_ATTR_MAX - 1)
+
 #endif /* _XT_QUOTA_H */
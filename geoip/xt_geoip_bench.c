@@ -0,0 +1,769 @@
+/*
+ *	Microbenchmark for the xt_geoip lookup layouts
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License; either
+ *	version 2 of the License, or any later version, as published by the
+ *	Free Software Foundation.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include <netinet/in.h>
+#ifndef aligned_u64
+#	define aligned_u64 __u64 __attribute__((aligned(8)))
+#endif
+#include "xt_geoip.h"
+#include "xt_geoip_index.h"
+
+/**
+ * @subnets:	ranges as stored in the database files
+ * @count:	number of ranges
+ */
+struct bench_country {
+	struct geoip_subnet4 *subnets;
+	unsigned int count;
+};
+
+struct bench_country6 {
+	struct geoip_subnet6 *subnets;
+	unsigned int count;
+};
+
+/**
+ * Merged ranges of all countries, in both layouts
+ * @begin, @end, @set:	sorted order
+ * @ekey, @eend, @eset:	Eytzinger order as built by xt_geoip
+ * @pool:	country sets the @set entries point into; country i has code i
+ */
+struct bench_index {
+	unsigned int count;
+	uint32_t *begin, *end;
+	unsigned int *set;
+	uint32_t *ekey, *eend;
+	unsigned int *eset;
+	__u16 *pool;
+};
+
+/**
+ * Merged IPv6 ranges of all countries
+ * @begin, @end, @set:	sorted order
+ * @ekey, @eend, @eset:	full-width Eytzinger order, as before the
+ * 			prefix index
+ * @pkey, @pend, @pset:	/64 prefix index as built by xt_geoip
+ * @fkey, @fend, @fset:	its full-width fallback
+ */
+struct bench_index6 {
+	unsigned int count, pcount, fcount;
+	struct in6_addr *begin, *end;
+	unsigned int *set;
+	struct in6_addr *ekey, *eend;
+	unsigned int *eset;
+	__u64 *pkey, *pend;
+	unsigned int *pset;
+	struct in6_addr *fkey, *fend;
+	unsigned int *fset;
+	__u16 *pool;
+};
+
+/* Addresses looked up at once by the batched search */
+#define BENCH_BATCH 8
+
+static const char *db_dir = "/usr/share/xt_geoip";
+static unsigned int nr_lookups;
+static unsigned int nr_synthetic = 8;
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL && size != 0) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/**
+ * Read one database file
+ * @ext:	"iv4" or "iv6"
+ * @esize:	size of one range
+ */
+static bool bench_read(const char *code, const char *ext, size_t esize,
+    void **subnets, unsigned int *count)
+{
+	char buf[256];
+	struct stat sb;
+	int fd;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	snprintf(buf, sizeof(buf), "%s/BE/%s.%s", db_dir, code, ext);
+#else
+	snprintf(buf, sizeof(buf), "%s/LE/%s.%s", db_dir, code, ext);
+#endif
+	fd = open(buf, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", buf, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size % esize != 0) {
+		fprintf(stderr, "%s seems to be corrupted\n", buf);
+		close(fd);
+		return false;
+	}
+	*count   = sb.st_size / esize;
+	*subnets = xmalloc(sb.st_size + 1);
+	if (read(fd, *subnets, sb.st_size) != sb.st_size) {
+		fprintf(stderr, "Short read on %s\n", buf);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+static bool bench_load(struct bench_country *c, const char *code)
+{
+	void *subnets;
+
+	if (!bench_read(code, "iv4", sizeof(*c->subnets), &subnets, &c->count))
+		return false;
+	c->subnets = subnets;
+	return true;
+}
+
+static bool bench_load6(struct bench_country6 *c, const char *code)
+{
+	void *subnets;
+
+	if (!bench_read(code, "iv6", sizeof(*c->subnets), &subnets, &c->count))
+		return false;
+	c->subnets = subnets;
+	return true;
+}
+
+static void bench_put6(struct in6_addr *a, uint64_t hi, uint64_t lo)
+{
+	a->s6_addr32[0] = hi >> 32;
+	a->s6_addr32[1] = hi;
+	a->s6_addr32[2] = lo >> 32;
+	a->s6_addr32[3] = lo;
+}
+
+static uint64_t rand64(void)
+{
+	return (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ rand();
+}
+
+/*
+ * Interleave countries in roughly the same granularity as real data,
+ * with a total range count similar to the full MaxMind IPv4 set. One range
+ * in 32 half overlaps a range of another country, so that the sweep has
+ * country sets to build.
+ */
+static void bench_synthesize(struct bench_country *c, unsigned int nc)
+{
+	unsigned int i, n = 0, per = 320000 / nc;
+	uint32_t addr = 0x01000000;
+
+	for (i = 0; i < nc; ++i) {
+		c[i].subnets = xmalloc(per * sizeof(*c[i].subnets));
+		c[i].count   = 0;
+	}
+	while (n < nc * per) {
+		struct bench_country *p = &c[rand() % nc], *q;
+		uint32_t len = 1U << (8 + rand() % 6);
+
+		if (p->count >= per)
+			continue;
+		p->subnets[p->count].begin = addr;
+		p->subnets[p->count].end   = addr + len - 1;
+		++p->count;
+		++n;
+		q = &c[rand() % nc];
+		if (rand() % 32 == 0 && q != p && q->count < per) {
+			q->subnets[q->count].begin = addr + len / 2;
+			q->subnets[q->count].end   = addr + len + len / 2 - 1;
+			++q->count;
+			++n;
+		}
+		addr += len + (rand() % 4) * 256;
+	}
+}
+
+/*
+ * Mostly allocations between /48 and /29, as in real data, and one in 16
+ * a range within a single /64 to exercise the full-width fallback. As for
+ * IPv4, one allocation in 32 half overlaps one of another country.
+ */
+static void bench_synthesize6(struct bench_country6 *c, unsigned int nc)
+{
+	unsigned int i, n = 0, per = 100000 / nc;
+	uint64_t hi = 0x2001000000000000ULL, lo, len;
+
+	for (i = 0; i < nc; ++i) {
+		c[i].subnets = xmalloc(per * sizeof(*c[i].subnets));
+		c[i].count   = 0;
+	}
+	while (n < nc * per) {
+		struct bench_country6 *p = &c[rand() % nc], *q;
+		struct geoip_subnet6 *s;
+
+		if (p->count >= per)
+			continue;
+		s = &p->subnets[p->count];
+		if (rand() % 16 != 0) {
+			len = 1ULL << (16 + rand() % 20);
+			bench_put6(&s->begin, hi, 0);
+			bench_put6(&s->end, hi + len - 1, ~0ULL);
+			q = &c[rand() % nc];
+			if (rand() % 32 == 0 && q != p && q->count < per) {
+				s = &q->subnets[q->count++];
+				bench_put6(&s->begin, hi + len / 2, 0);
+				bench_put6(&s->end, hi + len + len / 2 - 1, ~0ULL);
+				++n;
+			}
+			hi += len + ((uint64_t)(rand() % 4) << 16);
+		} else {
+			lo  = (uint64_t)(rand() % 256) << 32;
+			len = 1ULL << (rand() % 32);
+			bench_put6(&s->begin, hi, lo);
+			bench_put6(&s->end, hi, lo + len - 1);
+			++hi;
+		}
+		++p->count;
+		++n;
+	}
+}
+
+/**
+ * Lay out sorted ranges in Eytzinger order, with the code xt_geoip uses
+ * @asize:	size of one address
+ */
+static void bench_eytz(const void *begin, const void *end,
+    const unsigned int *set, unsigned int n, size_t asize,
+    void **ekey, void **eend, unsigned int **eset)
+{
+	unsigned int *perm = xmalloc((n + 1) * sizeof(*perm));
+
+	*ekey = xmalloc((n + 1) * asize);
+	*eend = xmalloc((n + 1) * asize);
+	*eset = xmalloc((n + 1) * sizeof(**eset));
+	geoip_eytz_layout(perm, begin, end, set, n, asize, *ekey, *eend, *eset);
+	free(perm);
+}
+
+/**
+ * Merge the countries as xt_geoip does, slot and code of country i being i
+ * @ev:		events of all countries, sorted here
+ * @asize:	size of one address
+ *
+ * Returns the number of merged ranges.
+ */
+static unsigned int bench_sweep(bool v6, struct geoip_event *ev,
+    unsigned int nev, unsigned int nc, size_t asize, void **begin,
+    void **end, unsigned int **set, __u16 **pool)
+{
+	struct geoip_builder b = {};
+	__u16 *cc = xmalloc(nc * sizeof(*cc));
+	unsigned int i;
+	int n;
+
+	b.cc        = cc;
+	b.nslots    = nc;
+	b.active    = calloc(nc, sizeof(*b.active));
+	b.scratch   = xmalloc((nc + 1) * sizeof(*b.scratch));
+	b.pool_size = b.pool_len = 2 * nc;
+	b.pool      = xmalloc(b.pool_size * sizeof(*b.pool));
+	if (b.active == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nc; ++i) {
+		cc[i] = i;
+		b.pool[2*i]   = 1;
+		b.pool[2*i+1] = i;
+	}
+
+	*begin = xmalloc(nev * asize);
+	*end   = xmalloc(nev * asize);
+	*set   = xmalloc(nev * sizeof(**set));
+	qsort(ev, nev, sizeof(*ev), geoip_event_cmp);
+	n = geoip_index_sweep(&b, v6, ev, nev, *begin, *end, *set);
+	if (n < 0) {
+		perror("geoip_index_sweep");
+		exit(EXIT_FAILURE);
+	}
+	*pool = b.pool;
+	free(cc);
+	free(b.active);
+	free(b.scratch);
+	return n;
+}
+
+/*
+ * Countries are sorted and coalesced in place like xt_geoip does on load,
+ * which the per-country search relies on as well.
+ */
+static void bench_merge(struct bench_index *idx,
+    struct bench_country *c, unsigned int nc)
+{
+	struct geoip_event *ev;
+	unsigned int i, nev = 0;
+
+	for (i = 0; i < nc; ++i) {
+		qsort(c[i].subnets, c[i].count, sizeof(*c[i].subnets),
+		      geoip_subnet4_cmp);
+		c[i].count = geoip_coalesce(c[i].subnets, c[i].count, false);
+		nev += 2 * c[i].count;
+	}
+	ev = xmalloc(nev * sizeof(*ev));
+	for (i = 0, nev = 0; i < nc; ++i)
+		nev += geoip_events_add(&ev[nev], false, c[i].subnets,
+		       c[i].count, i);
+	idx->count = bench_sweep(false, ev, nev, nc, sizeof(*idx->begin),
+	             (void **)&idx->begin, (void **)&idx->end, &idx->set,
+	             &idx->pool);
+	free(ev);
+	if (idx->count == 0)
+		return;
+
+	bench_eytz(idx->begin, idx->end, idx->set, idx->count,
+	           sizeof(*idx->begin), (void **)&idx->ekey,
+	           (void **)&idx->eend, &idx->eset);
+}
+
+static void bench_merge6(struct bench_index6 *idx,
+    struct bench_country6 *c, unsigned int nc)
+{
+	unsigned int i, n, k, nev = 0, *fine;
+	struct geoip_event *ev;
+	__u64 *pbegin, *pend;
+	struct in6_addr *fbegin, *fend;
+	unsigned int *pset, *fset;
+
+	for (i = 0; i < nc; ++i) {
+		qsort(c[i].subnets, c[i].count, sizeof(*c[i].subnets),
+		      geoip_subnet6_cmp);
+		c[i].count = geoip_coalesce(c[i].subnets, c[i].count, true);
+		nev += 2 * c[i].count;
+	}
+	ev = xmalloc(nev * sizeof(*ev));
+	for (i = 0, nev = 0; i < nc; ++i)
+		nev += geoip_events_add(&ev[nev], true, c[i].subnets,
+		       c[i].count, i);
+	idx->count = n = bench_sweep(true, ev, nev, nc, sizeof(*idx->begin),
+	             (void **)&idx->begin, (void **)&idx->end, &idx->set,
+	             &idx->pool);
+	free(ev);
+	if (n == 0)
+		return;
+	bench_eytz(idx->begin, idx->end, idx->set, n, sizeof(*idx->begin),
+	           (void **)&idx->ekey, (void **)&idx->eend, &idx->eset);
+
+	pbegin = xmalloc(3 * n * sizeof(*pbegin));
+	pend   = xmalloc(3 * n * sizeof(*pend));
+	pset   = xmalloc(3 * n * sizeof(*pset));
+	fine   = xmalloc(n * sizeof(*fine));
+	idx->pcount = geoip_split6(idx->begin, idx->end, idx->set, n,
+	              pbegin, pend, pset, fine, &idx->fcount);
+	bench_eytz(pbegin, pend, pset, idx->pcount, sizeof(*pbegin),
+	           (void **)&idx->pkey, (void **)&idx->pend, &idx->pset);
+	if (idx->fcount > 0) {
+		fbegin = xmalloc(idx->fcount * sizeof(*fbegin));
+		fend   = xmalloc(idx->fcount * sizeof(*fend));
+		fset   = xmalloc(idx->fcount * sizeof(*fset));
+		for (k = 0; k < idx->fcount; ++k) {
+			fbegin[k] = idx->begin[fine[k]];
+			fend[k]   = idx->end[fine[k]];
+			fset[k]   = idx->set[fine[k]];
+		}
+		bench_eytz(fbegin, fend, fset, idx->fcount, sizeof(*fbegin),
+		           (void **)&idx->fkey, (void **)&idx->fend,
+		           &idx->fset);
+		free(fbegin);
+		free(fend);
+		free(fset);
+	}
+	free(pbegin);
+	free(pend);
+	free(pset);
+	free(fine);
+}
+
+/* The pre-index xt_geoip search, run once per country of a rule */
+static bool geoip_bsearch4(const struct geoip_subnet4 *range,
+    uint32_t addr, int lo, int hi)
+{
+	int mid;
+
+	while (hi > lo) {
+		mid = (lo + hi) / 2;
+		if (range[mid].begin <= addr && addr <= range[mid].end)
+			return true;
+		if (range[mid].begin > addr)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return false;
+}
+
+/* First country of the set a merged lookup returned */
+static unsigned int bench_country_of(const __u16 *pool, unsigned int set)
+{
+	return (set == GEOIP_SET_NONE) ? GEOIP_SET_NONE : pool[set+1];
+}
+
+static unsigned int lookup_percountry(const struct bench_country *c,
+    unsigned int nc, uint32_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nc; ++i)
+		if (geoip_bsearch4(c[i].subnets, addr, 0, c[i].count))
+			return i;
+	return GEOIP_SET_NONE;
+}
+
+static unsigned int lookup_sorted(const struct bench_index *idx,
+    uint32_t addr)
+{
+	unsigned int lo = 0, hi = idx->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->begin[mid] <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || addr > idx->end[lo-1])
+		return GEOIP_SET_NONE;
+	return idx->set[lo-1];
+}
+
+static unsigned int lookup_eytz(const struct bench_index *idx, uint32_t addr)
+{
+	unsigned int k = geoip_eytz_search4(idx->ekey, idx->count, addr);
+
+	if (idx->eset[k] == GEOIP_SET_NONE || addr > idx->eend[k])
+		return GEOIP_SET_NONE;
+	return idx->eset[k];
+}
+
+/* The pre-index IPv6 search, comparing whole struct in6_addr */
+static bool geoip_bsearch6(const struct geoip_subnet6 *range,
+    const struct in6_addr *addr, int lo, int hi)
+{
+	int mid;
+
+	while (hi > lo) {
+		mid = (lo + hi) / 2;
+		if (geoip_ipv6_cmp(&range[mid].begin, addr) <= 0 &&
+		    geoip_ipv6_cmp(addr, &range[mid].end) <= 0)
+			return true;
+		if (geoip_ipv6_cmp(&range[mid].begin, addr) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return false;
+}
+
+static unsigned int lookup6_percountry(const struct bench_country6 *c,
+    unsigned int nc, const struct in6_addr *addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nc; ++i)
+		if (geoip_bsearch6(c[i].subnets, addr, 0, c[i].count))
+			return i;
+	return GEOIP_SET_NONE;
+}
+
+static unsigned int lookup6_full(const struct bench_index6 *idx,
+    const struct in6_addr *addr)
+{
+	unsigned int k = geoip_eytz_search6(idx->ekey, idx->count, addr);
+
+	if (idx->eset[k] == GEOIP_SET_NONE ||
+	    geoip_ipv6_cmp(addr, &idx->eend[k]) > 0)
+		return GEOIP_SET_NONE;
+	return idx->eset[k];
+}
+
+/* Same as geoip_lookup6_node() in xt_geoip */
+static unsigned int lookup6_node(const struct bench_index6 *idx,
+    const struct in6_addr *addr, unsigned int k)
+{
+	unsigned int set = idx->pset[k];
+
+	if (set == GEOIP_SET_NONE || geoip_ipv6_hi(addr) > idx->pend[k])
+		return GEOIP_SET_NONE;
+	if (set != GEOIP_SET_FULL)
+		return set;
+	k = geoip_eytz_search6(idx->fkey, idx->fcount, addr);
+	if (idx->fset[k] == GEOIP_SET_NONE ||
+	    geoip_ipv6_cmp(addr, &idx->fend[k]) > 0)
+		return GEOIP_SET_NONE;
+	return idx->fset[k];
+}
+
+static unsigned int lookup6_prefix(const struct bench_index6 *idx,
+    const struct in6_addr *addr)
+{
+	return lookup6_node(idx, addr, geoip_eytz_search64(idx->pkey,
+	       idx->pcount, geoip_ipv6_hi(addr)));
+}
+
+/* @n must be a multiple of %BENCH_BATCH */
+static unsigned long lookup6_batch(const struct bench_index6 *idx,
+    const struct in6_addr *addr, unsigned int n)
+{
+	unsigned int i, j, node[BENCH_BATCH];
+	__u64 hi[BENCH_BATCH];
+	unsigned long sum = 0;
+
+	for (i = 0; i < n; i += BENCH_BATCH) {
+		for (j = 0; j < BENCH_BATCH; ++j)
+			hi[j] = geoip_ipv6_hi(&addr[i+j]);
+		geoip_eytz_search64_batch(idx->pkey, idx->pcount, hi, node,
+			BENCH_BATCH);
+		for (j = 0; j < BENCH_BATCH; ++j)
+			sum += lookup6_node(idx, &addr[i+j], node[j]);
+	}
+	return sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, unsigned long sum)
+{
+	double t = now() - start;
+
+	printf("%-24s %8.2f Mlookups/s  (%.1f ns/lookup, checksum %lu)\n",
+	       name, nr_lookups / t / 1e6, t * 1e9 / nr_lookups, sum);
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr,
+		"Usage: %s [-6] [-D dbdir] [-n lookups] [-s countries] [CC...]\n"
+		"Without country codes, a synthetic database with the -s number\n"
+		"of countries is used. -6 compares the IPv6 layouts instead.\n",
+		p);
+	exit(EXIT_FAILURE);
+}
+
+static int bench_ipv4(char **ccs, unsigned int nc)
+{
+	struct bench_country *c;
+	struct bench_index idx;
+	unsigned long sum;
+	unsigned int i, total = 0;
+	uint32_t *addr;
+	double start;
+
+	c = xmalloc(nc * sizeof(*c));
+	if (ccs != NULL) {
+		for (i = 0; i < nc; ++i)
+			if (!bench_load(&c[i], ccs[i]))
+				return EXIT_FAILURE;
+	} else {
+		bench_synthesize(c, nc);
+	}
+	bench_merge(&idx, c, nc);
+	for (i = 0; i < nc; ++i)
+		total += c[i].count;
+	if (total == 0) {
+		fprintf(stderr, "No IPv4 ranges loaded\n");
+		return EXIT_FAILURE;
+	}
+	printf("%u countries, %u IPv4 ranges, %u lookups\n",
+	       nc, total, nr_lookups);
+
+	/* Half the addresses are drawn from ranges, half uniformly */
+	addr = xmalloc(nr_lookups * sizeof(*addr));
+	for (i = 0; i < nr_lookups; ++i) {
+		if (i & 1) {
+			addr[i] = (uint32_t)rand() << 16 ^ rand();
+		} else {
+			unsigned int k = rand() % idx.count;
+
+			addr[i] = idx.begin[k] +
+			          rand() % (idx.end[k] - idx.begin[k] + 1);
+		}
+	}
+
+	for (i = 0; i < nr_lookups; ++i)
+		if (lookup_sorted(&idx, addr[i]) != lookup_eytz(&idx, addr[i]) ||
+		    bench_country_of(idx.pool, lookup_sorted(&idx, addr[i])) !=
+		    lookup_percountry(c, nc, addr[i])) {
+			fprintf(stderr, "Layouts disagree on %08x\n", addr[i]);
+			return EXIT_FAILURE;
+		}
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup_percountry(c, nc, addr[i]);
+	report("per-country bsearch", start, sum);
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup_sorted(&idx, addr[i]);
+	report("merged, sorted", start, sum);
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup_eytz(&idx, addr[i]);
+	report("merged, Eytzinger", start, sum);
+	return EXIT_SUCCESS;
+}
+
+static int bench_ipv6(char **ccs, unsigned int nc)
+{
+	struct bench_country6 *c;
+	struct bench_index6 idx = {};
+	struct in6_addr *addr;
+	unsigned long sum;
+	unsigned int i, k, total = 0;
+	uint64_t lo_hi, span;
+	double start;
+
+	c = xmalloc(nc * sizeof(*c));
+	if (ccs != NULL) {
+		for (i = 0; i < nc; ++i)
+			if (!bench_load6(&c[i], ccs[i]))
+				return EXIT_FAILURE;
+	} else {
+		bench_synthesize6(c, nc);
+	}
+	bench_merge6(&idx, c, nc);
+	for (i = 0; i < nc; ++i)
+		total += c[i].count;
+	if (total == 0) {
+		fprintf(stderr, "No IPv6 ranges loaded\n");
+		return EXIT_FAILURE;
+	}
+	printf("%u countries, %u IPv6 ranges (%u by /64 prefix, %u full-width), "
+	       "%u lookups\n", nc, total, idx.pcount, idx.fcount, nr_lookups);
+	printf("index size: %zu bytes full-width, %zu bytes by prefix\n",
+	       (idx.count + 1) * (2 * sizeof(struct in6_addr) + sizeof(int)),
+	       (idx.pcount + 1) * (2 * sizeof(uint64_t) + sizeof(int)) +
+	       (idx.fcount + 1) * (2 * sizeof(struct in6_addr) + sizeof(int)));
+
+	/*
+	 * Half the addresses are drawn from ranges, half uniformly from the
+	 * /64s the database spans.
+	 */
+	lo_hi = geoip_ipv6_hi(&idx.begin[0]);
+	span  = geoip_ipv6_hi(&idx.end[idx.count-1]) - lo_hi;
+	addr  = xmalloc(nr_lookups * sizeof(*addr));
+	for (i = 0; i < nr_lookups; ++i) {
+		if (i & 1) {
+			bench_put6(&addr[i], lo_hi + (span + 1 != 0 ?
+			           rand64() % (span + 1) : rand64()), rand64());
+		} else {
+			unsigned __int128 b, e, off;
+
+			k   = rand() % idx.count;
+			b   = (unsigned __int128)geoip_ipv6_hi(&idx.begin[k]) << 64 |
+			      geoip_ipv6_lo(&idx.begin[k]);
+			e   = (unsigned __int128)geoip_ipv6_hi(&idx.end[k]) << 64 |
+			      geoip_ipv6_lo(&idx.end[k]);
+			off = (unsigned __int128)rand64() << 64 | rand64();
+			if (e - b + 1 != 0)
+				off %= e - b + 1;
+			b += off;
+			bench_put6(&addr[i], b >> 64, b);
+		}
+	}
+
+	for (i = 0; i < nr_lookups; ++i)
+		if (lookup6_full(&idx, &addr[i]) != lookup6_prefix(&idx, &addr[i]) ||
+		    bench_country_of(idx.pool, lookup6_full(&idx, &addr[i])) !=
+		    lookup6_percountry(c, nc, &addr[i])) {
+			fprintf(stderr, "Layouts disagree on %08x:%08x:%08x:%08x\n",
+			        addr[i].s6_addr32[0], addr[i].s6_addr32[1],
+			        addr[i].s6_addr32[2], addr[i].s6_addr32[3]);
+			return EXIT_FAILURE;
+		}
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup6_percountry(c, nc, &addr[i]);
+	report("per-country bsearch", start, sum);
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup6_full(&idx, &addr[i]);
+	report("merged, full-width", start, sum);
+
+	start = now();
+	for (sum = 0, i = 0; i < nr_lookups; ++i)
+		sum += lookup6_prefix(&idx, &addr[i]);
+	report("merged, /64 prefix", start, sum);
+
+	start = now();
+	sum = lookup6_batch(&idx, addr, nr_lookups);
+	report("merged, /64 prefix, batch", start, sum);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nc;
+	bool ipv6 = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "6D:n:s:")) != -1) {
+		switch (opt) {
+		case '6':
+			ipv6 = true;
+			break;
+		case 'D':
+			db_dir = optarg;
+			break;
+		case 'n':
+			nr_lookups = strtoul(optarg, NULL, 0);
+			if (nr_lookups == 0)
+				usage(*argv);
+			break;
+		case 's':
+			nr_synthetic = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	nc = (optind < argc) ? argc - optind : nr_synthetic;
+	if (nc == 0 || nc > 255)
+		usage(*argv);
+	if (nr_lookups == 0)
+		nr_lookups = ipv6 ? 1 << 22 : 1 << 24;
+
+	if (ipv6) {
+		/* The batched search wants whole batches */
+		nr_lookups = (nr_lookups + BENCH_BATCH - 1) / BENCH_BATCH *
+		             BENCH_BATCH;
+		return bench_ipv6((optind < argc) ? &argv[optind] : NULL, nc);
+	}
+	return bench_ipv4((optind < argc) ? &argv[optind] : NULL, nc);
+}
@@ -0,0 +1,635 @@
+/*
+ *	Converter for MaxMind CSV database to binary, for xt_geoip
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License; either
+ *	version 2 of the License, or any later version, as published by the
+ *	Free Software Foundation.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+#include <linux/types.h>
+#ifndef aligned_u64
+#	define aligned_u64 __u64 __attribute__((aligned(8)))
+#endif
+#include "xt_geoip.h"
+#include "xt_geoip_db.h"
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+struct range4 {
+	uint32_t begin, end;
+};
+
+/* Addresses as two host-order halves, so that they compare as integers */
+struct range6 {
+	uint64_t begin_hi, begin_lo, end_hi, end_lo;
+};
+
+/**
+ * @code:	upper-cased ISO code
+ * @name:	name from the first row seen
+ * @v4, @v6:	ranges in input order, sorted and merged later on
+ */
+struct country {
+	char code[3];
+	char *name;
+	struct range4 *v4;
+	struct range6 *v6;
+	size_t n4, n6, alloc4, alloc6;
+	size_t rows4, rows6;
+};
+
+/* Indexed by (code[0] << 8 | code[1]), so rows need no search */
+static struct country *country[1 << 16];
+static const char *target_dir = ".";
+static unsigned int nr_threads;
+static unsigned int next_cc;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/**
+ * Split a CSV line into at most @max fields in place. Fields may be
+ * quoted, with "" standing for a literal quote, and surrounded by
+ * whitespace. Returns the number of fields.
+ */
+static unsigned int csv_split(char *line, char **field, unsigned int max)
+{
+	unsigned int n = 0;
+	char *rd = line, *wr;
+
+	while (n < max) {
+		while (*rd == ' ' || *rd == '\t')
+			++rd;
+		field[n++] = wr = rd;
+		if (*rd == '"') {
+			field[n-1] = wr = ++rd;
+			while (*rd != '\0') {
+				if (*rd == '"' && rd[1] == '"') {
+					*wr++ = '"';
+					rd += 2;
+				} else if (*rd == '"') {
+					++rd;
+					break;
+				} else {
+					*wr++ = *rd++;
+				}
+			}
+			while (*rd != '\0' && *rd != ',')
+				++rd;
+		} else {
+			while (*rd != '\0' && *rd != ',' && *rd != '\r' &&
+			    *rd != '\n')
+				*wr++ = *rd++;
+			while (wr > field[n-1] && (wr[-1] == ' ' || wr[-1] == '\t'))
+				--wr;
+		}
+		if (*rd != ',') {
+			*wr = '\0';
+			break;
+		}
+		++rd;
+		*wr = '\0';
+	}
+	return n;
+}
+
+static struct country *country_get(const char *code, const char *name)
+{
+	unsigned int cc;
+	struct country *c;
+
+	if (strlen(code) != 2 || !isalnum(code[0]) || !isalnum(code[1]))
+		return NULL;
+	cc = toupper(code[0]) << 8 | toupper(code[1]);
+	c  = country[cc];
+	if (c != NULL)
+		return c;
+	c = xrealloc(NULL, sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->code[0] = toupper(code[0]);
+	c->code[1] = toupper(code[1]);
+	c->name    = strdup(name);
+	if (c->name == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	country[cc] = c;
+	return c;
+}
+
+static bool parse_ip6(const char *s, uint64_t *hi, uint64_t *lo)
+{
+	struct in6_addr a;
+	unsigned int i;
+
+	if (inet_pton(AF_INET6, s, &a) <= 0)
+		return false;
+	*hi = *lo = 0;
+	for (i = 0; i < 8; ++i)
+		*hi = *hi << 8 | a.s6_addr[i];
+	for (; i < 16; ++i)
+		*lo = *lo << 8 | a.s6_addr[i];
+	return true;
+}
+
+/* Rows are begin, end, begin as integer, end as integer, code, name */
+static bool collect_row(char *line, unsigned long lineno)
+{
+	struct country *c;
+	char *field[6];
+	char *end;
+	unsigned long b4, e4;
+	struct range6 r6;
+
+	if (csv_split(line, field, 6) < 6)
+		goto bad;
+	c = country_get(field[4], field[5]);
+	if (c == NULL)
+		goto bad;
+
+	if (strchr(field[0], ':') != NULL) {
+		if (!parse_ip6(field[0], &r6.begin_hi, &r6.begin_lo) ||
+		    !parse_ip6(field[1], &r6.end_hi, &r6.end_lo))
+			goto bad;
+		if (c->n6 == c->alloc6) {
+			c->alloc6 = c->alloc6 * 2 + 64;
+			c->v6 = xrealloc(c->v6, c->alloc6 * sizeof(*c->v6));
+		}
+		c->v6[c->n6++] = r6;
+		++c->rows6;
+		return true;
+	}
+
+	errno = 0;
+	b4 = strtoul(field[2], &end, 10);
+	if (*end != '\0' || errno != 0 || b4 > UINT32_MAX)
+		goto bad;
+	e4 = strtoul(field[3], &end, 10);
+	if (*end != '\0' || errno != 0 || e4 > UINT32_MAX)
+		goto bad;
+	if (c->n4 == c->alloc4) {
+		c->alloc4 = c->alloc4 * 2 + 256;
+		c->v4 = xrealloc(c->v4, c->alloc4 * sizeof(*c->v4));
+	}
+	c->v4[c->n4].begin = b4;
+	c->v4[c->n4].end   = e4;
+	++c->n4;
+	++c->rows4;
+	return true;
+
+ bad:
+	fprintf(stderr, "Line %lu: cannot parse row, skipping\n", lineno);
+	return false;
+}
+
+static unsigned long collect(FILE *fp, unsigned long rows)
+{
+	char *line = NULL;
+	size_t size = 0;
+
+	while (getline(&line, &size, fp) >= 0) {
+		if (*line == '\n' || *line == '\0')
+			continue;
+		collect_row(line, ++rows);
+		if (rows % 65536 == 0)
+			fprintf(stderr, "\r\e[2K%lu entries", rows);
+	}
+	free(line);
+	return rows;
+}
+
+/*
+ * LSD radix sort of @n ranges by begin address, a byte at a time, using
+ * @tmp as second buffer. Passes in which all keys have the same byte are
+ * skipped; for IPv6, where only the upper part of addresses varies, that
+ * does away with most of them. Returns the buffer holding the result.
+ */
+static struct range4 *radix_sort4(struct range4 *r, struct range4 *tmp,
+    size_t n)
+{
+	size_t count[256], i, sum;
+	unsigned int shift, d;
+	struct range4 *t;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; ++i)
+			++count[(r[i].begin >> shift) & 0xFF];
+		if (count[(r[0].begin >> shift) & 0xFF] == n)
+			continue;
+		for (d = 0, sum = 0; d < 256; ++d) {
+			i = count[d];
+			count[d] = sum;
+			sum += i;
+		}
+		for (i = 0; i < n; ++i)
+			tmp[count[(r[i].begin >> shift) & 0xFF]++] = r[i];
+		t = r; r = tmp; tmp = t;
+	}
+	return r;
+}
+
+static inline unsigned int key6(const struct range6 *r, unsigned int shift)
+{
+	return ((shift < 64) ? r->begin_lo >> shift :
+	       r->begin_hi >> (shift - 64)) & 0xFF;
+}
+
+static struct range6 *radix_sort6(struct range6 *r, struct range6 *tmp,
+    size_t n)
+{
+	size_t count[256], i, sum;
+	unsigned int shift, d;
+	struct range6 *t;
+
+	for (shift = 0; shift < 128; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; ++i)
+			++count[key6(&r[i], shift)];
+		if (count[key6(&r[0], shift)] == n)
+			continue;
+		for (d = 0, sum = 0; d < 256; ++d) {
+			i = count[d];
+			count[d] = sum;
+			sum += i;
+		}
+		for (i = 0; i < n; ++i)
+			tmp[count[key6(&r[i], shift)]++] = r[i];
+		t = r; r = tmp; tmp = t;
+	}
+	return r;
+}
+
+/* Coalesce overlapping and adjacent ranges of sorted @r in place */
+static size_t merge4(struct range4 *r, size_t n)
+{
+	size_t i, k = 0;
+
+	for (i = 1; i < n; ++i) {
+		if (r[k].end == UINT32_MAX || r[i].begin <= r[k].end + 1) {
+			if (r[i].end > r[k].end)
+				r[k].end = r[i].end;
+			continue;
+		}
+		r[++k] = r[i];
+	}
+	return (n == 0) ? 0 : k + 1;
+}
+
+static inline bool le6(uint64_t ahi, uint64_t alo, uint64_t bhi, uint64_t blo)
+{
+	return ahi < bhi || (ahi == bhi && alo <= blo);
+}
+
+static size_t merge6(struct range6 *r, size_t n)
+{
+	uint64_t hi, lo;
+	size_t i, k = 0;
+
+	for (i = 1; i < n; ++i) {
+		/* one past the end of the current range, 0 if that wraps */
+		lo = r[k].end_lo + 1;
+		hi = r[k].end_hi + (lo == 0);
+		if ((hi == 0 && lo == 0) ||
+		    le6(r[i].begin_hi, r[i].begin_lo, hi, lo)) {
+			if (!le6(r[i].end_hi, r[i].end_lo,
+			    r[k].end_hi, r[k].end_lo)) {
+				r[k].end_hi = r[i].end_hi;
+				r[k].end_lo = r[i].end_lo;
+			}
+			continue;
+		}
+		r[++k] = r[i];
+	}
+	return (n == 0) ? 0 : k + 1;
+}
+
+static void sort_country(struct country *c)
+{
+	void *tmp, *res;
+
+	if (c->n4 > 0) {
+		tmp = xrealloc(NULL, c->n4 * sizeof(*c->v4));
+		res = radix_sort4(c->v4, tmp, c->n4);
+		free((res == tmp) ? (void *)c->v4 : tmp);
+		c->v4 = res;
+		c->n4 = merge4(c->v4, c->n4);
+	}
+	if (c->n6 > 0) {
+		tmp = xrealloc(NULL, c->n6 * sizeof(*c->v6));
+		res = radix_sort6(c->v6, tmp, c->n6);
+		free((res == tmp) ? (void *)c->v6 : tmp);
+		c->v6 = res;
+		c->n6 = merge6(c->v6, c->n6);
+	}
+}
+
+/* Workers take countries off the table until none are left */
+static void *sort_worker(void *arg)
+{
+	unsigned int cc;
+
+	for (;;) {
+		pthread_mutex_lock(&next_lock);
+		while (next_cc < ARRAY_SIZE(country) && country[next_cc] == NULL)
+			++next_cc;
+		cc = next_cc++;
+		pthread_mutex_unlock(&next_lock);
+		if (cc >= ARRAY_SIZE(country))
+			break;
+		sort_country(country[cc]);
+	}
+	return NULL;
+}
+
+static void sort_all(void)
+{
+	pthread_t *tid;
+	unsigned int i;
+	int ret;
+
+	tid = xrealloc(NULL, nr_threads * sizeof(*tid));
+	for (i = 0; i < nr_threads; ++i) {
+		ret = pthread_create(&tid[i], NULL, sort_worker, NULL);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nr_threads; ++i)
+		pthread_join(tid[i], NULL);
+	free(tid);
+}
+
+/* Output buffer for one file, with values stored in the chosen order */
+struct obuf {
+	unsigned char *data;
+	size_t len, alloc;
+	bool be;
+};
+
+static void put(struct obuf *b, uint64_t v, unsigned int bytes)
+{
+	unsigned int i;
+
+	if (b->len + bytes > b->alloc) {
+		b->alloc = b->alloc * 2 + 4096;
+		b->data  = xrealloc(b->data, b->alloc);
+	}
+	for (i = 0; i < bytes; ++i)
+		b->data[b->len + i] = b->be ?
+			v >> (8 * (bytes - 1 - i)) : v >> (8 * i);
+	b->len += bytes;
+}
+
+static uint32_t get32(const struct obuf *b, size_t off)
+{
+	const unsigned char *p = &b->data[off];
+
+	if (b->be)
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* IPv6 addresses are stored as four 32-bit words, most significant first */
+static void put6(struct obuf *b, uint64_t hi, uint64_t lo)
+{
+	put(b, hi >> 32, 4);
+	put(b, hi, 4);
+	put(b, lo >> 32, 4);
+	put(b, lo, 4);
+}
+
+static void put_ranges(struct obuf *b, const struct country *c, bool v6)
+{
+	size_t i;
+
+	if (v6)
+		for (i = 0; i < c->n6; ++i) {
+			put6(b, c->v6[i].begin_hi, c->v6[i].begin_lo);
+			put6(b, c->v6[i].end_hi, c->v6[i].end_lo);
+		}
+	else
+		for (i = 0; i < c->n4; ++i) {
+			put(b, c->v4[i].begin, 4);
+			put(b, c->v4[i].end, 4);
+		}
+}
+
+static void put_record(struct obuf *b, unsigned int cc,
+    const struct country *c, bool v6)
+{
+	put(b, cc, 2);
+	put(b, v6 ? NFPROTO_IPV6 : NFPROTO_IPV4, 1);
+	put(b, 0, 1);
+	put(b, v6 ? c->n6 : c->n4, 4);
+}
+
+static void write_file(const char *order, const char *name,
+    const struct obuf *b)
+{
+	char path[4096];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", target_dir, order, name);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (fwrite(b->data, 1, b->len, fp) != b->len || fclose(fp) != 0) {
+		fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void dump_one(const struct country *c, bool be)
+{
+	struct obuf b = {.be = be};
+	char name[8];
+
+	snprintf(name, sizeof(name), "%s.iv6", c->code);
+	put_ranges(&b, c, true);
+	write_file(be ? "BE" : "LE", name, &b);
+	b.len = 0;
+	snprintf(name, sizeof(name), "%s.iv4", c->code);
+	put_ranges(&b, c, false);
+	write_file(be ? "BE" : "LE", name, &b);
+	free(b.data);
+}
+
+/* See extensions/xt_geoip_db.h for the layout */
+static void dump_db(bool be)
+{
+	struct obuf b = {.be = be};
+	unsigned int cc, nent = 0, v6;
+	size_t off, size;
+	uint32_t sum = 0;
+
+	for (cc = 0; cc < ARRAY_SIZE(country); ++cc)
+		if (country[cc] != NULL)
+			nent += 2;
+
+	/* Header, filled in once the size and checksum are known */
+	put(&b, 0, sizeof(struct geoip_db_header));
+	off = b.len + nent * sizeof(struct geoip_db_entry);
+	for (cc = 0; cc < ARRAY_SIZE(country); ++cc) {
+		const struct country *c = country[cc];
+
+		if (c == NULL)
+			continue;
+		/* NFPROTO_IPV4 sorts before NFPROTO_IPV6 */
+		for (v6 = 0; v6 < 2; ++v6) {
+			put_record(&b, cc, c, v6);
+			put(&b, off, 8);
+			off += sizeof(struct geoip_db_record) +
+			       (v6 ? c->n6 * sizeof(struct geoip_subnet6) :
+			       c->n4 * sizeof(struct geoip_subnet4));
+		}
+	}
+	for (cc = 0; cc < ARRAY_SIZE(country); ++cc) {
+		const struct country *c = country[cc];
+
+		if (c == NULL)
+			continue;
+		for (v6 = 0; v6 < 2; ++v6) {
+			put_record(&b, cc, c, v6);
+			put_ranges(&b, c, v6);
+		}
+	}
+
+	for (off = sizeof(struct geoip_db_header); off < b.len; off += 4)
+		sum += get32(&b, off);
+	size  = b.len;
+	memcpy(b.data, XT_GEOIP_DB_MAGIC, sizeof(XT_GEOIP_DB_MAGIC));
+	b.len = offsetof(struct geoip_db_header, version);
+	put(&b, XT_GEOIP_DB_VERSION, 4);
+	put(&b, nent, 4);
+	put(&b, size, 8);
+	put(&b, sum, 4);
+	b.len = size;
+	write_file(be ? "BE" : "LE", XT_GEOIP_DB_FILE, &b);
+	free(b.data);
+}
+
+static void dump(void)
+{
+	const struct country *c;
+	unsigned int cc;
+
+	for (cc = 0; cc < ARRAY_SIZE(country); ++cc) {
+		c = country[cc];
+		if (c == NULL)
+			continue;
+		printf("%5zu IPv6 ranges for %s %s (from %zu rows)\n",
+		       c->n6, c->code, c->name, c->rows6);
+		printf("%5zu IPv4 ranges for %s %s (from %zu rows)\n",
+		       c->n4, c->code, c->name, c->rows4);
+		dump_one(c, false);
+		dump_one(c, true);
+	}
+	dump_db(false);
+	dump_db(true);
+}
+
+static void make_dir(const char *order)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", target_dir, order);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not mkdir %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr, "Usage: %s [-D target_dir] [-j threads] [file...]\n", p);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rows = 0;
+	struct stat sb;
+	double start;
+	FILE *fp;
+	long n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "D:j:")) != -1) {
+		switch (opt) {
+		case 'D':
+			target_dir = optarg;
+			break;
+		case 'j':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if (nr_threads == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = (n > 0) ? n : 1;
+	}
+
+	if (stat(target_dir, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+		fprintf(stderr, "Target directory %s does not exist.\n",
+		        target_dir);
+		return EXIT_FAILURE;
+	}
+	make_dir("LE");
+	make_dir("BE");
+
+	start = now();
+	if (optind == argc)
+		rows = collect(stdin, rows);
+	for (; optind < argc; ++optind) {
+		fp = fopen(argv[optind], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Could not open %s: %s\n",
+			        argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		rows = collect(fp, rows);
+		fclose(fp);
+	}
+	sort_all();
+	fprintf(stderr, "\r\e[2K%lu entries total, %.0f rows/s\n",
+	        rows, rows / (now() - start));
+	dump();
+	return EXIT_SUCCESS;
+}
@@ -65,10 +65,62 @@ sub collect
 sub dump
 {
 	my $country = shift @_;
+	my @entries;
 
 	foreach my $iso_code (sort keys %$country) {
 		&dump_one($iso_code, $country->{$iso_code});
+		# NFPROTO_IPV4 sorts before NFPROTO_IPV6
+		push(@entries,
+		     [$iso_code, 2, $country->{$iso_code}->{pool_v4}],
+		     [$iso_code, 10, $country->{$iso_code}->{pool_v6}]);
 	}
+	&dump_db("LE", \@entries);
+	&dump_db("BE", \@entries);
+}
+
+#
+# Write all countries into one xt_geoip.db container, see
+# extensions/xt_geoip_db.h for the layout.
+#
+sub dump_db
+{
+	my($order, $entries) = @_;
+	my $le = $order eq "LE";
+	my($table, $records) = ("", "");
+	my $offset = 32 + 16 * scalar(@$entries);
+	my($file, $fh);
+
+	foreach (@$entries) {
+		my($iso_code, $nfproto, $pool) = @$_;
+		my $cc = (ord(uc substr($iso_code, 0, 1)) << 8) |
+		         ord(uc substr($iso_code, 1, 1));
+		my $rec = pack($le ? "vCCV" : "nCCN", $cc, $nfproto, 0,
+		          scalar(@$pool));
+
+		foreach my $range (@$pool) {
+			if ($nfproto == 10) {
+				$rec .= $le ? &ip6_swap($range->[0]).&ip6_swap($range->[1]) :
+				        $range->[0].$range->[1];
+			} else {
+				$rec .= pack($le ? "VV" : "NN", @$range);
+			}
+		}
+		$table .= pack($le ? "vCCVQ<" : "nCCNQ>", $cc, $nfproto, 0,
+		          scalar(@$pool), $offset + length($records));
+		$records .= $rec;
+	}
+
+	my $body = $table.$records;
+	$file = "$target_dir/$order/xt_geoip.db";
+	if (!open($fh, "> $file")) {
+		print STDERR "Error opening $file: $!\n";
+		exit 1;
+	}
+	print $fh pack($le ? "a8VVQ<VV" : "a8NNQ>NN", "xtgeoip", 1,
+	               scalar(@$entries), 32 + length($body),
+	               unpack($le ? "%32V*" : "%32N*", $body), 0);
+	print $fh $body;
+	close $fh;
 }
 
 sub dump_one
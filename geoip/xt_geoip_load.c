@@ -0,0 +1,320 @@
+/*
+ *	Load GeoIP database files into the xt_geoip kernel module
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License; either
+ *	version 2 of the License, or any later version, as published by the
+ *	Free Software Foundation.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+#include <linux/types.h>
+#ifndef aligned_u64
+#	define aligned_u64 __u64 __attribute__((aligned(8)))
+#endif
+#include "xt_geoip.h"
+#include "xt_geoip_db.h"
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#	define GEOIP_ENDIAN "BE"
+#else
+#	define GEOIP_ENDIAN "LE"
+#endif
+
+static const char *db_dir = "/usr/share/xt_geoip";
+static const char *proc_file = "/proc/net/xt_geoip/database";
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+	const char *buf = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, buf, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf   += ret;
+		size  -= ret;
+	}
+	return true;
+}
+
+/**
+ * Send one country file. A missing file is not an error, since not every
+ * country has IPv6 ranges.
+ * @dir:	"%s/LE" or "%s/BE" database directory
+ * @code:	two-letter country code
+ * @nfproto:	%NFPROTO_IPV4 or %NFPROTO_IPV6
+ */
+static int load_file(int out, const char *dir, const char *code,
+    uint8_t nfproto)
+{
+	size_t esize = (nfproto == NFPROTO_IPV6) ?
+	               sizeof(struct geoip_subnet6) :
+	               sizeof(struct geoip_subnet4);
+	struct geoip_db_record rec;
+	char path[320];
+	struct stat sb;
+	void *subnets;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s.%s", dir, code,
+	         (nfproto == NFPROTO_IPV6) ? "iv6" : "iv4");
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size % esize != 0) {
+		fprintf(stderr, "%s seems to be corrupted\n", path);
+		close(fd);
+		return -1;
+	}
+
+	/* Read it whole, so that errors only ever happen between records */
+	subnets = malloc(sb.st_size + 1);
+	if (subnets == NULL) {
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+	if (read(fd, subnets, sb.st_size) != sb.st_size) {
+		fprintf(stderr, "Short read on %s\n", path);
+		free(subnets);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.cc      = toupper(code[0]) << 8 | toupper(code[1]);
+	rec.nfproto = nfproto;
+	rec.count   = sb.st_size / esize;
+	if (!write_all(out, &rec, sizeof(rec)) ||
+	    !write_all(out, subnets, sb.st_size)) {
+		fprintf(stderr, "Could not write %s to %s: %s\n",
+		        code, proc_file, strerror(errno));
+		free(subnets);
+		return -1;
+	}
+	free(subnets);
+	return 1;
+}
+
+static int load_country(int out, const char *dir, const char *code)
+{
+	int ret4, ret6;
+
+	if (strlen(code) != 2 || !isalnum(code[0]) || !isalnum(code[1])) {
+		fprintf(stderr, "Invalid country code \"%s\"\n", code);
+		return -1;
+	}
+	ret4 = load_file(out, dir, code, NFPROTO_IPV4);
+	if (ret4 < 0)
+		return -1;
+	ret6 = load_file(out, dir, code, NFPROTO_IPV6);
+	if (ret6 < 0)
+		return -1;
+	if (ret4 == 0 && ret6 == 0) {
+		fprintf(stderr, "No database files for %s in %s\n", code, dir);
+		return -1;
+	}
+	return 0;
+}
+
+/* Each country has an .iv4 file, so that is what we look for */
+static int load_all(int out, const char *dir)
+{
+	const struct dirent *de;
+	char code[3];
+	DIR *dh;
+	int ret = 0;
+
+	dh = opendir(dir);
+	if (dh == NULL) {
+		fprintf(stderr, "Could not open %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dh)) != NULL) {
+		if (strlen(de->d_name) != 6 || strcmp(de->d_name + 2, ".iv4") != 0)
+			continue;
+		code[0] = de->d_name[0];
+		code[1] = de->d_name[1];
+		code[2] = '\0';
+		ret = load_country(out, dir, code);
+		if (ret < 0)
+			break;
+	}
+	closedir(dh);
+	return ret;
+}
+
+/**
+ * Send countries out of a verified xt_geoip.db container, or all of them
+ * in one go if @ccs is empty.
+ */
+static int load_db(int out, const void *base, char **ccs, int nccs)
+{
+	const struct geoip_db_header *hdr = base;
+	const struct geoip_db_entry *ent[2];
+	size_t start = sizeof(*hdr) +
+	               hdr->count * sizeof(struct geoip_db_entry);
+	unsigned int cc, i, j;
+	int k;
+
+	if (nccs == 0) {
+		if (write_all(out, base + start, hdr->size - start))
+			return 0;
+		fprintf(stderr, "Could not write to %s: %s\n",
+		        proc_file, strerror(errno));
+		return -1;
+	}
+
+	for (k = 0; k < nccs; ++k) {
+		const char *code = ccs[k];
+
+		if (strlen(code) != 2 || !isalnum(code[0]) || !isalnum(code[1])) {
+			fprintf(stderr, "Invalid country code \"%s\"\n", code);
+			return -1;
+		}
+		cc = toupper(code[0]) << 8 | toupper(code[1]);
+		ent[0] = geoip_db_find(base, cc, NFPROTO_IPV4);
+		ent[1] = geoip_db_find(base, cc, NFPROTO_IPV6);
+		if (ent[0] == NULL && ent[1] == NULL) {
+			fprintf(stderr, "%s is not in the database\n", code);
+			return -1;
+		}
+		for (i = 0; i < 2; ++i) {
+			if (ent[i] == NULL)
+				continue;
+			j = sizeof(struct geoip_db_record) + ent[i]->count *
+			    geoip_db_range_size(ent[i]->nfproto);
+			if (!write_all(out, base + ent[i]->offset, j)) {
+				fprintf(stderr, "Could not write %s to %s: %s\n",
+				        code, proc_file, strerror(errno));
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Map @dir/xt_geoip.db; returns %MAP_FAILED with errno ENOENT if absent */
+static void *map_db(const char *dir, size_t *size)
+{
+	const char *err;
+	char path[320];
+	struct stat sb;
+	void *base;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" XT_GEOIP_DB_FILE, dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return MAP_FAILED;
+	if (fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Could not stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		errno = EIO;
+		return MAP_FAILED;
+	}
+	*size = sb.st_size;
+	base  = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+		errno = EIO;
+		return MAP_FAILED;
+	}
+	err = geoip_db_verify(base, *size);
+	if (err != NULL) {
+		fprintf(stderr, "%s: %s\n", path, err);
+		munmap(base, *size);
+		errno = EIO;
+		return MAP_FAILED;
+	}
+	madvise(base, *size, MADV_SEQUENTIAL);
+	return base;
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr, "Usage: %s [-D dbdir] [CC...]\n", p);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[256];
+	int fd, opt, ret = 0;
+	size_t db_size = 0;
+	void *db;
+
+	while ((opt = getopt(argc, argv, "D:")) != -1) {
+		switch (opt) {
+		case 'D':
+			db_dir = optarg;
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+
+	snprintf(dir, sizeof(dir), "%s/" GEOIP_ENDIAN, db_dir);
+	db = map_db(dir, &db_size);
+	if (db == MAP_FAILED && errno != ENOENT)
+		return EXIT_FAILURE;
+
+	fd = open(proc_file, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n"
+		        "Is the xt_geoip module loaded?\n",
+		        proc_file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Without a container, fall back to the per-country files */
+	if (db != MAP_FAILED)
+		ret = load_db(fd, db, &argv[optind], argc - optind);
+	else if (optind == argc)
+		ret = load_all(fd, dir);
+	else
+		for (; optind < argc && ret == 0; ++optind)
+			ret = load_country(fd, dir, argv[optind]);
+
+	/*
+	 * The kernel takes over the countries when the file is closed after
+	 * whole records, and close() fails if it cannot. On error, send an
+	 * invalid record so that it discards them all instead.
+	 */
+	if (ret < 0) {
+		struct geoip_db_record bad;
+
+		memset(&bad, 0, sizeof(bad));
+		write_all(fd, &bad, sizeof(bad));
+	}
+	if (close(fd) < 0 && ret == 0) {
+		fprintf(stderr, "Could not load database: %s\n", strerror(errno));
+		ret = -1;
+	}
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}